@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/bcm.h>
+
+#include "canbcm.hpp"
+#include "debugmsg.hpp"
+
+namespace carla
+{
+
+/*
+ * open a broadcast manager socket on the interface
+ */
+int bcm_open(int ifindex)
+{
+	struct sockaddr_can addr;
+	int s = socket(PF_CAN, SOCK_DGRAM, CAN_BCM);
+	if(s < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "open bcm socket failed: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifindex;
+	if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "connect bcm socket failed: %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static int bcm_write(int s, uint32_t opcode, uint32_t flags, uint32_t period_usec, const struct can_data_t *dat)
+{
+	/* head followed by one frame, classic frames use the can_frame prefix */
+	alignas(struct bcm_msg_head) uint8_t msg[sizeof(struct bcm_msg_head) + sizeof(struct canfd_frame)];
+	struct bcm_msg_head head;
+	size_t frame_size = sizeof(struct can_frame);
+
+	memset(&head, 0, sizeof(head));
+	head.opcode = opcode;
+	head.flags = flags;
+	head.can_id = dat->frame.can_id;
+	head.nframes = 1;
+	head.ival2.tv_sec = (long)(period_usec / 1000000U);
+	head.ival2.tv_usec = (long)(period_usec % 1000000U);
+	if(dat->mtu == CANFD_MTU)
+	{
+		head.flags |= CAN_FD_FRAME;
+		frame_size = sizeof(struct canfd_frame);
+	}
+	memcpy(msg, &head, sizeof(head));
+	memcpy(msg + sizeof(head), &dat->frame, frame_size);
+
+	ssize_t len = (ssize_t)(sizeof(head) + frame_size);
+	if(write(s, msg, (size_t)len) != len)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * start the kernel timer of every cyclic slot of a bus with its current payload,
+ * CAN FD slots are left out on a classic CAN interface
+ */
+int bcm_setup_cycles(int s, int bus, bool fd)
+{
+	unsigned int cyclic = 0;
+
+	for(unsigned int i = 0; i < can_slot_count(); i++)
+	{
+		struct can_data_t dat;
+		uint32_t period_usec = can_slot_cycle_usec((int)i);
+		if(period_usec == 0 || can_slot_bus((int)i) != bus || peek_can_slot((int)i, &dat) < 0)
+		{
+			continue;
+		}
+		if(dat.mtu == CANFD_MTU && !fd)
+		{
+			DBG_ERROR(LOG_PREFIX, "bcm: %X is CAN FD, the interface is not", dat.frame.can_id);
+			continue;
+		}
+
+		if(bcm_write(s, TX_SETUP, SETTIMER | STARTTIMER, period_usec, &dat) < 0)
+		{
+			DBG_ERROR(LOG_PREFIX, "bcm setup of %X failed: %s", dat.frame.can_id, strerror(errno));
+			return -1;
+		}
+		cyclic++;
+	}
+
+	DBG_INFO(LOG_PREFIX, "bcm: %u cyclic ids handed to the kernel", cyclic);
+	return 0;
+}
+
+/*
+ * send an update, a cyclic id keeps its timer and only changes its payload
+ */
+int bcm_update(int s, const struct can_data_t *dat)
+{
+	if(can_slot_cycle_usec(dat->slot) != 0)
+	{
+		return bcm_write(s, TX_SETUP, TX_ANNOUNCE, 0, dat);
+	}
+	return bcm_write(s, TX_SEND, 0, 0, dat);
+}
+
+} // namespace carla
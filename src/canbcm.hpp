@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_CAN_BCM_HPP
+#define TMCAGL_CAN_BCM_HPP
+
+#include "canencoder.hpp"
+
+namespace carla
+{
+
+/*
+ * transmission through the SocketCAN broadcast manager. cyclic slots are
+ * handed to the kernel once, which then sends them on its own timer;
+ * updates replace the payload in place and are sent at once.
+ */
+extern int bcm_open(int ifindex);
+extern int bcm_setup_cycles(int s, int bus, bool fd);
+extern int bcm_update(int s, const struct can_data_t *dat);
+
+} // namespace carla
+
+#endif  // !TMCAGL_CAN_BCM_HPP
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+
+#include "canbusload.hpp"
+
+namespace carla
+{
+
+#define CAN_CRC15_POLY	0x4599
+#define CAN_STUFF_RUN	5
+#define CAN_FRAME_TAIL_BITS	13	/* crc delimiter, ack, ack delimiter, eof, intermission */
+#define CANFD_CRC17_FIELD_BITS	27	/* stuff count, crc and the fixed stuff bits */
+#define CANFD_CRC21_FIELD_BITS	32
+
+/*
+ * counts the bits of a frame on the wire, with the stuff bits inserted
+ * after five equal bits, per bit rate phase
+ */
+struct bit_counter_t
+{
+	unsigned int bits[2];	/* arbitration phase, data phase */
+	unsigned int phase;
+	int last;
+	unsigned int run;
+	bool crc_on;
+	uint16_t crc;
+};
+
+static inline void put_bit(struct bit_counter_t *c, int bit)
+{
+	c->bits[c->phase]++;
+	if (c->crc_on)
+	{
+		int crc_nxt = bit ^ ((c->crc >> 14) & 1);
+		c->crc = (uint16_t)((c->crc << 1) & 0x7FFF);
+		if (crc_nxt)
+		{
+			c->crc ^= CAN_CRC15_POLY;
+		}
+	}
+
+	if (bit != c->last)
+	{
+		c->last = bit;
+		c->run = 1;
+	}
+	else if (++c->run == CAN_STUFF_RUN)
+	{
+		/* stuff bit of the opposite level, it starts the next run */
+		c->bits[c->phase]++;
+		c->last = !bit;
+		c->run = 1;
+	}
+}
+
+static inline void put_bits(struct bit_counter_t *c, uint32_t val, unsigned int n)
+{
+	while (n-- > 0)
+	{
+		put_bit(c, (int)((val >> n) & 1));
+	}
+}
+
+/*
+ * length of a frame on the bus including the stuff bits of its actual
+ * content, the intermission is counted too. *data_bits gets the part
+ * sent at the data bit rate of a CAN FD frame with BRS.
+ */
+unsigned int can_frame_bits(const struct canfd_frame *cf, int mtu, unsigned int *data_bits)
+{
+	struct bit_counter_t c;
+	bool fd = (mtu == CANFD_MTU);
+	bool eff = (cf->can_id & CAN_EFF_FLAG) != 0;
+	bool rtr = !fd && (cf->can_id & CAN_RTR_FLAG) != 0;
+	unsigned int len = fd ? can_dlc2len(can_len2dlc(cf->len)) : ((cf->len > CAN_MAX_DLEN) ? CAN_MAX_DLEN : cf->len);
+
+	memset(&c, 0, sizeof(c));
+	c.last = -1;
+	c.crc_on = !fd;
+
+	put_bit(&c, 0);		/* start of frame */
+	if (eff)
+	{
+		uint32_t id = cf->can_id & CAN_EFF_MASK;
+		put_bits(&c, id >> 18, 11);
+		put_bit(&c, 1);	/* srr */
+		put_bit(&c, 1);	/* ide */
+		put_bits(&c, id & 0x3FFFF, 18);
+		put_bit(&c, rtr);	/* rtr, rrs for CAN FD */
+	}
+	else
+	{
+		put_bits(&c, cf->can_id & CAN_SFF_MASK, 11);
+		put_bit(&c, rtr);	/* rtr, rrs for CAN FD */
+		put_bit(&c, 0);	/* ide */
+	}
+
+	if (fd)
+	{
+		put_bit(&c, 1);	/* fdf */
+		put_bit(&c, 0);	/* res */
+		put_bit(&c, (cf->flags & CANFD_BRS) ? 1 : 0);
+		if (cf->flags & CANFD_BRS)
+		{
+			c.phase = 1;
+		}
+		put_bit(&c, 0);	/* esi */
+		put_bits(&c, can_len2dlc((unsigned char)len), 4);
+	}
+	else
+	{
+		if (eff)
+		{
+			put_bit(&c, 0);	/* r1 */
+		}
+		put_bit(&c, 0);	/* r0 */
+		put_bits(&c, len, 4);
+	}
+
+	if (!rtr)
+	{
+		for (unsigned int i = 0; i < len; i++)
+		{
+			put_bits(&c, cf->data[i], 8);
+		}
+	}
+
+	if (fd)
+	{
+		/* the crc field of CAN FD has fixed stuff bits, its value does not matter */
+		c.bits[c.phase] += (len > 16) ? CANFD_CRC21_FIELD_BITS : CANFD_CRC17_FIELD_BITS;
+	}
+	else
+	{
+		c.crc_on = false;
+		put_bits(&c, c.crc, 15);
+	}
+
+	if (data_bits != NULL)
+	{
+		*data_bits = c.bits[1];
+	}
+	return c.bits[0] + CAN_FRAME_TAIL_BITS;
+}
+
+void bus_load_init(struct can_bus_load_t *load, uint32_t bitrate, uint32_t data_bitrate, uint64_t now)
+{
+	memset(load, 0, sizeof(*load));
+	load->bitrate = (bitrate != 0) ? bitrate : BUS_BITRATE_DEFAULT;
+	load->data_bitrate = (data_bitrate != 0) ? data_bitrate : load->bitrate;
+	load->bucket_start_usec = now;
+}
+
+/*
+ * time a frame occupies the bus
+ */
+uint64_t bus_load_frame_ns(const struct can_bus_load_t *load, const struct canfd_frame *cf, int mtu)
+{
+	unsigned int data_bits = 0;
+	unsigned int bits = can_frame_bits(cf, mtu, &data_bits);
+
+	return (uint64_t)bits * 1000000000ULL / load->bitrate
+		+ (uint64_t)data_bits * 1000000000ULL / load->data_bitrate;
+}
+
+/*
+ * move the window to now, the buckets that passed are emptied
+ */
+static void advance(struct can_bus_load_t *load, uint64_t now)
+{
+	if (now < load->bucket_start_usec + BUS_LOAD_BUCKET_USEC)
+	{
+		return;
+	}
+
+	uint64_t steps = (now - load->bucket_start_usec) / BUS_LOAD_BUCKET_USEC;
+	load->bucket_start_usec += steps * BUS_LOAD_BUCKET_USEC;
+
+	/* the window just completed is a candidate for the peak */
+	unsigned int permille = (unsigned int)((load->window_ns + load->standing_ns) / (BUS_LOAD_WINDOW_USEC));
+	if (permille > load->peak_permille)
+	{
+		load->peak_permille = permille;
+	}
+
+	if (steps >= BUS_LOAD_BUCKETS)
+	{
+		memset(load->busy_ns, 0, sizeof(load->busy_ns));
+		load->window_ns = 0;
+		return;
+	}
+	while (steps-- > 0)
+	{
+		load->pos = (load->pos + 1) % BUS_LOAD_BUCKETS;
+		load->window_ns -= load->busy_ns[load->pos];
+		load->busy_ns[load->pos] = 0;
+	}
+}
+
+void bus_load_add(struct can_bus_load_t *load, uint64_t now, uint64_t busy_ns)
+{
+	advance(load, now);
+	load->busy_ns[load->pos] += busy_ns;
+	load->window_ns += busy_ns;
+	load->total_ns += busy_ns;
+}
+
+/*
+ * account a frame the kernel repeats every period_usec (CAN_BCM), it is
+ * part of every window without being added as it is sent
+ */
+void bus_load_add_cycle(struct can_bus_load_t *load, const struct canfd_frame *cf, int mtu, uint32_t period_usec)
+{
+	if (period_usec != 0)
+	{
+		load->standing_ns += bus_load_frame_ns(load, cf, mtu) * BUS_LOAD_WINDOW_USEC / period_usec;
+	}
+}
+
+/*
+ * utilization of the last window in 1/1000 of the bus capacity
+ */
+unsigned int bus_load_permille(struct can_bus_load_t *load, uint64_t now)
+{
+	advance(load, now);
+	/* ns per usec of window times 1000 cancel out */
+	return (unsigned int)((load->window_ns + load->standing_ns) / BUS_LOAD_WINDOW_USEC);
+}
+
+} // namespace carla
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TMCAGL_CAN_BUS_LOAD_HPP
+#define TMCAGL_CAN_BUS_LOAD_HPP
+
+#include <stdint.h>
+#include <linux/can.h>
+
+#include "canencoder.hpp"
+
+namespace carla
+{
+
+#define BUS_LOAD_BUCKETS	20
+#define BUS_LOAD_BUCKET_USEC	50000ULL	/* 1 s window */
+#define BUS_LOAD_WINDOW_USEC	(BUS_LOAD_BUCKETS * BUS_LOAD_BUCKET_USEC)
+#define BUS_BITRATE_DEFAULT	500000
+
+/*
+ * utilization of one bus over a sliding window, estimated from the frames
+ * sent. the window is kept in buckets, so adding a frame and reading the
+ * load are O(1) apart from skipping buckets that have passed.
+ */
+struct can_bus_load_t
+{
+	uint32_t bitrate;		/* arbitration phase, bit/s */
+	uint32_t data_bitrate;		/* CAN FD data phase with BRS, bit/s */
+	uint64_t bucket_start_usec;	/* start of the current bucket */
+	unsigned int pos;		/* current bucket */
+	uint64_t busy_ns[BUS_LOAD_BUCKETS];
+	uint64_t window_ns;		/* sum of busy_ns */
+	uint64_t standing_ns;		/* per window, frames sent by the kernel on its own */
+	uint64_t total_ns;
+	unsigned int peak_permille;	/* highest load of a full window */
+};
+
+extern void bus_load_init(struct can_bus_load_t *load, uint32_t bitrate, uint32_t data_bitrate, uint64_t now);
+extern unsigned int can_frame_bits(const struct canfd_frame *cf, int mtu, unsigned int *data_bits);
+extern uint64_t bus_load_frame_ns(const struct can_bus_load_t *load, const struct canfd_frame *cf, int mtu);
+extern void bus_load_add(struct can_bus_load_t *load, uint64_t now, uint64_t busy_ns);
+extern void bus_load_add_cycle(struct can_bus_load_t *load, const struct canfd_frame *cf, int mtu, uint32_t period_usec);
+extern unsigned int bus_load_permille(struct can_bus_load_t *load, uint64_t now);
+
+} // namespace carla
+
+#endif  // !TMCAGL_CAN_BUS_LOAD_HPP
@@ -18,13 +18,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <math.h>
 #include <errno.h>
 #include <linux/can.h>
 #include <linux/can/error.h>
-#include <pthread.h>
-#include <search.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <atomic>
+#include <limits>
+#include <new>
 
 #include "canencoder.hpp"
+#include "latency.hpp"
 #include "debugmsg.hpp"
 
 namespace carla
@@ -33,13 +39,171 @@ namespace carla
 #define CANID_DELIM '#'
 #define DATA_SEPERATOR '.'
 #define ENABLE1_TYPENAME "ENABLE-1"	/* spec. type1.json original type name */
+#define CACHE_LINE_SIZE 64
+#define MAX_CAN_SLOTS (1U << 15)	/* slot indexes are stored as int16_t */
+#define CAN_BITMAP_SUMMARY (MAX_CAN_SLOTS / 64 / 64)
+#define CYCLE_REPORT_INTERVAL_USEC (10 * 1000 * 1000ULL)
 
-static struct can_data_t *phead = NULL, *ptail = NULL;
-static pthread_mutex_t lock;
-static char buf[MAX_CANDATA_SIZE+1] = {0};
-static char str[MAX_LENGTH+1] = {0};
-static void *canmsg_root = NULL;
+/*
+ * last value of one can id. the payload is guarded by a seqlock, dirty
+ * tells whether the slot is already marked in the pending bitmap.
+ */
+struct can_slot_t
+{
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> seq;
+	std::atomic<bool> dirty;
+	canid_t can_id;
+	uint8_t bus;
+	uint8_t len;
+	uint8_t flags;		/* canfd_frame flags */
+	int mtu;		/* CAN_MTU or CANFD_MTU */
+	uint8_t prio;		/* can_prio_t */
+	uint16_t rank;		/* transmit order on its bus, see order_can_slots() */
+	uint64_t enqueue_usec;	/* time of the first update not yet sent */
+	uint8_t data[CANFD_MAX_DLEN];
+	uint8_t image[CANFD_MAX_DLEN];	/* accumulated signals, producer side only */
+};
+
+/*
+ * set of slot ranks, a bit per rank and a summary bit per word of 64
+ * ranks. bits are set by the producer and cleared by the consumer only,
+ * so the lowest rank is found with two count-trailing-zeros and nothing
+ * is ever allocated on the way.
+ */
+struct can_bitmap_t
+{
+	std::atomic<uint64_t> summary[CAN_BITMAP_SUMMARY];
+	std::atomic<uint64_t> *words;
+	unsigned int word_cnt;
+};
+
+/*
+ * single producer (updateValue) / single consumer (transmission loop)
+ * pending set of a bus, served in rank order
+ */
+struct can_pending_t
+{
+	alignas(CACHE_LINE_SIZE) struct can_bitmap_t bitmap;
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> depth;
+	std::atomic<uint64_t> popped;
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> pushed;
+	std::atomic<uint64_t> coalesced;
+};
+
+/*
+ * cyclic transmission of one slot, consumer side only.
+ * deadlines follow a fixed timeline, an event triggered send of a slot
+ * that is due also serves its deadline. a deadline is served when its
+ * frame is written, not when it is taken from the queue.
+ */
+struct can_cycle_t
+{
+	uint32_t period_usec;	/* 0: sent on change only */
+	uint64_t next_usec;	/* next deadline */
+	uint64_t due_usec;	/* deadline waiting for transmission, 0 if none */
+	uint64_t sent;
+	uint64_t missed;	/* deadlines skipped because the loop was late, or not written */
+	uint64_t jitter_sum_usec;
+	uint64_t jitter_max_usec;
+};
+
+/*
+ * transmit queue of one bus
+ */
+struct can_queue_t
+{
+	struct can_pending_t pending;
+	int eventfd;
+	unsigned int slots;	/* slots routed to this bus */
+	uint16_t *rank_slot;	/* slot of each rank */
+	struct can_bitmap_t due;	/* cyclic slots waiting for transmission, consumer side */
+};
 
+static struct can_slot_t *can_slots = NULL;
+static unsigned int can_slot_cnt = 0;
+static unsigned int can_slot_max = 0;
+
+/* can id to slot index: dense for 11 bit ids, open addressing for 29 bit ids */
+static int16_t sff_slot_map[CAN_BUS_MAX][CAN_SFF_MASK + 1];
+static canid_t *eff_slot_keys = NULL;
+static uint8_t *eff_slot_bus = NULL;
+static int16_t *eff_slot_vals = NULL;
+static_assert(MAX_CAN_SLOTS - 1 <= (unsigned int)std::numeric_limits<int16_t>::max(),
+	"every slot index must fit the id maps, -1 marks a free entry");
+static uint32_t eff_slot_mask = 0;
+static struct can_queue_t tx_queue[CAN_BUS_MAX];
+static struct can_cycle_t *can_cycles = NULL;
+static int tx_timerfd = -1;
+static uint64_t cycle_report_usec = 0;
+
+static int bitmap_init(struct can_bitmap_t *bm, unsigned int bits)
+{
+	bm->word_cnt = (bits + 63) / 64;
+	bm->words = new (std::nothrow) std::atomic<uint64_t>[bm->word_cnt];
+	if (bm->words == NULL)
+	{
+		return -1;
+	}
+	for (unsigned int i = 0; i < bm->word_cnt; i++)
+	{
+		bm->words[i].store(0, std::memory_order_relaxed);
+	}
+	for (unsigned int i = 0; i < CAN_BITMAP_SUMMARY; i++)
+	{
+		bm->summary[i].store(0, std::memory_order_relaxed);
+	}
+	return 0;
+}
+
+/*
+ * mark a rank, the word bit is set before the summary bit so that the
+ * consumer never sees a summary bit without its word
+ */
+static inline void bitmap_set(struct can_bitmap_t *bm, unsigned int rank)
+{
+	unsigned int w = rank / 64;
+	bm->words[w].fetch_or(1ULL << (rank % 64), std::memory_order_release);
+	bm->summary[w / 64].fetch_or(1ULL << (w % 64), std::memory_order_release);
+}
+
+static inline void bitmap_clear(struct can_bitmap_t *bm, unsigned int rank)
+{
+	bm->words[rank / 64].fetch_and(~(1ULL << (rank % 64)), std::memory_order_acq_rel);
+}
+
+/*
+ * lowest marked rank or -1, consumer side only. summary bits of words
+ * emptied by bitmap_clear() are dropped here; a word marked again in the
+ * meantime gets its summary bit back.
+ */
+static int bitmap_first(struct can_bitmap_t *bm)
+{
+	unsigned int summary_cnt = (bm->word_cnt + 63) / 64;
+
+	for (unsigned int s = 0; s < summary_cnt; s++)
+	{
+		uint64_t sum = bm->summary[s].load(std::memory_order_acquire);
+		while (sum != 0)
+		{
+			unsigned int bit = (unsigned int)__builtin_ctzll(sum);
+			unsigned int w = s * 64 + bit;
+			uint64_t word = bm->words[w].load(std::memory_order_acquire);
+			if (word != 0)
+			{
+				return (int)(w * 64 + (unsigned int)__builtin_ctzll(word));
+			}
+
+			bm->summary[s].fetch_and(~(1ULL << bit), std::memory_order_acq_rel);
+			if (bm->words[w].load(std::memory_order_acquire) != 0)
+			{
+				bm->summary[s].fetch_or(1ULL << bit, std::memory_order_release);
+				continue;
+			}
+			sum &= ~(1ULL << bit);
+		}
+	}
+	return -1;
+}
 
 /* CAN DLC to real data length conversion helpers */
 static const unsigned char dlc2len[] = {0, 1, 2, 3, 4, 5, 6, 7,
@@ -111,168 +275,1078 @@ unsigned char asc2nibble(char c)
 	return 16; /* error */
 }
 
-static int canmsg_compare(const void *pa, const void *pb)
+/*
+ * init, one slot per can id is registered later with register_can_slot()
+ */
+int init_can_encoder(unsigned int max_slots)
+{
+	uint32_t size = 1;
+	void *mem = NULL;
+
+	if(max_slots == 0 || max_slots > MAX_CAN_SLOTS)
+	{
+		DBG_ERROR(LOG_PREFIX, "invalid can slot count:%u", max_slots);
+		return -1;
+	}
+
+	/* size of the extended id table */
+	while(size < max_slots)
+	{
+		size <<= 1;
+	}
+
+	if(posix_memalign(&mem, CACHE_LINE_SIZE, max_slots * sizeof(struct can_slot_t)) != 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot allocate can frame slots");
+		return -1;
+	}
+	memset(mem, 0, max_slots * sizeof(struct can_slot_t));
+	can_slots = (struct can_slot_t *)mem;
+	can_slot_max = max_slots;
+	can_slot_cnt = 0;
+
+	memset(sff_slot_map, 0xFF, sizeof(sff_slot_map));
+	eff_slot_keys = (canid_t *)calloc(size * 2, sizeof(canid_t));
+	eff_slot_bus = (uint8_t *)calloc(size * 2, sizeof(uint8_t));
+	eff_slot_vals = (int16_t *)malloc(size * 2 * sizeof(int16_t));
+	if(eff_slot_keys == NULL || eff_slot_bus == NULL || eff_slot_vals == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot allocate can id table");
+		return -1;
+	}
+	memset(eff_slot_vals, 0xFF, size * 2 * sizeof(int16_t));
+	eff_slot_mask = size * 2 - 1;
+
+	for(int bus = 0; bus < CAN_BUS_MAX; bus++)
+	{
+		struct can_queue_t *q = &tx_queue[bus];
+		/* every slot is marked at most once, so the queue never overflows */
+		q->rank_slot = (uint16_t *)calloc(max_slots, sizeof(uint16_t));
+		if(q->rank_slot == NULL || bitmap_init(&q->pending.bitmap, max_slots) < 0
+			|| bitmap_init(&q->due, max_slots) < 0)
+		{
+			DBG_ERROR(LOG_PREFIX, "cannot allocate can transmit queue");
+			return -1;
+		}
+		q->pending.depth.store(0, std::memory_order_relaxed);
+		q->pending.pushed.store(0, std::memory_order_relaxed);
+		q->pending.coalesced.store(0, std::memory_order_relaxed);
+		q->pending.popped.store(0, std::memory_order_relaxed);
+		q->slots = 0;
+
+		q->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(q->eventfd < 0)
+		{
+			DBG_ERROR(LOG_PREFIX, "cannot create can transmit eventfd");
+			return -1;
+		}
+	}
+
+	can_cycles = (struct can_cycle_t *)calloc(max_slots, sizeof(struct can_cycle_t));
+	if(can_cycles == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot allocate can cycle table");
+		return -1;
+	}
+
+	tx_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(tx_timerfd < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot create can cycle timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline uint32_t eff_slot_hash(canid_t can_id)
 {
-	struct canmsg_info_t *a =(struct canmsg_info_t *)pa;
-	struct canmsg_info_t *b =(struct canmsg_info_t *)pb;
-	return strcmp(a->canid,b->canid);
+	return (can_id * 2654435761U) & eff_slot_mask;
 }
 
 /*
- * init
+ * constant time lookup of the slot of a can id on a bus, -1 if not registered
  */
-void init_can_encoder(void)
+int find_can_slot(int bus, canid_t can_id)
 {
-	pthread_mutex_init(&lock, NULL);
-	phead = NULL;
-	ptail = NULL;
+	if(bus < 0 || bus >= CAN_BUS_MAX)
+	{
+		return -1;
+	}
+
+	if(!(can_id & CAN_EFF_FLAG))
+	{
+		return sff_slot_map[bus][can_id & CAN_SFF_MASK];
+	}
+
+	for(uint32_t h = eff_slot_hash(can_id); eff_slot_vals[h] >= 0; h = (h + 1) & eff_slot_mask)
+	{
+		if(eff_slot_keys[h] == can_id && eff_slot_bus[h] == bus)
+		{
+			return eff_slot_vals[h];
+		}
+	}
+	return -1;
 }
 
 /*
- * push can msg to queue
+ * get the slot of a can id on a bus, a new slot is added the first time
+ * the id is seen. a frame becomes CAN FD if any of its properties is.
  */
-int push(char *dat)
+int register_can_slot(int bus, canid_t can_id, uint8_t len, int mtu, uint8_t flags)
 {
-	if (dat == NULL)
+	if(bus < 0 || bus >= CAN_BUS_MAX)
 	{
-		DBG_ERROR(LOG_PREFIX, "push data is NULL");
+		DBG_ERROR(LOG_PREFIX, "invalid bus %d for id %X", bus, can_id);
 		return -1;
 	}
 
-	struct can_data_t *p = (struct can_data_t *)malloc(sizeof(struct can_data_t));
-	strncpy(p->dat, dat, MAX_CANDATA_SIZE);
-	p->dat[MAX_CANDATA_SIZE] = '\0';
-	p->next = NULL;
+	int idx = find_can_slot(bus, can_id);
+	if(idx >= 0)
+	{
+		struct can_slot_t *slot = &can_slots[idx];
+		if(slot->len < len)
+		{
+			slot->len = len;
+		}
+		if(slot->mtu < mtu)
+		{
+			slot->mtu = mtu;
+		}
+		slot->flags |= flags;
+		if(slot->mtu == CANFD_MTU)
+		{
+			/* only discrete CAN FD lengths 0..8, 12, 16, 20, 24, 32, 48, 64 */
+			slot->len = can_dlc2len(can_len2dlc(slot->len));
+		}
+		return idx;
+	}
+
+	if(can_slot_cnt >= can_slot_max)
+	{
+		DBG_ERROR(LOG_PREFIX, "no free can slot for id %X", can_id);
+		return -1;
+	}
+
+	idx = (int)can_slot_cnt++;
+	struct can_slot_t *slot = &can_slots[idx];
+	slot->can_id = can_id;
+	slot->bus = (uint8_t)bus;
+	slot->len = len;
+	slot->flags = flags;
+	slot->mtu = mtu;
+	slot->prio = CAN_PRIO_MAX;	/* no class set yet, ranked as normal */
+	slot->rank = (uint16_t)tx_queue[bus].slots;
+	tx_queue[bus].rank_slot[slot->rank] = (uint16_t)idx;
+	memset(slot->image, 0, sizeof(slot->image));
+	slot->seq.store(0, std::memory_order_relaxed);
+	slot->dirty.store(false, std::memory_order_relaxed);
 
-	pthread_mutex_lock(&lock);
-	if (ptail == NULL)
+	if(!(can_id & CAN_EFF_FLAG))
 	{
-		ptail = p;
-		phead = p;
+		sff_slot_map[bus][can_id & CAN_SFF_MASK] = (int16_t)idx;
 	}
 	else
 	{
-		ptail->next = p;
-		ptail = p;
+		/* the table has twice as many entries as slots, it is never full */
+		uint32_t h = eff_slot_hash(can_id);
+		while(eff_slot_vals[h] >= 0)
+		{
+			h = (h + 1) & eff_slot_mask;
+		}
+		eff_slot_keys[h] = can_id;
+		eff_slot_bus[h] = (uint8_t)bus;
+		eff_slot_vals[h] = (int16_t)idx;
+	}
+	tx_queue[bus].slots++;
+
+	return idx;
+}
+
+/*
+ * publish the latest frame of a slot, producer side only.
+ * a slot that is still waiting for transmission is only overwritten.
+ */
+static void write_slot(struct can_slot_t *slot, const uint8_t *data)
+{
+	/* seqlock write, the consumer retries while seq is odd or has moved */
+	uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(slot->data, data, slot->len);
+	slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+static int publish(int slot_idx, const uint8_t *data)
+{
+	struct can_slot_t *slot = &can_slots[slot_idx];
+	struct can_queue_t *q = &tx_queue[slot->bus];
+
+	write_slot(slot, data);
+
+	q->pending.pushed.fetch_add(1, std::memory_order_relaxed);
+
+	if (slot->dirty.exchange(true, std::memory_order_acq_rel))
+	{
+		/* already queued, the transmitter will pick up this state */
+		q->pending.coalesced.fetch_add(1, std::memory_order_relaxed);
+		return 0;
+	}
+
+	slot->enqueue_usec = monotonic_usec();
+	q->pending.depth.fetch_add(1, std::memory_order_relaxed);
+	bitmap_set(&q->pending.bitmap, slot->rank);
+
+	/* wake the transmission loop */
+	uint64_t one = 1;
+	if (write(q->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		DBG_ERROR(LOG_PREFIX, "can transmit eventfd write failed");
+	}
+	return 0;
+}
+
+int push(int slot_idx, const struct canfd_frame *cf)
+{
+	if (cf == NULL || slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt)
+	{
+		DBG_ERROR(LOG_PREFIX, "push of %s to slot %d rejected", (cf == NULL) ? "no data" : "a frame", slot_idx);
+		return -1;
+	}
+	return publish(slot_idx, cf->data);
+}
+
+/*
+ * update the data of a cyclic slot without queueing it, its next cycle
+ * sends it. producer side only
+ */
+int stage(int slot_idx, const struct canfd_frame *cf)
+{
+	if (cf == NULL || slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt)
+	{
+		return -1;
+	}
+	write_slot(&can_slots[slot_idx], cf->data);
+	return 0;
+}
+
+/*
+ * signal image of a slot for packing in place, producer side only
+ */
+uint8_t *can_slot_image(int slot_idx)
+{
+	return can_slots[slot_idx].image;
+}
+
+/*
+ * publish the signal image of a slot, producer side only
+ */
+int push_slot_image(int slot_idx)
+{
+	return publish(slot_idx, can_slots[slot_idx].image);
+}
+
+/*
+ * set the transmission period of a slot, the shortest period of the
+ * properties sharing the can id wins. call before start_can_schedule().
+ */
+int set_can_slot_cycle(int slot_idx, unsigned int period_ms)
+{
+	if (slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt)
+	{
+		return -1;
+	}
+
+	struct can_cycle_t *cyc = &can_cycles[slot_idx];
+	uint32_t period_usec = period_ms * 1000U;
+	if (period_usec != 0 && (cyc->period_usec == 0 || period_usec < cyc->period_usec))
+	{
+		cyc->period_usec = period_usec;
+	}
+	return 0;
+}
+
+/*
+ * set the priority class of a slot, the most urgent class of the
+ * properties sharing the can id wins. call before order_can_slots().
+ */
+int set_can_slot_priority(int slot_idx, unsigned int prio)
+{
+	if (slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt || prio >= CAN_PRIO_MAX)
+	{
+		return -1;
+	}
+
+	struct can_slot_t *slot = &can_slots[slot_idx];
+	if (prio < slot->prio)
+	{
+		slot->prio = (uint8_t)prio;
 	}
-	pthread_mutex_unlock(&lock);
 	return 0;
 }
 
+int can_slot_priority(int slot_idx)
+{
+	uint8_t prio = can_slots[slot_idx].prio;
+	return (prio == CAN_PRIO_MAX) ? (int)CAN_PRIO_NORMAL : (int)prio;
+}
+
+static inline uint64_t rank_key(const struct can_slot_t *slot)
+{
+	uint8_t prio = (slot->prio == CAN_PRIO_MAX) ? (uint8_t)CAN_PRIO_NORMAL : slot->prio;
+	return ((uint64_t)prio << 32) | can_arbitration_key(slot->can_id);
+}
+
+/*
+ * rank the slots of each bus by priority class, then by the arbitration
+ * order of their ids. pending slots are sent lowest rank first. call once
+ * after all slots are registered, before anything is pushed.
+ */
+void order_can_slots(void)
+{
+	for (int bus = 0; bus < CAN_BUS_MAX; bus++)
+	{
+		struct can_queue_t *q = &tx_queue[bus];
+
+		/* insertion sort, done once at start */
+		for (unsigned int i = 1; i < q->slots; i++)
+		{
+			uint16_t idx = q->rank_slot[i];
+			uint64_t key = rank_key(&can_slots[idx]);
+			unsigned int j = i;
+			while (j > 0 && rank_key(&can_slots[q->rank_slot[j - 1]]) > key)
+			{
+				q->rank_slot[j] = q->rank_slot[j - 1];
+				j--;
+			}
+			q->rank_slot[j] = idx;
+		}
+		for (unsigned int i = 0; i < q->slots; i++)
+		{
+			can_slots[q->rank_slot[i]].rank = (uint16_t)i;
+		}
+	}
+}
+
+unsigned int can_slot_count(void)
+{
+	return can_slot_cnt;
+}
+
+int can_slot_bus(int slot_idx)
+{
+	return can_slots[slot_idx].bus;
+}
+
+uint32_t can_slot_cycle_usec(int slot_idx)
+{
+	if (slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt)
+	{
+		return 0;
+	}
+	return can_cycles[slot_idx].period_usec;
+}
+
 /*
- * pop can msg from queue
+ * arm the cycle timer at the earliest deadline
  */
-struct can_data_t* pop(void)
+static void arm_can_schedule(void)
 {
-	struct can_data_t *p = NULL;
-	pthread_mutex_lock(&lock);
-	if (phead != NULL)
+	uint64_t earliest = 0;
+	struct itimerspec its;
+
+	for (unsigned int i = 0; i < can_slot_cnt; i++)
 	{
-		p = phead;
-		if (phead->next != NULL)
+		if (can_cycles[i].period_usec != 0 && (earliest == 0 || can_cycles[i].next_usec < earliest))
 		{
-			phead = p->next;
+			earliest = can_cycles[i].next_usec;
+		}
+	}
+	if (earliest == 0)
+	{
+		return;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = (time_t)(earliest / 1000000ULL);
+	its.it_value.tv_nsec = (long)(earliest % 1000000ULL) * 1000L;
+	if (timerfd_settime(tx_timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "can cycle timer setting failed");
+	}
+}
+
+/*
+ * start the timeline of all cyclic slots, consumer side only
+ */
+void start_can_schedule(void)
+{
+	uint64_t now = monotonic_usec();
+	unsigned int cyclic = 0;
+
+	for (unsigned int i = 0; i < can_slot_cnt; i++)
+	{
+		struct can_cycle_t *cyc = &can_cycles[i];
+		if (cyc->period_usec == 0)
+		{
+			continue;
+		}
+		cyc->next_usec = now + cyc->period_usec;
+		cyc->due_usec = 0;
+		cyclic++;
+	}
+	cycle_report_usec = now + CYCLE_REPORT_INTERVAL_USEC;
+
+	DBG_INFO(LOG_PREFIX, "can cycle schedule: %u of %u ids cyclic", cyclic, can_slot_cnt);
+	arm_can_schedule();
+}
+
+static void report_can_schedule(void)
+{
+	for (unsigned int i = 0; i < can_slot_cnt; i++)
+	{
+		struct can_cycle_t *cyc = &can_cycles[i];
+		if (cyc->period_usec == 0)
+		{
+			continue;
+		}
+		DBG_INFO(LOG_PREFIX, "can cycle %X period:%ums sent:%llu missed:%llu jitter avg:%lluus max:%lluus",
+			can_slots[i].can_id, cyc->period_usec / 1000U,
+			(unsigned long long)cyc->sent, (unsigned long long)cyc->missed,
+			(unsigned long long)(cyc->sent ? cyc->jitter_sum_usec / cyc->sent : 0),
+			(unsigned long long)cyc->jitter_max_usec);
+	}
+}
+
+/*
+ * collect the slots whose deadline has passed and rearm the timer.
+ * a slot that still waits for its previous deadline, e.g. on a blocked
+ * bus, is not queued twice.
+ */
+static void run_can_schedule(void)
+{
+	uint64_t now = monotonic_usec();
+
+	for (unsigned int i = 0; i < can_slot_cnt; i++)
+	{
+		struct can_cycle_t *cyc = &can_cycles[i];
+		if (cyc->period_usec == 0 || cyc->next_usec > now)
+		{
+			continue;
+		}
+
+		if (cyc->due_usec != 0)
+		{
+			/* the previous deadline is not served yet */
+			cyc->missed++;
 		}
 		else
 		{
-			phead = NULL;
-			ptail = NULL;
+			cyc->due_usec = cyc->next_usec;
+			bitmap_set(&tx_queue[can_slots[i].bus].due, can_slots[i].rank);
 		}
+		cyc->next_usec += cyc->period_usec;
+		while (cyc->next_usec <= now)
+		{
+			/* the loop was late by more than a period */
+			cyc->next_usec += cyc->period_usec;
+			cyc->missed++;
+		}
+	}
+
+	if (now >= cycle_report_usec)
+	{
+		report_can_schedule();
+		cycle_report_usec = now + CYCLE_REPORT_INTERVAL_USEC;
 	}
-	pthread_mutex_unlock(&lock);
-	return p;
+
+	arm_can_schedule();
 }
 
 /*
- * clear transmission msg queue
+ * account a send that serves the pending deadline of a slot
  */
-void clear(void)
+static inline void serve_deadline(struct can_cycle_t *cyc)
+{
+	uint64_t jitter = monotonic_usec() - cyc->due_usec;
+
+	cyc->sent++;
+	cyc->jitter_sum_usec += jitter;
+	if (jitter > cyc->jitter_max_usec)
+	{
+		cyc->jitter_max_usec = jitter;
+	}
+	cyc->due_usec = 0;
+}
+
+static void read_slot(const struct can_slot_t *slot, struct can_data_t *dat)
 {
-	struct can_data_t *p = NULL;
-	pthread_mutex_lock(&lock);
-	while (phead != NULL)
+	memset(&dat->frame, 0, sizeof(dat->frame));
+	dat->frame.can_id = slot->can_id;
+	dat->frame.len = slot->len;
+	dat->frame.flags = slot->flags;
+	dat->mtu = slot->mtu;
+	while (true)
 	{
-		p = phead;
-		phead = phead->next;
-		free(p);
+		uint32_t seq = slot->seq.load(std::memory_order_acquire);
+		if (seq & 1)
+		{
+			sched_yield();
+			continue;
+		}
+		memcpy(dat->frame.data, slot->data, slot->len);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->seq.load(std::memory_order_relaxed) == seq)
+		{
+			break;
+		}
 	}
-	ptail = NULL;
-	pthread_mutex_unlock(&lock);
 }
 
 /*
- * make "0" string
+ * whether a newer state of the slot waits in its queue, a frame of the
+ * slot taken before is superseded then
  */
-static char *makeZeroString(uint8_t dlc)
+bool can_slot_pending(int slot_idx)
 {
-	int len = dlc * 2;
+	if (slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt)
+	{
+		return false;
+	}
+	return can_slots[slot_idx].dirty.load(std::memory_order_acquire);
+}
 
-	if (len > MAX_LENGTH)
+/*
+ * current state of a slot without queueing it, consumer side only
+ */
+int peek_can_slot(int slot_idx, struct can_data_t *dat)
+{
+	if (slot_idx < 0 || (unsigned int)slot_idx >= can_slot_cnt)
 	{
-		DBG_ERROR(LOG_PREFIX, "makeZeroString input dlc error; dlc=%d",dlc);
-		return NULL;
+		return -1;
+	}
+
+	dat->slot = slot_idx;
+	dat->enqueue_usec = 0;
+	dat->cyclic = false;
+	dat->deadline = false;
+	read_slot(&can_slots[slot_idx], dat);
+	return 0;
+}
+
+/*
+ * take the latest state of the pending slot of a bus with the lowest rank,
+ * whether it is pending for an update or for its cycle. consumer side only.
+ * a frame with dat->deadline set has to be passed to complete_can_deadline()
+ * once it is written or dropped, the slot is not due again before.
+ */
+bool pop(int bus, struct can_data_t *dat)
+{
+	struct can_queue_t *q = &tx_queue[bus];
+	int updated = bitmap_first(&q->pending.bitmap);
+	int due = bitmap_first(&q->due);
+
+	if (updated >= 0 && (due < 0 || updated <= due))
+	{
+		uint16_t idx = q->rank_slot[updated];
+		struct can_slot_t *slot = &can_slots[idx];
+		bitmap_clear(&q->pending.bitmap, (unsigned int)updated);
+		q->pending.depth.fetch_sub(1, std::memory_order_relaxed);
+
+		dat->slot = idx;
+		dat->enqueue_usec = slot->enqueue_usec;
+		dat->cyclic = false;
+		/* updates from now on queue the slot again */
+		slot->dirty.store(false, std::memory_order_seq_cst);
+		read_slot(slot, dat);
+
+		/* the update also serves the deadline */
+		dat->deadline = (can_cycles[idx].due_usec != 0);
+		if (dat->deadline)
+		{
+			bitmap_clear(&q->due, (unsigned int)updated);
+		}
+		q->pending.popped.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	if (due >= 0)
+	{
+		uint16_t idx = q->rank_slot[due];
+		struct can_cycle_t *cyc = &can_cycles[idx];
+		bitmap_clear(&q->due, (unsigned int)due);
+
+		dat->slot = idx;
+		dat->enqueue_usec = cyc->due_usec;
+		dat->cyclic = true;
+		dat->deadline = true;
+		read_slot(&can_slots[idx], dat);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * the frame of a deadline taken by pop() was written, or dropped or held
+ * back, which counts as a missed deadline. a deadline served by another
+ * frame of the slot before is not accounted twice.
+ */
+void complete_can_deadline(const struct can_data_t *dat, bool sent)
+{
+	struct can_cycle_t *cyc = &can_cycles[dat->slot];
+
+	if (!dat->deadline || cyc->due_usec == 0)
+	{
+		return;
+	}
+	if (sent)
+	{
+		serve_deadline(cyc);
+	}
+	else
+	{
+		cyc->missed++;
+		cyc->due_usec = 0;
+	}
+}
+
+/*
+ * the eventfd signalled by push() for a bus, the consumer reads it
+ * before draining the queue with pop()
+ */
+int can_queue_event_fd(int bus)
+{
+	return tx_queue[bus].eventfd;
+}
+
+/*
+ * the timerfd of the cyclic schedule, call on_can_schedule_timer() when
+ * it is readable
+ */
+int can_schedule_fd(void)
+{
+	return tx_timerfd;
+}
+
+void on_can_schedule_timer(void)
+{
+	uint64_t count;
+
+	if (read(tx_timerfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	{
+		DBG_ERROR(LOG_PREFIX, "can cycle timer read failed");
 	}
+	run_can_schedule();
+}
 
-	for (int i = 0; i < len; i++) {
-		str[i] = '0';
+/*
+ * drop pending transmissions of a bus, consumer side only
+ */
+void clear(int bus)
+{
+	struct can_data_t dat;
+	while (pop(bus, &dat))
+	{
+		/* discard */
+		complete_can_deadline(&dat, false);
 	}
+}
 
-	str[len + 1] = '\0';
+void get_can_queue_stats(int bus, struct can_queue_stats_t *stats)
+{
+	struct can_queue_t *q = &tx_queue[bus];
 
-	return str;
+	stats->size = q->slots;
+	stats->depth = q->pending.depth.load(std::memory_order_relaxed);
+	stats->pushed = q->pending.pushed.load(std::memory_order_relaxed);
+	stats->popped = q->pending.popped.load(std::memory_order_relaxed);
+	stats->coalesced = q->pending.coalesced.load(std::memory_order_relaxed);
 }
 
-static struct canmsg_info_t * getCanMsg_dict(const char * can_id)
+/*
+ * parse a hex can id of digits only; up to three digits is a standard id,
+ * more is an extended one and gets CAN_EFF_FLAG, so the two never alias
+ */
+int parse_can_id(const char *text, canid_t *id)
 {
-	struct canmsg_info_t info;
-	strncpy(info.canid, can_id, sizeof(info.canid));
-	info.value = 0;
+	/* hex digits only, a sign, blank or 0x prefix would count as a digit */
+	size_t digits = strspn(text, "0123456789abcdefABCDEF");
 
-	void *v;
-	v = tfind((void *)&info, &canmsg_root, canmsg_compare);
-	if (v == NULL)
+	if (digits == 0 || text[digits] != '\0')
+	{
+		DBG_ERROR(LOG_PREFIX, "invalid can id \"%s\"", text);
+		return -1;
+	}
+	unsigned long val = strtoul(text, NULL, 16);
+	if (digits > 3)
 	{
-		/* new msg, add node */
-		struct canmsg_info_t * p = (struct canmsg_info_t *)malloc(sizeof(struct canmsg_info_t));
-		strncpy(p->canid, can_id, sizeof(p->canid));
-		p->value = 0;
-		v = tsearch((void *)p, &canmsg_root, canmsg_compare);
-		if (v == NULL)
+		if (val > CAN_EFF_MASK)
 		{
-			DBG_ERROR(LOG_PREFIX, "add canmsg failed: not enogh memory?");
+			DBG_ERROR(LOG_PREFIX, "can id \"%s\" exceeds 29 bits", text);
+			return -1;
 		}
+		*id = (canid_t)val | CAN_EFF_FLAG;
+	}
+	else if (val > CAN_SFF_MASK)
+	{
+		DBG_ERROR(LOG_PREFIX, "can id \"%s\" exceeds 11 bits, write it with more digits for an extended id", text);
+		return -1;
+	}
+	else
+	{
+		*id = (canid_t)val;
+	}
+	return 0;
+}
+
+/*
+ * precompute the frame id and the bit layout of a property, called once at load
+ */
+int init_prop_codec(struct prop_info_t *property_info)
+{
+	unsigned int msb;	/* signal msb, counted from the msb of byte 0 */
+	unsigned int first;
+	unsigned int last;
+	unsigned int size = property_info->bit_size;
+
+	if (property_info->dlc > CAN_MAX_DLEN || property_info->fd_flags != 0)
+	{
+		property_info->fd = true;
+	}
+	if (property_info->can_id == NULL || property_info->dlc == 0
+		|| property_info->dlc > (property_info->fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN))
+	{
+		DBG_ERROR(LOG_PREFIX, "invalid can id or dlc for %s", property_info->name);
+		return -1;
+	}
+	if (property_info->fd)
+	{
+		/* round up to the next length a CAN FD frame can carry */
+		property_info->dlc = can_dlc2len(can_len2dlc(property_info->dlc));
 	}
 
-	return (*(struct canmsg_info_t **)v);
+	if (parse_can_id(property_info->can_id, &property_info->frame_id) < 0)
+	{
+		return -1;
+	}
+
+	if (size == 0 || size > 64)
+	{
+		DBG_ERROR(LOG_PREFIX, "invalid bit size %u of %s", size, property_info->name);
+		return -1;
+	}
+
+	switch (property_info->byte_order)
+	{
+	case SIGNAL_ORDER_INTEL:
+		/* lsb0 numbering, the signal grows towards higher bytes */
+		first = property_info->bit_pos / 8;
+		last = (property_info->bit_pos + size - 1) / 8;
+		property_info->shift = (uint8_t)(property_info->bit_pos % 8);
+		break;
+	case SIGNAL_ORDER_MOTOROLA:
+		/* lsb0 numbering of the msb, the signal grows towards higher bytes */
+		msb = (property_info->bit_pos / 8) * 8 + (7 - property_info->bit_pos % 8);
+		first = msb / 8;
+		last = (msb + size - 1) / 8;
+		property_info->shift = (uint8_t)((last + 1) * 8 - msb - size);
+		break;
+	default:
+		msb = property_info->bit_pos;
+		first = msb / 8;
+		last = (msb + size - 1) / 8;
+		property_info->shift = (uint8_t)((last + 1) * 8 - msb - size);
+		break;
+	}
+
+	if (last >= property_info->dlc)
+	{
+		DBG_ERROR(LOG_PREFIX, "signal %s does not fit into %d bytes", property_info->name, property_info->dlc);
+		return -1;
+	}
+	if (last - first + 1 > 8)
+	{
+		DBG_ERROR(LOG_PREFIX, "signal %s spans more than 8 bytes", property_info->name);
+		return -1;
+	}
+
+	property_info->byte_start = (uint8_t)first;
+	property_info->byte_cnt = (uint8_t)(last - first + 1);
+	property_info->mask = (size == 64) ? ~0ULL : ((1ULL << size) - 1);
+
+	if (property_info->is_signed)
+	{
+		property_info->raw_max = (int64_t)(property_info->mask >> 1);
+		property_info->raw_min = -property_info->raw_max - 1;
+	}
+	else
+	{
+		property_info->raw_min = 0;
+		property_info->raw_max = (size >= 63) ? INT64_MAX : (int64_t)property_info->mask;
+	}
+
+	if (property_info->factor == 0)
+	{
+		property_info->factor = 1.0;
+	}
+
+	property_info->filter = (property_info->deadband > 0) || (property_info->deadband_rel > 0)
+		|| (property_info->min_interval_usec != 0) || (property_info->smoothing > 0);
+
+	return 0;
 }
 
 /*
- * make can frame data
+ * run a new physical value through the filters of the property, *val is
+ * replaced by the smoothed value. returns false when the update is dropped.
+ * the deadbands compare with the last value passed, so a slow drift still
+ * gets through once it adds up.
  */
-char * makeCanData(struct prop_info_t *property_info)
+bool filter_prop_value(struct prop_info_t *property_info, double *val)
 {
-	char tmp[MAX_LENGTH+1] = {0};
-	u_int64_t val = 0, mask = 0;
-	struct canmsg_info_t * p = getCanMsg_dict(property_info->can_id);
-	if (p == NULL)
+	struct prop_info_t *p = property_info;
+
+	if (!p->filter)
 	{
-		return NULL;
+		return true;
+	}
+
+	double v = *val;
+	if (p->smoothing > 0 && p->filter_primed)
+	{
+		v = p->filter_avg + p->smoothing * (v - p->filter_avg);
+	}
+	p->filter_avg = v;
+
+	uint64_t now = (p->min_interval_usec != 0) ? monotonic_usec() : 0;
+	if (p->filter_primed)
+	{
+		double delta = fabs(v - p->filter_last);
+		if (delta < p->deadband)
+		{
+			/* back near the value sent, a held one is stale */
+			p->filter_stats.deadband++;
+			p->filter_held = false;
+			return false;
+		}
+		if (delta < p->deadband_rel * fabs(p->filter_last))
+		{
+			p->filter_stats.deadband_rel++;
+			p->filter_held = false;
+			return false;
+		}
+		if (now - p->filter_usec < p->min_interval_usec)
+		{
+			/* the latest value is kept, see release_prop_value() */
+			p->filter_stats.interval++;
+			p->filter_held = true;
+			p->filter_held_val = v;
+			return false;
+		}
 	}
 
-	memset(buf, 0, sizeof(buf));
-	sprintf(buf, "%s#%s", property_info->can_id, makeZeroString(property_info->dlc));
-	mask = (1 << (property_info->bit_size)) - 1;
-	val = mask & property_info->curValue.uint16_val;
-	val = val << ((property_info->dlc * 8) - property_info->bit_size - property_info->bit_pos);
-	mask = mask << ((property_info->dlc * 8) - property_info->bit_size - property_info->bit_pos);
-	mask = ~mask;
-	p->value = p->value & mask;
-	p->value = p->value | val;
+	p->filter_held = false;
+	p->filter_primed = true;
+	p->filter_last = v;
+	p->filter_usec = now;
+	p->filter_stats.passed++;
+	*val = v;
+
+	return true;
+}
+
+static inline void pass_held_value(struct prop_info_t *p, double *val)
+{
+	p->filter_held = false;
+	p->filter_last = p->filter_held_val;
+	p->filter_stats.released++;
+	*val = p->filter_held_val;
+}
 
-	sprintf(tmp, "%lx", p->value);
-	strncpy((buf + 4 + property_info->dlc * 2 -strlen(tmp)), tmp ,strlen(tmp));
+/*
+ * pass the latest value dropped by the interval once the interval has
+ * expired. returns false while it has to wait or when nothing is held.
+ */
+bool release_prop_value(struct prop_info_t *property_info, uint64_t now, double *val)
+{
+	struct prop_info_t *p = property_info;
+
+	if (!p->filter_held || now - p->filter_usec < p->min_interval_usec)
+	{
+		return false;
+	}
+	pass_held_value(p, val);
+	p->filter_usec = now;
+	return true;
+}
+
+/*
+ * take the value held by the interval at once, for a cyclic slot whose
+ * next cycle carries it without an extra frame. the interval goes on.
+ */
+bool take_held_value(struct prop_info_t *property_info, double *val)
+{
+	if (!property_info->filter_held)
+	{
+		return false;
+	}
+	pass_held_value(property_info, val);
+	return true;
+}
+
+/*
+ * scale a physical value to the raw signal value, clamped to its range
+ */
+int64_t phys2raw(const struct prop_info_t *property_info, double val)
+{
+	double raw = (val - property_info->offset) / property_info->factor;
+
+	if (raw <= (double)property_info->raw_min)
+	{
+		return property_info->raw_min;
+	}
+	if (raw >= (double)property_info->raw_max)
+	{
+		return property_info->raw_max;
+	}
+	return llround(raw);
+}
+
+/*
+ * merge the raw property value into the message state and build the frame,
+ * returns the mtu to write or 0 on error
+ */
+int makeCanFrame(struct prop_info_t *property_info, struct canfd_frame *cf)
+{
+	if (property_info->mask == 0 || property_info->slot < 0)
+	{
+		/* rejected by init_prop_codec() or without a frame slot */
+		return 0;
+	}
 
-//	DBG_ERROR(LOG_PREFIX, "makeCanData buf is [%s]", buf);
+	struct can_slot_t *p = &can_slots[property_info->slot];
+	uint8_t *win = p->image + property_info->byte_start;
+	unsigned int cnt = property_info->byte_cnt;
+	uint64_t mask = property_info->mask << property_info->shift;
+	uint64_t val = ((uint64_t)property_info->raw & property_info->mask) << property_info->shift;
+	uint64_t w = 0;
+
+	if (property_info->byte_order == SIGNAL_ORDER_INTEL)
+	{
+		for (unsigned int i = 0; i < cnt; i++)
+		{
+			w |= (uint64_t)win[i] << (8 * i);
+		}
+		w = (w & ~mask) | val;
+		for (unsigned int i = 0; i < cnt; i++)
+		{
+			win[i] = (uint8_t)(w >> (8 * i));
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < cnt; i++)
+		{
+			w = (w << 8) | win[i];
+		}
+		w = (w & ~mask) | val;
+		for (unsigned int i = cnt; i-- > 0; )
+		{
+			win[i] = (uint8_t)w;
+			w >>= 8;
+		}
+	}
+
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = property_info->frame_id;
+	cf->len = p->len;
+	cf->flags = p->flags;
+	memcpy(cf->data, p->image, p->len);
+
+	return p->mtu;
+}
+
+/*
+ * get the physical value of a property from a received frame, the inverse
+ * of makeCanFrame(). returns -1 if the frame does not carry the signal.
+ */
+int decodeCanSignal(const struct prop_info_t *property_info, const struct canfd_frame *cf, double *val)
+{
+	const uint8_t *win = cf->data + property_info->byte_start;
+	unsigned int cnt = property_info->byte_cnt;
+	uint64_t w = 0;
+
+	if (property_info->mask == 0 || property_info->byte_start + cnt > cf->len)
+	{
+		return -1;
+	}
+
+	if (property_info->byte_order == SIGNAL_ORDER_INTEL)
+	{
+		for (unsigned int i = cnt; i-- > 0; )
+		{
+			w = (w << 8) | win[i];
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < cnt; i++)
+		{
+			w = (w << 8) | win[i];
+		}
+	}
+
+	uint64_t raw = (w >> property_info->shift) & property_info->mask;
+	if (property_info->is_signed)
+	{
+		/* sign extend */
+		uint64_t sign = (property_info->mask >> 1) + 1;
+		*val = (double)(int64_t)((raw ^ sign) - sign);
+	}
+	else
+	{
+		*val = (double)raw;
+	}
+	*val = *val * property_info->factor + property_info->offset;
+
+	return 0;
+}
+
+/*
+ * format a frame as "<can_id>#<data>" (or "<can_id>##<flags><data>" for CAN FD),
+ * only meant for logging
+ */
+char *canframe2str(const struct canfd_frame *cf, int mtu, char *buf, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t pos;
+
+	if (len < CANFRAME_STR_SIZE)
+	{
+		return NULL;
+	}
+
+	if (cf->can_id & CAN_EFF_FLAG)
+	{
+		pos = (size_t)sprintf(buf, "%08X", cf->can_id & CAN_EFF_MASK);
+	}
+	else
+	{
+		pos = (size_t)sprintf(buf, "%03X", cf->can_id & CAN_SFF_MASK);
+	}
+	buf[pos++] = CANID_DELIM;
+	if (mtu == CANFD_MTU)
+	{
+		buf[pos++] = CANID_DELIM;
+		buf[pos++] = hex[cf->flags & 0x0F];
+	}
+	for (int i = 0; i < cf->len && i < CANFD_MAX_DLEN; i++)
+	{
+		buf[pos++] = hex[cf->data[i] >> 4];
+		buf[pos++] = hex[cf->data[i] & 0x0F];
+	}
+	buf[pos] = '\0';
 
 	return buf;
 }
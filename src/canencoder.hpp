@@ -28,19 +28,57 @@
 namespace carla
 {
 
-#define MAX_LENGTH	16
-#define MAX_CANDATA_SIZE 20
+/* "<8 digit id>##<flags><64 bytes hex>" */
+#define CANFRAME_STR_SIZE (8 + 3 + CANFD_MAX_DLEN * 2 + 1)
 
 struct can_data_t
 {
-	char dat[MAX_CANDATA_SIZE+1];
-	struct can_data_t * next;
+	struct canfd_frame frame;
+	int mtu;
+	int slot;
+	uint64_t enqueue_usec;	/* first update, or the deadline of a cyclic send */
+	bool cyclic;		/* sent for its cycle, not for an update */
+	bool deadline;		/* carries a cyclic deadline, see complete_can_deadline() */
 };
 
-struct canmsg_info_t
+enum can_bus_t
 {
-	char canid[4];
-	u_int64_t value;
+	CAN_BUS_HS,	/* "hs" of dev-mapping.conf */
+	CAN_BUS_LS,	/* "ls" of dev-mapping.conf */
+	CAN_BUS_MAX
+};
+
+/* transmit priority class of a slot, in the order pending frames are sent */
+enum can_prio_t
+{
+	CAN_PRIO_HIGH,
+	CAN_PRIO_NORMAL,	/* default */
+	CAN_PRIO_LOW,
+	CAN_PRIO_MAX
+};
+
+/*
+ * arbitration order of an id, lower wins: the 11 bit base id first, then a
+ * standard frame before an extended one with the same base, then the
+ * 18 bit extension
+ */
+static inline uint32_t can_arbitration_key(canid_t can_id)
+{
+	if (can_id & CAN_EFF_FLAG)
+	{
+		uint32_t id = can_id & CAN_EFF_MASK;
+		return ((id >> 18) << 19) | (1U << 18) | (id & 0x3FFFF);
+	}
+	return (can_id & CAN_SFF_MASK) << 19;
+}
+
+struct can_queue_stats_t
+{
+	uint32_t size;		/* number of frame slots */
+	uint32_t depth;		/* slots waiting for transmission */
+	uint64_t pushed;	/* updates */
+	uint64_t popped;	/* frames handed to the transmitter */
+	uint64_t coalesced;	/* updates merged into a waiting slot */
 };
 
 enum var_type_t
@@ -62,15 +100,21 @@ enum var_type_t
 /* 14 */	ENABLE1_T	/* AMB#CANRawPlugin original type */
 };
 
-union data_content_t
+enum signal_order_t
+{
+	SIGNAL_ORDER_LEGACY,	/* big endian, bit_pos counted from the msb of byte 0 */
+	SIGNAL_ORDER_INTEL,	/* little endian, bit_pos is the lsb (dbc "@1") */
+	SIGNAL_ORDER_MOTOROLA	/* big endian, bit_pos is the msb (dbc "@0") */
+};
+
+/* updates dropped by the filters of a property */
+struct prop_filter_stats_t
 {
-	uint32_t uint32_val;
-	int32_t  int32_val;
-	uint16_t uint16_val;
-	int16_t  int16_val;
-	uint8_t  uint8_val;
-	int8_t   int8_val;
-	int8_t     bool_val;
+	uint64_t passed;
+	uint64_t deadband;
+	uint64_t deadband_rel;
+	uint64_t interval;
+	uint64_t released;	/* held by the interval, sent later */
 };
 
 struct prop_info_t
@@ -78,20 +122,82 @@ struct prop_info_t
 	const char * name;
 	unsigned char var_type;
 	const char * can_id;
-	uint8_t bit_pos;
+	uint16_t bit_pos;
 	uint8_t bit_size;
-	uint8_t dlc;
-	union data_content_t curValue;
+	uint8_t dlc;		/* payload bytes, up to 64 for CAN FD */
+	bool fd;		/* sent as CAN FD frame */
+	uint8_t fd_flags;	/* canfd_frame flags, e.g. CANFD_BRS */
+	uint16_t cycle_ms;	/* transmission period, 0: sent on change only */
+	uint8_t bus;		/* can_bus_t */
+	uint8_t priority;	/* can_prio_t */
+	uint8_t byte_order;	/* signal_order_t */
+	bool is_signed;		/* two's complement */
+	double factor;		/* physical = raw * factor + offset */
+	double offset;
+	int64_t raw;		/* last packed value */
+
+	/* update filters, applied before encoding, 0: off */
+	double deadband;		/* minimum change of the physical value */
+	double deadband_rel;		/* minimum change relative to the last value passed */
+	uint32_t min_interval_usec;	/* minimum time between two values passed */
+	double smoothing;		/* weight of a new sample in the running average */
+	bool filter;			/* any of the above is set */
+	bool filter_primed;		/* a value has passed */
+	double filter_avg;
+	double filter_last;		/* last value passed */
+	uint64_t filter_usec;		/* when it passed */
+	bool filter_held;		/* the latest value was dropped by the interval */
+	double filter_held_val;
+	struct prop_filter_stats_t filter_stats;
+
+	int slot;	/* frame slot of can_id */
+
+	/* precomputed by init_prop_codec() */
+	canid_t frame_id;
+	uint8_t byte_start;	/* first byte of the window holding the signal */
+	uint8_t byte_cnt;	/* window length, at most 8 bytes */
+	uint8_t shift;		/* of the signal lsb inside the window */
+	uint64_t mask;
+	int64_t raw_min;
+	int64_t raw_max;
 
 	struct prop_info_t *next;
 };
 
 
-extern void init_can_encoder(void);
-extern int push(char *dat);
-extern struct can_data_t* pop(void);
-extern void clear(void);
-extern char * makeCanData(struct prop_info_t *property_info);
+extern int init_can_encoder(unsigned int max_slots);
+extern int register_can_slot(int bus, canid_t can_id, uint8_t len, int mtu, uint8_t flags);
+extern int find_can_slot(int bus, canid_t can_id);
+extern int set_can_slot_cycle(int slot_idx, unsigned int period_ms);
+extern int set_can_slot_priority(int slot_idx, unsigned int prio);
+extern int can_slot_priority(int slot_idx);
+extern void order_can_slots(void);
+extern void start_can_schedule(void);
+extern unsigned int can_slot_count(void);
+extern int can_slot_bus(int slot_idx);
+extern uint32_t can_slot_cycle_usec(int slot_idx);
+extern int peek_can_slot(int slot_idx, struct can_data_t *dat);
+extern bool can_slot_pending(int slot_idx);
+extern int push(int slot_idx, const struct canfd_frame *cf);
+extern int stage(int slot_idx, const struct canfd_frame *cf);
+extern uint8_t *can_slot_image(int slot_idx);
+extern int push_slot_image(int slot_idx);
+extern bool pop(int bus, struct can_data_t *dat);
+extern void complete_can_deadline(const struct can_data_t *dat, bool sent);
+extern int can_queue_event_fd(int bus);
+extern int can_schedule_fd(void);
+extern void on_can_schedule_timer(void);
+extern void clear(int bus);
+extern void get_can_queue_stats(int bus, struct can_queue_stats_t *stats);
+extern int parse_can_id(const char *text, canid_t *id);
+extern int init_prop_codec(struct prop_info_t *property_info);
+extern int64_t phys2raw(const struct prop_info_t *property_info, double val);
+extern bool filter_prop_value(struct prop_info_t *property_info, double *val);
+extern bool release_prop_value(struct prop_info_t *property_info, uint64_t now, double *val);
+extern bool take_held_value(struct prop_info_t *property_info, double *val);
+extern int makeCanFrame(struct prop_info_t *property_info, struct canfd_frame *cf);
+extern int decodeCanSignal(const struct prop_info_t *property_info, const struct canfd_frame *cf, double *val);
+extern char *canframe2str(const struct canfd_frame *cf, int mtu, char *buf, size_t len);
 extern unsigned char can_dlc2len(unsigned char can_dlc);
 extern unsigned char can_len2dlc(unsigned char len);
 extern int parse_canframe(char *cs, struct canfd_frame *cf);
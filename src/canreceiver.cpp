@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <linux/can/raw.h>
+
+#include "canreceiver.hpp"
+#include "cansender.hpp"
+#include "latency.hpp"
+#include "debugmsg.hpp"
+
+namespace carla
+{
+
+#define RX_REPORT_INTERVAL	10000
+
+static json_object *read_json_file(const char *fname)
+{
+	struct stat stbuf;
+	json_object *jobj = NULL;
+
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &stbuf) == 0)
+	{
+		char *filebuf = (char *)malloc((size_t)stbuf.st_size + 1);
+		if(filebuf != NULL)
+		{
+			ssize_t n = read(fd, filebuf, (size_t)stbuf.st_size);
+			filebuf[(n > 0) ? n : 0] = '\0';
+			jobj = json_tokener_parse(filebuf);
+			free(filebuf);
+		}
+	}
+	close(fd);
+
+	return jobj;
+}
+
+CanReceiver::CanReceiver() :
+signals(NULL),
+values(NULL),
+seen(NULL),
+nSignal(0),
+eff_keys(NULL),
+eff_bus(NULL),
+eff_first(NULL),
+eff_mask(0),
+next_signal(NULL),
+foreign_next(0),
+s(-1),
+frame_cnt(0),
+changed_cnt(0)
+{
+	for(int bus = 0; bus < CAN_BUS_MAX; bus++)
+	{
+		bus_name[bus] = NULL;
+		bus_ifindex[bus] = 0;
+	}
+	for(unsigned int i = 0; i < RX_FOREIGN_IFINDEX_MAX; i++)
+	{
+		foreign_ifindex[i] = 0;
+	}
+	memset(sff_first, 0xFF, sizeof(sff_first));
+}
+
+CanReceiver::~CanReceiver()
+{
+	if(s >= 0)
+	{
+		close(s);
+	}
+	for(unsigned int i = 0; i < nSignal; i++)
+	{
+		free((void *)signals[i].name);
+		free((void *)signals[i].can_id);
+	}
+	free(signals);
+	free(values);
+	free(seen);
+	free(eff_keys);
+	free(eff_bus);
+	free(eff_first);
+	free(next_signal);
+}
+
+/*
+ * load the receive map named in steering_wheel.json and open the socket,
+ * without "rx_map" nothing is received
+ */
+int CanReceiver::init(const char *hs, const char *ls)
+{
+	bus_name[CAN_BUS_HS] = hs;
+	bus_name[CAN_BUS_LS] = ls;
+
+	json_object *jobj = read_json_file(STEERING_WHEEL_JSON);
+	if(jobj == NULL)
+	{
+		return -1;
+	}
+
+	int ret = 0;
+	json_object *rx_map = NULL;
+	if(json_object_object_get_ex(jobj, "rx_map", &rx_map))
+	{
+		ret = loadMap(json_object_get_string(rx_map));
+		if(ret == 0 && nSignal > 0)
+		{
+			ret = buildIdTables();
+		}
+		if(ret == 0 && nSignal > 0)
+		{
+			ret = openSocket();
+		}
+	}
+	json_object_put(jobj);
+
+	return ret;
+}
+
+int CanReceiver::loadMap(const char *fname)
+{
+	json_object *jobj = read_json_file(fname);
+	json_object *props = NULL;
+
+	if(jobj == NULL || !json_object_object_get_ex(jobj, "PROPERTYS", &props)
+		|| json_object_get_type(props) != json_type_array)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot read receive map \"%s\"", fname);
+		if(jobj != NULL)
+		{
+			json_object_put(jobj);
+		}
+		return -1;
+	}
+
+	unsigned int cnt = (unsigned int)json_object_array_length(props);
+	if(cnt > (unsigned int)INT16_MAX)
+	{
+		DBG_ERROR(LOG_PREFIX, "receive map \"%s\": %u signals, at most %d", fname, cnt, INT16_MAX);
+		json_object_put(jobj);
+		return -1;
+	}
+	signals = (struct prop_info_t *)calloc(cnt, sizeof(struct prop_info_t));
+	values = (double *)calloc(cnt, sizeof(double));
+	seen = (bool *)calloc(cnt, sizeof(bool));
+	if(signals == NULL || values == NULL || seen == NULL)
+	{
+		json_object_put(jobj);
+		return -1;
+	}
+
+	for(unsigned int i = 0; i < cnt; i++)
+	{
+		struct prop_info_t *sig = &signals[nSignal];
+		if(parse_prop_info(sig, json_object_array_get_idx(props, (int)i)) != 0)
+		{
+			DBG_ERROR(LOG_PREFIX, "receive map: entry %u skipped", i);
+			free((void *)sig->name);
+			free((void *)sig->can_id);
+			memset(sig, 0, sizeof(*sig));
+			continue;
+		}
+		nSignal++;
+	}
+	json_object_put(jobj);
+
+	DBG_INFO(LOG_PREFIX, "receive map \"%s\": %u signals", fname, nSignal);
+	return 0;
+}
+
+static inline uint32_t eff_id_hash(canid_t can_id, uint32_t mask)
+{
+	return (can_id * 2654435761U) & mask;
+}
+
+/*
+ * constant time lookup of the signals of a received frame, like the
+ * slot maps of the encoder: a direct table for standard ids, an open
+ * addressing hash for extended ones. the signals of one frame are chained.
+ */
+int CanReceiver::buildIdTables()
+{
+	uint32_t size = 1;
+	while(size < nSignal * 2)
+	{
+		size <<= 1;
+	}
+	eff_keys = (canid_t *)calloc(size, sizeof(canid_t));
+	eff_bus = (uint8_t *)calloc(size, sizeof(uint8_t));
+	eff_first = (int16_t *)malloc(size * sizeof(int16_t));
+	next_signal = (int16_t *)malloc(nSignal * sizeof(int16_t));
+	if(eff_keys == NULL || eff_bus == NULL || eff_first == NULL || next_signal == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot allocate can receive id table");
+		return -1;
+	}
+	memset(eff_first, 0xFF, size * sizeof(int16_t));
+	eff_mask = size - 1;
+
+	/* backwards, so that a chain keeps the order of the map */
+	for(int k = (int)nSignal - 1; k >= 0; k--)
+	{
+		canid_t id = signals[k].frame_id;
+		int bus = signals[k].bus;
+		int16_t *first;
+
+		if((id & ~CAN_SFF_MASK) == 0)
+		{
+			first = &sff_first[bus][id];
+		}
+		else
+		{
+			uint32_t h = eff_id_hash(id, eff_mask);
+			while(eff_first[h] >= 0 && (eff_keys[h] != id || eff_bus[h] != bus))
+			{
+				h = (h + 1) & eff_mask;
+			}
+			eff_keys[h] = id;
+			eff_bus[h] = (uint8_t)bus;
+			first = &eff_first[h];
+		}
+		next_signal[k] = *first;
+		*first = (int16_t)k;
+	}
+	return 0;
+}
+
+/*
+ * first signal of a frame, -1 if the map has none
+ */
+int CanReceiver::firstSignal(int bus, canid_t can_id) const
+{
+	if(bus < 0 || bus >= CAN_BUS_MAX)
+	{
+		return -1;
+	}
+	if((can_id & ~CAN_SFF_MASK) == 0)
+	{
+		return sff_first[bus][can_id];
+	}
+	for(uint32_t h = eff_id_hash(can_id, eff_mask); eff_first[h] >= 0; h = (h + 1) & eff_mask)
+	{
+		if(eff_keys[h] == can_id && eff_bus[h] == bus)
+		{
+			return eff_first[h];
+		}
+	}
+	return -1;
+}
+
+/*
+ * one socket for all buses, the kernel only passes the ids of the map
+ */
+int CanReceiver::openSocket()
+{
+	struct can_filter *filter = (struct can_filter *)calloc(nSignal, sizeof(struct can_filter));
+	unsigned int nFilter = 0;
+	struct sockaddr_can addr;
+	int enable_canfd = 1;
+
+	if(filter == NULL)
+	{
+		return -1;
+	}
+	for(unsigned int i = 0; i < nSignal; i++)
+	{
+		canid_t id = signals[i].frame_id;
+		unsigned int j = 0;
+		while(j < nFilter && filter[j].can_id != id)
+		{
+			j++;
+		}
+		if(j == nFilter)
+		{
+			filter[nFilter].can_id = id;
+			filter[nFilter].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG
+				| ((id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+			nFilter++;
+		}
+	}
+
+	s = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+	if(s < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "can receive socket failed: %s", strerror(errno));
+		free(filter);
+		return -1;
+	}
+
+	if(setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filter, (socklen_t)(nFilter * sizeof(struct can_filter))) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "CAN_RAW_FILTER failed: %s", strerror(errno));
+	}
+	free(filter);
+
+	/* classic frames are received all the same */
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_canfd, sizeof(enable_canfd));
+
+	/* any CAN interface, also ones which come up later */
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = 0;
+	if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "can receive bind failed: %s", strerror(errno));
+		close(s);
+		s = -1;
+		return -1;
+	}
+
+	for(unsigned int i = 0; i < RX_BATCH_MAX; i++)
+	{
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+
+	DBG_INFO(LOG_PREFIX, "can receive: %u signals, %u ids", nSignal, nFilter);
+	return 0;
+}
+
+/*
+ * map an interface index to hs or ls. the bus names are looked up again
+ * only for an index not seen before, i.e. when an interface was created
+ * anew (the kernel does not reuse an index right away); the indexes of
+ * other CAN interfaces are remembered, so their frames cost no lookup.
+ */
+int CanReceiver::busOf(int ifindex)
+{
+	if(ifindex == 0)
+	{
+		return -1;
+	}
+	for(int bus = 0; bus < CAN_BUS_MAX; bus++)
+	{
+		if(bus_ifindex[bus] == ifindex)
+		{
+			return bus;
+		}
+	}
+	for(unsigned int i = 0; i < RX_FOREIGN_IFINDEX_MAX; i++)
+	{
+		if(foreign_ifindex[i] == ifindex)
+		{
+			return -1;
+		}
+	}
+
+	int found = -1;
+	for(int bus = 0; bus < CAN_BUS_MAX; bus++)
+	{
+		bus_ifindex[bus] = (bus_name[bus] != NULL) ? (int)if_nametoindex(bus_name[bus]) : 0;
+		if(bus_ifindex[bus] == ifindex)
+		{
+			found = bus;
+		}
+	}
+	if(found < 0)
+	{
+		DBG_INFO(LOG_PREFIX, "can receive: frames of interface %d are ignored", ifindex);
+		foreign_ifindex[foreign_next] = ifindex;
+		foreign_next = (foreign_next + 1) % RX_FOREIGN_IFINDEX_MAX;
+	}
+	return found;
+}
+
+int CanReceiver::formatControl(char *val, size_t len) const
+{
+	size_t pos = 0;
+
+	for(unsigned int i = 0; i < nSignal; i++)
+	{
+		if(!seen[i])
+		{
+			continue;
+		}
+		int n = snprintf(val + pos, len - pos, "%s%s=%.6g", (pos != 0) ? "," : "", signals[i].name, values[i]);
+		if(n < 0 || (size_t)n >= len - pos)
+		{
+			DBG_ERROR(LOG_PREFIX, "control values exceed %u bytes", (unsigned int)len);
+			return -1;
+		}
+		pos += (size_t)n;
+	}
+	return 0;
+}
+
+/*
+ * read everything the socket holds. returns 1 and the merged control values
+ * "<name>=<value>,..." when a value changed, 0 if none did, -1 on error.
+ * rx_usec is the time the first frame of this call was read.
+ */
+int CanReceiver::receive(char *val, size_t len, uint64_t *rx_usec)
+{
+	bool changed = false;
+
+	*rx_usec = 0;
+	while(true)
+	{
+		for(unsigned int i = 0; i < RX_BATCH_MAX; i++)
+		{
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		int n = recvmmsg(s, msgs, RX_BATCH_MAX, MSG_DONTWAIT, NULL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				DBG_ERROR(LOG_PREFIX, "can receive failed: %s", strerror(errno));
+				return -1;
+			}
+			break;
+		}
+		if(*rx_usec == 0)
+		{
+			*rx_usec = monotonic_usec();
+		}
+
+		for(int i = 0; i < n; i++)
+		{
+			const struct canfd_frame *cf = &frames[i];
+			int bus = busOf(addrs[i].can_ifindex);
+
+			frame_cnt++;
+			for(int k = firstSignal(bus, cf->can_id); k >= 0; k = next_signal[k])
+			{
+				double v;
+				if(decodeCanSignal(&signals[k], cf, &v) < 0)
+				{
+					continue;
+				}
+				if(!seen[k] || values[k] != v)
+				{
+					values[k] = v;
+					seen[k] = true;
+					changed = true;
+				}
+			}
+		}
+
+		if(frame_cnt % RX_REPORT_INTERVAL < (uint64_t)n)
+		{
+			DBG_INFO(LOG_PREFIX, "can receive: frames:%llu changes:%llu",
+				(unsigned long long)frame_cnt, (unsigned long long)changed_cnt);
+		}
+		if(n < RX_BATCH_MAX)
+		{
+			break;
+		}
+	}
+
+	if(!changed)
+	{
+		return 0;
+	}
+	changed_cnt++;
+	return (formatControl(val, len) < 0) ? -1 : 1;
+}
+
+} // namespace carla
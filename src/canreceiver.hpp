@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TMCAGL_CAN_RECEIVER_HPP
+#define TMCAGL_CAN_RECEIVER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/can.h>
+
+#include "canencoder.hpp"
+
+namespace carla
+{
+
+#define RX_BATCH_MAX	32
+#define RX_FOREIGN_IFINDEX_MAX	8	/* other CAN interfaces remembered by busOf() */
+
+/*
+ * Receives the driver inputs (steering wheel, pedals) of the rig from CAN.
+ *
+ * The signals are listed in the "rx_map" of steering_wheel.json, in the
+ * same format as the transmit map, and are decoded by the same codec. Only
+ * the ids of the map pass the kernel filter of the socket. All values seen
+ * so far are merged into one control command for the CARLA server.
+ */
+class CanReceiver
+{
+public:
+	explicit CanReceiver();
+	~CanReceiver();
+
+	int init(const char *hs, const char *ls);
+	int getFd() const { return s; }
+	int receive(char *val, size_t len, uint64_t *rx_usec);
+
+private:
+	CanReceiver(CanReceiver const&) = delete;
+	CanReceiver& operator=(CanReceiver const&) = delete;
+
+	int loadMap(const char *fname);
+	int buildIdTables();
+	int openSocket();
+	int busOf(int ifindex);
+	int firstSignal(int bus, canid_t can_id) const;
+	int formatControl(char *val, size_t len) const;
+
+private:
+	struct prop_info_t *signals;
+	double *values;
+	bool *seen;
+	unsigned int nSignal;
+	/* first signal of a frame by can id, the others follow in next_signal, -1 ends */
+	int16_t sff_first[CAN_BUS_MAX][CAN_SFF_MASK + 1];
+	canid_t *eff_keys;
+	uint8_t *eff_bus;
+	int16_t *eff_first;
+	uint32_t eff_mask;
+	int16_t *next_signal;
+	const char *bus_name[CAN_BUS_MAX];
+	int bus_ifindex[CAN_BUS_MAX];
+	int foreign_ifindex[RX_FOREIGN_IFINDEX_MAX];
+	unsigned int foreign_next;
+	int s;
+	struct canfd_frame frames[RX_BATCH_MAX];
+	struct sockaddr_can addrs[RX_BATCH_MAX];
+	struct iovec iov[RX_BATCH_MAX];
+	struct mmsghdr msgs[RX_BATCH_MAX];
+	uint64_t frame_cnt;
+	uint64_t changed_cnt;
+};
+
+} // namespace carla
+
+#endif  // !TMCAGL_CAN_RECEIVER_HPP
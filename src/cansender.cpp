@@ -22,13 +22,21 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <atomic>
 
 #include "cansender.hpp"
+#include "canbcm.hpp"
+#include "canbusload.hpp"
+#include "dbcparser.hpp"
+#include "latency.hpp"
 #include "debugmsg.hpp"
 
 namespace carla
@@ -46,121 +54,698 @@ double gearRatio[8] =
 	1.0/3.21	//Reverse
 };
 
+/* vehicle speed in km/h per engine rpm at a ratio of 1.0 */
+static double gearKmhPerRpm = GEAR_KMH_PER_RPM_DEFAULT;
+static double gearHysteresis = GEAR_HYSTERESIS_DEFAULT;
+
+enum tx_backend_t
+{
+	TX_BACKEND_RAW,		/* every frame written to a CAN_RAW socket */
+	TX_BACKEND_BCM		/* cyclic frames sent by the kernel broadcast manager */
+};
+
+/* bit rates and transmit budget of one bus, from "bus_load" of steering_wheel.json */
+struct bus_load_conf
+{
+	uint32_t bitrate;
+	uint32_t data_bitrate;
+	unsigned int budget;	/* percent of the bus, 0: no budget */
+	canid_t defer_id;	/* over budget, frames losing arbitration to this id wait */
+};
+
 struct transmission_bus_conf
 {
 	char *hs;
 	char *ls;
+	enum tx_backend_t backend;
+	struct bus_load_conf load[CAN_BUS_MAX];
+};
+
+#define TX_LATENCY_REPORT_INTERVAL 1000
+#define TX_BATCH_MAX 64
+#define TX_BUS_REPORT_INTERVAL_USEC (10 * 1000 * 1000ULL)
+#define TX_BUS_RETRY_USEC (2 * 1000 * 1000ULL)
+#define TX_BUS_BACKOFF_USEC 1000ULL	/* wait after ENOBUFS, the device queue drains at bus speed */
+#define TX_EPOLL_SCHEDULE CAN_BUS_MAX	/* epoll tag of the cycle timer, queues use their bus */
+#define TX_EPOLL_SOCKET 0x100		/* epoll tag flag of a bus socket */
+
+/*
+ * frame held back while the bus is over its budget, its latest state is
+ * read again when it is released
+ */
+struct tx_deferred_t
+{
+	uint16_t slot;
+	bool cyclic;
+	uint64_t enqueue_usec;
+};
+
+/*
+ * transmit state of one bus, only touched by the transmission loop
+ */
+struct tx_bus_t
+{
+	const char *name;	/* interface, NULL if not configured */
+	int s;			/* -1 while the interface is missing */
+	uint64_t retry_usec;	/* next attempt to open the bus */
+	bool used;		/* some property is routed to this bus */
+	bool blocked;		/* socket buffer full, waiting for EPOLLOUT */
+	uint64_t backoff_usec;	/* device queue full, no send before this time */
+	uint64_t block_start_usec;	/* start of the current saturation, 0 if none */
+	bool fd;		/* interface and socket accept CAN FD frames, found at open */
+	struct can_data_t batch[TX_BATCH_MAX];
+	struct iovec iov[TX_BATCH_MAX];
+	struct mmsghdr msgs[TX_BATCH_MAX];
+	unsigned int batch_cnt;
+	unsigned int batch_pos;	/* first frame of the batch not sent yet */
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t syscalls;
+	uint64_t fd_dropped;	/* CAN FD frames for a classic CAN interface */
+	uint64_t saturated;	/* sends refused with ENOBUFS or EAGAIN */
+	uint64_t retries;	/* sends again after saturation */
+	uint64_t superseded;	/* held frames dropped for a newer value of their id */
+	uint64_t errors;	/* frames dropped for other send errors */
+	uint64_t blocked_usec;	/* total time spent saturated */
+	uint64_t report_frames;	/* frames at the last report */
+	struct can_bus_load_t load;
+	unsigned int budget_permille;	/* 0: no budget */
+	uint32_t defer_key;	/* arbitration key from which frames are deferred */
+	struct tx_deferred_t *deferred;	/* one entry per slot of the bus at most */
+	unsigned int deferred_cnt;
+	uint64_t deferred_frames;	/* frames held back over budget */
 };
 
 static struct transmission_bus_conf trans_conf;
+static struct latency_stats_t tx_latency;	/* only touched by the transmission loop */
+static struct tx_bus_t tx_bus[CAN_BUS_MAX];
+static const char *const tx_bus_names[CAN_BUS_MAX] = {"hs", "ls"};
+static int tx_epfd = -1;
+static bool *tx_slot_deferred = NULL;	/* slot waits in the deferred list of its bus */
+static std::atomic<uint32_t> tx_load_permille[CAN_BUS_MAX];
+
+static void record_tx_latency(const struct can_data_t *dat)
+{
+	if (dat->cyclic) {
+		/* jitter is accounted by the schedule */
+		return;
+	}
 
-static void *transmission_event_loop(void *args)
+	latency_record(&tx_latency, monotonic_usec() - dat->enqueue_usec);
+	if ((tx_latency.count % TX_LATENCY_REPORT_INTERVAL) == 0) {
+		DBG_INFO(LOG_PREFIX, "can tx latency(enqueue to write) frames:%llu p50:%lluus p99:%lluus max:%lluus",
+			(unsigned long long)tx_latency.count,
+			(unsigned long long)latency_percentile(&tx_latency, 50),
+			(unsigned long long)latency_percentile(&tx_latency, 99),
+			(unsigned long long)tx_latency.max_usec);
+	}
+}
+
+/*
+ * find out once per open whether the interface carries CAN FD frames,
+ * a raw socket is switched into CAN FD mode then
+ */
+static bool detect_fd(int s, struct ifreq *ifr, bool raw)
 {
-	int s; /* can raw socket */
-	unsigned int required_mtu;
-	int mtu;
 	int enable_canfd = 1;
+
+	if (ioctl(s, SIOCGIFMTU, ifr) < 0) {
+		perror("SIOCGIFMTU");
+		return false;
+	}
+	if (ifr->ifr_mtu != CANFD_MTU) {
+		return false;
+	}
+
+	/* interface is ok - try to switch the socket into CAN FD mode */
+	if (raw && setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+		       &enable_canfd, sizeof(enable_canfd))){
+		fprintf(stderr, "error when enabling CAN FD support\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * check that the frame fits the bus, returns -1 if it cannot be sent
+ */
+static int check_frame(struct tx_bus_t *b, const struct can_data_t *dat)
+{
+	if ((unsigned int)dat->mtu <= CAN_MTU || b->fd) {
+		return 0;
+	}
+
+	if (b->fd_dropped++ == 0) {
+		DBG_ERROR(LOG_PREFIX, "CAN interface %s is not CAN FD capable, CAN FD frames are dropped", b->name);
+	}
+	return -1;
+}
+
+static void set_blocked(int bus, bool blocked)
+{
+	struct epoll_event ev;
+
+	tx_bus[bus].blocked = blocked;
+	ev.events = blocked ? (uint32_t)EPOLLOUT : 0;
+	ev.data.u32 = TX_EPOLL_SOCKET | (uint32_t)bus;
+	if (epoll_ctl(tx_epfd, EPOLL_CTL_MOD, tx_bus[bus].s, &ev) < 0) {
+		DBG_ERROR(LOG_PREFIX, "epoll_ctl of bus %s failed: %s", tx_bus_names[bus], strerror(errno));
+	}
+}
+
+/*
+ * the cycles bcm_setup_cycles() handed to the kernel load the bus without
+ * passing flush_bus(), count them as standing load of the bus
+ */
+static void add_bcm_cycles(int bus)
+{
+	struct tx_bus_t *b = &tx_bus[bus];
+
+	b->load.standing_ns = 0;
+	for (unsigned int i = 0; i < carla::can_slot_count(); i++) {
+		struct can_data_t dat;
+		uint32_t period_usec = carla::can_slot_cycle_usec((int)i);
+		if (period_usec == 0 || carla::can_slot_bus((int)i) != bus || carla::peek_can_slot((int)i, &dat) < 0
+			|| (dat.mtu == CANFD_MTU && !b->fd)) {
+			continue;
+		}
+		carla::bus_load_add_cycle(&b->load, &dat.frame, dat.mtu, period_usec);
+	}
+}
+
+/*
+ * open the socket of a bus, fails while its interface does not exist.
+ * the CAN FD capability is found here, once per open.
+ */
+static int open_bus(int bus)
+{
+	struct tx_bus_t *b = &tx_bus[bus];
 	struct sockaddr_can addr;
-	struct canfd_frame frame;
+	struct epoll_event ev;
 	struct ifreq ifr;
-//	int retry = 0;
+	int s;
 
-	/* open socket */
-	if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("open socket failed");
-		return 0;
+	unsigned int ifindex = if_nametoindex(b->name);
+	if (ifindex == 0) {
+		return -1;
 	}
 
-	addr.can_family = AF_CAN;
-	strcpy(ifr.ifr_name, trans_conf.hs);
-	/* wait until hs device start */
-	while(1) {
-		if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
-			carla::clear();		/* clear transmission msg queue */
-			perror("SIOCGIFINDEX");
-			sleep(2);
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, b->name, IFNAMSIZ - 1);
+
+	if (trans_conf.backend == TX_BACKEND_BCM) {
+		s = carla::bcm_open((int)ifindex);
+		if (s < 0) {
+			return -1;
 		}
-		else
-		{
-			break;
+		b->fd = detect_fd(s, &ifr, false);
+		if (carla::bcm_setup_cycles(s, bus, b->fd) < 0) {
+			close(s);
+			return -1;
 		}
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	} else {
+		if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+			perror("open socket failed");
+			return -1;
+		}
+
+		/* disable default receive filter on this RAW socket */
+		/* This is obsolete as we do not read from the socket at all, but for */
+		/* this reason we can remove the receive list in the Kernel to save a */
+		/* little (really a very little!) CPU usage.                          */
+		setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+		b->fd = detect_fd(s, &ifr, true);
+
+		memset(&addr, 0, sizeof(addr));
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = (int)ifindex;
+		if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror("bind");
+			close(s);
+			return -1;
+		}
+
+		/* a full bus must not stall the other one */
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
 	}
 
-	addr.can_ifindex = ifr.ifr_ifindex;
+	ev.events = 0;
+	ev.data.u32 = TX_EPOLL_SOCKET | (uint32_t)bus;
+	if (epoll_ctl(tx_epfd, EPOLL_CTL_ADD, s, &ev) < 0) {
+		DBG_ERROR(LOG_PREFIX, "epoll_ctl of bus %s failed: %s", tx_bus_names[bus], strerror(errno));
+		close(s);
+		return -1;
+	}
 
-	/* disable default receive filter on this RAW socket */
-	/* This is obsolete as we do not read from the socket at all, but for */
-	/* this reason we can remove the receive list in the Kernel to save a */
-	/* little (really a very little!) CPU usage.                          */
-	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+	b->s = s;
+	if (trans_conf.backend == TX_BACKEND_BCM) {
+		add_bcm_cycles(bus);
+	}
+	b->blocked = false;
+	b->backoff_usec = 0;
+	b->block_start_usec = 0;
+	DBG_INFO(LOG_PREFIX, "can bus %s: %s opened%s", tx_bus_names[bus], b->name, b->fd ? " (CAN FD)" : "");
+	return 0;
+}
 
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 0;
+static void drop_deferred(struct tx_bus_t *b)
+{
+	for (unsigned int i = 0; i < b->deferred_cnt; i++) {
+		tx_slot_deferred[b->deferred[i].slot] = false;
 	}
+	b->deferred_cnt = 0;
+}
 
-	while(1)
-	{
-		struct can_data_t* p = carla::pop();
-		if(p == NULL)
-		{
-			/* sleep 150ms */
-			usleep(150000);
+/*
+ * hold a frame back while the bus is over its budget, returns false if it
+ * is sent anyway. only the latest state of a slot is sent on release.
+ */
+static bool defer_frame(struct tx_bus_t *b, const struct can_data_t *dat)
+{
+	if (carla::can_slot_priority(dat->slot) != CAN_PRIO_LOW
+		&& carla::can_arbitration_key(dat->frame.can_id) < b->defer_key) {
+		return false;
+	}
+
+	b->deferred_frames++;
+	if (!tx_slot_deferred[dat->slot]) {
+		struct tx_deferred_t *d = &b->deferred[b->deferred_cnt++];
+		tx_slot_deferred[dat->slot] = true;
+		d->slot = (uint16_t)dat->slot;
+		d->cyclic = dat->cyclic;
+		d->enqueue_usec = dat->enqueue_usec;
+	}
+	return true;
+}
+
+/*
+ * the bus is below its budget again, move deferred frames into the batch
+ * from position n on. returns the new batch size.
+ */
+static unsigned int release_deferred(struct tx_bus_t *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->deferred_cnt && n < TX_BATCH_MAX; i++) {
+		const struct tx_deferred_t *d = &b->deferred[i];
+		tx_slot_deferred[d->slot] = false;
+		if (carla::can_slot_pending(d->slot)) {
+			/* a newer state is queued and sent from there */
+			b->superseded++;
+			continue;
+		}
+		carla::peek_can_slot(d->slot, &b->batch[n]);
+		b->batch[n].cyclic = d->cyclic;
+		b->batch[n].enqueue_usec = d->enqueue_usec;
+		if (check_frame(b, &b->batch[n]) < 0) {
 			continue;
 		}
+		b->iov[n].iov_len = (size_t)b->batch[n].mtu;
+		n++;
+	}
+	memmove(b->deferred, b->deferred + i, (b->deferred_cnt - i) * sizeof(b->deferred[0]));
+	b->deferred_cnt -= i;
+
+	return n;
+}
+
+static inline bool over_budget(struct tx_bus_t *b, uint64_t now)
+{
+	return b->budget_permille != 0 && carla::bus_load_permille(&b->load, now) >= b->budget_permille;
+}
+
+/*
+ * the interface went away or down, drop the socket so that the bus is
+ * opened again and its capabilities are found again once it is back
+ */
+static void close_bus(int bus)
+{
+	struct tx_bus_t *b = &tx_bus[bus];
+
+	DBG_ERROR(LOG_PREFIX, "can bus %s: %s lost: %s", tx_bus_names[bus], b->name, strerror(errno));
+	close(b->s);	/* also removes it from epoll */
+	b->s = -1;
+	b->load.standing_ns = 0;	/* the kernel cycles of a bcm socket end with it */
+	b->retry_usec = monotonic_usec() + TX_BUS_RETRY_USEC;
+	b->blocked = false;
+	b->backoff_usec = 0;
+	b->block_start_usec = 0;
+	/* the cycles of the frames left in the batch are missed, not due for good */
+	for (unsigned int i = b->batch_pos; i < b->batch_cnt; i++) {
+		carla::complete_can_deadline(&b->batch[i], false);
+	}
+	b->batch_cnt = 0;
+	b->batch_pos = 0;
+	drop_deferred(b);
+}
+
+/* errors after which the socket has to be opened again */
+static inline bool is_bus_lost(int err)
+{
+	return err == ENODEV || err == ENXIO || err == ENETDOWN;
+}
+
+/*
+ * epoll reports a pending socket error (EPOLLERR) until SO_ERROR is read,
+ * also while nothing is sent on the bus. read it, and drop the socket if
+ * the interface is gone.
+ */
+static void check_bus_error(int bus, uint32_t events)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(tx_bus[bus].s, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		err = errno;
+	}
+	if (is_bus_lost(err) || (events & EPOLLHUP)) {
+		errno = (err != 0) ? err : ENETDOWN;
+		close_bus(bus);
+	} else if (err != 0) {
+		DBG_ERROR(LOG_PREFIX, "can bus %s: socket error: %s", tx_bus_names[bus], strerror(err));
+	}
+}
+
+/*
+ * send the held frames of a batch, returns the number of frames sent
+ * or -1 with errno set if the first one failed
+ */
+static int send_batch(struct tx_bus_t *b)
+{
+	unsigned int cnt = b->batch_cnt - b->batch_pos;
+
+	if (trans_conf.backend == TX_BACKEND_RAW) {
+		b->syscalls++;
+		return sendmmsg(b->s, &b->msgs[b->batch_pos], cnt, 0);
+	}
+
+	/* the broadcast manager takes one frame per write */
+	for (unsigned int i = 0; i < cnt; i++) {
+		b->syscalls++;
+		if (carla::bcm_update(b->s, &b->batch[b->batch_pos + i]) < 0) {
+			return (i != 0) ? (int)i : -1;
+		}
+	}
+	return (int)cnt;
+}
+
+/*
+ * the bus refused a send: wait until the socket is writable again and,
+ * for a full device queue, for a short backoff as well
+ */
+static void start_saturation(int bus, bool device_full, uint64_t now)
+{
+	struct tx_bus_t *b = &tx_bus[bus];
+
+	b->saturated++;
+	if (b->block_start_usec == 0) {
+		b->block_start_usec = now;
+	}
+	if (device_full) {
+		b->backoff_usec = now + TX_BUS_BACKOFF_USEC;
+	}
+	set_blocked(bus, true);
+}
+
+/*
+ * resume after saturation, held frames whose id got a newer value in the
+ * meantime are dropped, the newer value is queued already and takes over
+ * a pending deadline of the slot
+ */
+static void end_saturation(struct tx_bus_t *b, uint64_t now)
+{
+	unsigned int n = b->batch_pos;
 
-		/* parse CAN frame */
-		required_mtu = carla::parse_canframe(p->dat, &frame);
-		free(p);
-		if (!required_mtu){
-			fprintf(stderr, "\nWrong CAN-frame format! Try:\n\n");
-			fprintf(stderr, "    <can_id>#{R|data}          for CAN 2.0 frames\n");
-			fprintf(stderr, "    <can_id>##<flags>{data}    for CAN FD frames\n\n");
-			fprintf(stderr, "<can_id> can have 3 (SFF) or 8 (EFF) hex chars\n");
-			fprintf(stderr, "{data} has 0..8 (0..64 CAN FD) ASCII hex-values (optionally");
-			fprintf(stderr, " separated by '.')\n");
-			fprintf(stderr, "<flags> a single ASCII Hex value (0 .. F) which defines");
-			fprintf(stderr, " canfd_frame.flags\n\n");
-			fprintf(stderr, "e.g. 5A1#11.2233.44556677.88 / 123#DEADBEEF / 5AA# / ");
-			fprintf(stderr, "123##1 / 213##311\n     1F334455#1122334455667788 / 123#R ");
-			fprintf(stderr, "for remote transmission request.\n\n");
+	b->blocked_usec += now - b->block_start_usec;
+	b->block_start_usec = 0;
+	b->retries++;
+
+	for (unsigned int i = b->batch_pos; i < b->batch_cnt; i++) {
+		if (carla::can_slot_pending(b->batch[i].slot)) {
+			b->superseded++;
 			continue;
 		}
+		if (n != i) {
+			b->batch[n] = b->batch[i];
+			b->iov[n].iov_len = (size_t)b->batch[n].mtu;
+		}
+		n++;
+	}
+	b->batch_cnt = n;
+}
+
+/*
+ * drain the pending frames of a bus and send them with one sendmmsg() call
+ * per batch, until the queue is empty or the bus is saturated
+ */
+static void flush_bus(int bus, uint64_t now)
+{
+	struct tx_bus_t *b = &tx_bus[bus];
 
-		if (required_mtu > CAN_MTU) {
+	if (b->blocked || now < b->backoff_usec) {
+		return;
+	}
+	if (b->block_start_usec != 0) {
+		end_saturation(b, now);
+	}
 
-			/* check if the frame fits into the CAN netdevice */
-			if (ioctl(s, SIOCGIFMTU, &ifr) < 0) {
-				perror("SIOCGIFMTU");
-				continue;
+	while (true) {
+		if (b->batch_pos == b->batch_cnt) {
+			bool over = over_budget(b, now);
+			unsigned int n = over ? 0 : release_deferred(b, 0);
+
+			/* frames are built in binary form by makeCanFrame() */
+			while (n < TX_BATCH_MAX && carla::pop(bus, &b->batch[n])) {
+				/* a deadline is only served by a frame that is written */
+				if (check_frame(b, &b->batch[n]) < 0 || (over && defer_frame(b, &b->batch[n]))) {
+					carla::complete_can_deadline(&b->batch[n], false);
+					continue;
+				}
+				b->iov[n].iov_len = (size_t)b->batch[n].mtu;
+				n++;
 			}
-			mtu = ifr.ifr_mtu;
+			b->batch_cnt = n;
+			b->batch_pos = 0;
+			if (n == 0) {
+				return;
+			}
+		}
 
-			if (mtu != CANFD_MTU) {
-				fprintf(stderr, "CAN interface ist not CAN FD capable - sorry.\n");
+		int ret = send_batch(b);
+		if (ret < 0) {
+			if (errno == EINTR) {
 				continue;
 			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				/* keep the rest of the batch until the bus drains */
+				start_saturation(bus, errno == ENOBUFS, now);
+				return;
+			}
+			if (is_bus_lost(errno)) {
+				close_bus(bus);
+				return;
+			}
+			/* the first frame failed, drop it and send the rest */
+			char text[CANFRAME_STR_SIZE];
+			struct can_data_t *dat = &b->batch[b->batch_pos];
+			DBG_ERROR(LOG_PREFIX, "write %s failed: %s",
+				carla::canframe2str(&dat->frame, dat->mtu, text, sizeof(text)), strerror(errno));
+			b->errors++;
+			carla::complete_can_deadline(dat, false);
+			b->batch_pos++;
+			continue;
+		}
+
+		for (int i = 0; i < ret; i++) {
+			struct can_data_t *dat = &b->batch[b->batch_pos + (unsigned int)i];
+			b->bytes += dat->frame.len;
+			carla::bus_load_add(&b->load, now, carla::bus_load_frame_ns(&b->load, &dat->frame, dat->mtu));
+			carla::complete_can_deadline(dat, true);
+			record_tx_latency(dat);
+		}
+		b->batch_pos += (unsigned int)ret;
+		b->frames += (uint64_t)ret;
+	}
+}
+
+static void report_buses(uint64_t interval_usec)
+{
+	for (int bus = 0; bus < CAN_BUS_MAX; bus++) {
+		struct tx_bus_t *b = &tx_bus[bus];
+		struct can_queue_stats_t stats;
+
+		if (!b->used) {
+			continue;
+		}
+		carla::get_can_queue_stats(bus, &stats);
+		unsigned int permille = carla::bus_load_permille(&b->load, monotonic_usec());
+		DBG_INFO(LOG_PREFIX, "can bus %s: depth:%u/%u frames:%llu (%llu/s) bytes:%llu frames/syscall:%.2f coalesced:%llu"
+			" saturated:%llu retries:%llu superseded:%llu blocked:%llums errors:%llu fd dropped:%llu"
+			" load:%u.%u%% peak:%u.%u%% deferred:%llu (%u waiting)%s",
+			tx_bus_names[bus], stats.depth, stats.size,
+			(unsigned long long)b->frames,
+			(unsigned long long)((b->frames - b->report_frames) * 1000000ULL / interval_usec),
+			(unsigned long long)b->bytes,
+			b->syscalls ? (double)b->frames / (double)b->syscalls : 0.0,
+			(unsigned long long)stats.coalesced,
+			(unsigned long long)b->saturated,
+			(unsigned long long)b->retries,
+			(unsigned long long)b->superseded,
+			(unsigned long long)(b->blocked_usec / 1000),
+			(unsigned long long)b->errors,
+			(unsigned long long)b->fd_dropped,
+			permille / 10, permille % 10,
+			b->load.peak_permille / 10, b->load.peak_permille % 10,
+			(unsigned long long)b->deferred_frames, b->deferred_cnt,
+			(b->s < 0) ? " (down)" : (b->blocked ? " (blocked)" : ""));
+		b->report_frames = b->frames;
+	}
+}
+
+/*
+ * one thread serves the queues and sockets of all buses through epoll
+ */
+static void *transmission_event_loop(void *args)
+{
+	struct epoll_event ev;
+	struct epoll_event events[CAN_BUS_MAX * 2 + 1];
+	uint64_t now = monotonic_usec();
+	uint64_t next_report = now + TX_BUS_REPORT_INTERVAL_USEC;
+
+	tx_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (tx_epfd < 0) {
+		perror("epoll_create1");
+		return 0;
+	}
+
+	for (int bus = 0; bus < CAN_BUS_MAX; bus++) {
+		struct tx_bus_t *b = &tx_bus[bus];
+		struct can_queue_stats_t stats;
+
+		carla::get_can_queue_stats(bus, &stats);
+		b->name = (bus == CAN_BUS_HS) ? trans_conf.hs : trans_conf.ls;
+		b->used = (stats.size != 0);
+		b->s = -1;
+		b->retry_usec = 0;
+		carla::bus_load_init(&b->load, trans_conf.load[bus].bitrate, trans_conf.load[bus].data_bitrate, now);
+		b->budget_permille = trans_conf.load[bus].budget * 10;
+		/* without defer_id only the low priority class is deferred */
+		b->defer_key = (trans_conf.load[bus].defer_id != 0)
+			? carla::can_arbitration_key(trans_conf.load[bus].defer_id) : UINT32_MAX;
+		if (b->budget_permille != 0 && b->used) {
+			if (tx_slot_deferred == NULL) {
+				tx_slot_deferred = (bool *)calloc(carla::can_slot_count(), sizeof(bool));
+			}
+			b->deferred = (struct tx_deferred_t *)calloc(stats.size, sizeof(struct tx_deferred_t));
+			if (tx_slot_deferred == NULL || b->deferred == NULL) {
+				DBG_ERROR(LOG_PREFIX, "not enough memory for the budget of bus %s, disabled", tx_bus_names[bus]);
+				b->budget_permille = 0;
+			} else {
+				char from[32] = "";
+				if (trans_conf.load[bus].defer_id != 0) {
+					snprintf(from, sizeof(from), " and ids from %X", trans_conf.load[bus].defer_id & CAN_EFF_MASK);
+				}
+				DBG_INFO(LOG_PREFIX, "can bus %s: budget %u%% of %u bit/s, low priority ids%s are deferred",
+					tx_bus_names[bus], trans_conf.load[bus].budget, b->load.bitrate, from);
+			}
+		}
+		for (unsigned int i = 0; i < TX_BATCH_MAX; i++) {
+			memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+			b->iov[i].iov_base = &b->batch[i].frame;
+			b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = (uint32_t)bus;
+		epoll_ctl(tx_epfd, EPOLL_CTL_ADD, carla::can_queue_event_fd(bus), &ev);
+	}
+
+	if (trans_conf.backend == TX_BACKEND_RAW) {
+		ev.events = EPOLLIN;
+		ev.data.u32 = TX_EPOLL_SCHEDULE;
+		epoll_ctl(tx_epfd, EPOLL_CTL_ADD, carla::can_schedule_fd(), &ev);
+
+		/* cyclic ids are sent from now on, updates in between are sent at once */
+		carla::start_can_schedule();
+	}
+
+	while(1)
+	{
+		bool waiting = false;
+		int timeout = -1;
 
-			/* interface is ok - try to switch the socket into CAN FD mode */
-			if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
-				       &enable_canfd, sizeof(enable_canfd))){
-				fprintf(stderr, "error when enabling CAN FD support\n");
+		now = monotonic_usec();
+		for (int bus = 0; bus < CAN_BUS_MAX; bus++) {
+			struct tx_bus_t *b = &tx_bus[bus];
+			if (!b->used) {
 				continue;
 			}
+			if (b->s < 0 && b->name != NULL && now >= b->retry_usec && open_bus(bus) < 0) {
+				/* wait until the device starts */
+				b->retry_usec = now + TX_BUS_RETRY_USEC;
+			}
+			if (b->s < 0) {
+				carla::clear(bus);	/* clear transmission msg queue */
+				waiting = waiting || (b->name != NULL);
+				continue;
+			}
+			flush_bus(bus, now);
+			tx_load_permille[bus].store(carla::bus_load_permille(&b->load, now), std::memory_order_relaxed);
+			if (!b->blocked && b->backoff_usec > now) {
+				/* device queue full, try again when some frames left it */
+				int ms = (int)((b->backoff_usec - now + 999) / 1000);
+				timeout = (timeout < 0 || ms < timeout) ? ms : timeout;
+			} else if (!b->blocked && b->deferred_cnt != 0) {
+				/* see whether the load has dropped once the window moved on */
+				int ms = (int)(BUS_LOAD_BUCKET_USEC / 1000);
+				timeout = (timeout < 0 || ms < timeout) ? ms : timeout;
+			}
+		}
+		if (waiting && (timeout < 0 || timeout > (int)(TX_BUS_RETRY_USEC / 1000))) {
+			timeout = (int)(TX_BUS_RETRY_USEC / 1000);
+		}
 
-			/* ensure discrete CAN FD length values 0..8, 12, 16, 20, 24, 32, 64 */
-			frame.len = carla::can_dlc2len(carla::can_len2dlc(frame.len));
+		int n = epoll_wait(tx_epfd, events, (int)(sizeof(events) / sizeof(events[0])), timeout);
+		for (int i = 0; i < n; i++) {
+			uint32_t tag = events[i].data.u32;
+			uint64_t count;
+
+			if (tag & TX_EPOLL_SOCKET) {
+				int bus = (int)(tag & ~TX_EPOLL_SOCKET);
+				if (tx_bus[bus].s >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+					check_bus_error(bus, events[i].events);
+				}
+				if (tx_bus[bus].s >= 0 && (events[i].events & EPOLLOUT)) {
+					set_blocked(bus, false);
+				}
+			} else if (tag == TX_EPOLL_SCHEDULE) {
+				carla::on_can_schedule_timer();
+			} else if (read(carla::can_queue_event_fd((int)tag), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+				DBG_ERROR(LOG_PREFIX, "can transmit eventfd read failed");
+			}
 		}
 
-		/* send frame */
-		if (write(s, &frame, required_mtu) != required_mtu) {
-			perror("write");
+		now = monotonic_usec();
+		if (now >= next_report) {
+			report_buses(now - next_report + TX_BUS_REPORT_INTERVAL_USEC);
+			next_report = now + TX_BUS_REPORT_INTERVAL_USEC;
 		}
 	}
 }
 
-CanSender::CanSender()
+CanSender::CanSender() :
+wheel_info(NULL),
+prop_hash(NULL),
+prop_hash_mask(0),
+gear_handle(INVALID_PROP_HANDLE),
+update_cnt(0),
+interval_props(NULL),
+interval_cnt(0),
+held_release_usec(0)
 {
+	memset(&gear_est, 0, sizeof(gear_est));
 }
 
 CanSender::~CanSender()
@@ -182,7 +767,83 @@ int CanSender::init()
         DBG_INFO(LOG_PREFIX, "wheel_info %s %s %d", wheel_info->property[i].name, wheel_info->property[i].can_id, wheel_info->property[i].bit_pos);
     }
     ///
-    carla::init_can_encoder();
+    if(carla::init_can_encoder(wheel_info->nData))
+    {
+        DBG_ERROR(LOG_PREFIX, "init can encoder failed");
+		return -1;
+    }
+
+    if(buildPropertyIndex())
+    {
+        DBG_ERROR(LOG_PREFIX, "init property index failed");
+		return -1;
+    }
+
+    /* the gear is derived from speed and engine speed, see updateGear() */
+    gear_handle = getPropertyHandle(TRANSMISSION_GEAR_INFO);
+    gear_estimator_init(&gear_est, gearRatio, gearKmhPerRpm, gearHysteresis);
+
+    /* one frame slot per can id and bus, properties sharing an id share the slot */
+    for(uint i = 0; i < wheel_info->nData; i++)
+    {
+        struct prop_info_t *prop = &wheel_info->property[i];
+        if(prop->bus == CAN_BUS_LS && trans_conf.ls == NULL)
+        {
+            DBG_ERROR(LOG_PREFIX, "%s is routed to ls, but no ls bus is configured", prop->name);
+            prop->slot = -1;
+            continue;
+        }
+        prop->slot = (prop->mask != 0) ? carla::register_can_slot(prop->bus, prop->frame_id, prop->dlc,
+            prop->fd ? CANFD_MTU : CAN_MTU, prop->fd_flags) : -1;
+        if(prop->slot >= 0 && prop->cycle_ms != 0)
+        {
+            carla::set_can_slot_cycle(prop->slot, prop->cycle_ms);
+        }
+        if(prop->slot >= 0)
+        {
+            carla::set_can_slot_priority(prop->slot, prop->priority);
+        }
+    }
+    /* pending frames are sent by priority class, then in arbitration order */
+    carla::order_can_slots();
+
+    /* values held back by MIN_INTERVAL are sent from releaseHeld() */
+    for(uint i = 0; i < wheel_info->nData; i++)
+    {
+        if(wheel_info->property[i].min_interval_usec != 0 && wheel_info->property[i].slot >= 0)
+        {
+            interval_cnt++;
+        }
+    }
+    if(interval_cnt != 0)
+    {
+        interval_props = (struct prop_info_t **)malloc(interval_cnt * sizeof(*interval_props));
+        if(interval_props == NULL)
+        {
+            DBG_ERROR(LOG_PREFIX, "not enogh memory");
+            return -1;
+        }
+        interval_cnt = 0;
+        for(uint i = 0; i < wheel_info->nData; i++)
+        {
+            if(wheel_info->property[i].min_interval_usec != 0 && wheel_info->property[i].slot >= 0)
+            {
+                interval_props[interval_cnt++] = &wheel_info->property[i];
+            }
+        }
+    }
+
+#ifdef CARLA_STATIC_SIGNALS
+    /* updateSignal() uses the slot numbers computed by the generator */
+    for(uint i = 0; i < wheel_info->nData; i++)
+    {
+        if(wheel_info->property[i].slot != signals::kSignals[i].slot)
+        {
+            DBG_ERROR(LOG_PREFIX, "static signal table does not match slot of %s", wheel_info->property[i].name);
+            return -1;
+        }
+    }
+#endif
 
     if(initTransmissionLoop())
     {
@@ -301,34 +962,161 @@ int CanSender::readJsonConfig()
 		DBG_ERROR(LOG_PREFIX, "json: Invalid steering_wheel.json format");
 		return -1;
 	}
+	const char *wheel_map = NULL;
+	const char *dbc = NULL;
 	json_object_object_foreach(jobj, key, val)
 	{
 		if(strcmp(key,"wheel_map") == 0)
 		{
-			wheel_define_init(json_object_get_string(val));
+			wheel_map = json_object_get_string(val);
+		}
+		else if(strcmp(key,"dbc") == 0)
+		{
+			dbc = json_object_get_string(val);
 		}
 		else if(strcmp(key,"gear_para") == 0)
 		{
 			wheel_gear_para_init(json_object_get_string(val));
 		}
+		else if(strcmp(key,"bus_load") == 0)
+		{
+			parse_bus_load_json(val);
+		}
+		else if(strcmp(key,"tx_backend") == 0)
+		{
+			const char *backend = json_object_get_string(val);
+			if(strcmp(backend, "bcm") == 0)
+			{
+				trans_conf.backend = TX_BACKEND_BCM;
+			}
+			else if(strcmp(backend, "raw") != 0)
+			{
+				DBG_ERROR(LOG_PREFIX, "json: unknown tx_backend \"%s\", using raw", backend);
+			}
+		}
+	}
+
+#ifdef CARLA_STATIC_SIGNALS
+	/* the signal layout is compiled in, see tools/gen_signal_table.py */
+	if(dbc != NULL || wheel_map != NULL)
+	{
+		DBG_NOTICE(LOG_PREFIX, "built with static signals, \"%s\" is not read", (dbc != NULL) ? dbc : wheel_map);
 	}
+	static_define_init();
+#else
+	/* a dbc file replaces the hand written wheel map */
+	if(dbc != NULL)
+	{
+		dbc_define_init(dbc);
+	}
+	else if(wheel_map != NULL)
+	{
+		wheel_define_init(wheel_map);
+	}
+#endif
 	json_object_put(jobj);
 	free(filebuf);
 
+	if(wheel_info == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "no signal definitions loaded");
+		return -1;
+	}
+
 	return 0;
 }
 
-int CanSender::wheel_define_init(const char *fname)
+int CanSender::dbc_define_init(const char *fname)
 {
-	struct json_object *jobj;
-	int fd_wheel_map;
-	struct stat stbuf;
-	char *filebuf;
+	struct dbc_db_t db;
+	uint64_t start = monotonic_usec();
 
-	fd_wheel_map = open(fname, O_RDONLY);
-	if(fd_wheel_map < 0)
+	if(load_dbc(fname, &db) < 0)
 	{
-		DBG_ERROR(LOG_PREFIX, "wheel map is not access");
+		return -1;
+	}
+
+	wheel_info = (struct wheel_info_t *)malloc(sizeof(struct wheel_info_t) + (size_t)db.nSignal * sizeof(struct prop_info_t));
+	if(wheel_info == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "not enogh memory");
+		free_dbc(&db);
+		return -1;
+	}
+
+	/* the strings move over to wheel_info */
+	memcpy(wheel_info->property, db.signal, (size_t)db.nSignal * sizeof(struct prop_info_t));
+	wheel_info->nData = db.nSignal;
+	free(db.signal);
+
+	unsigned int rejected = 0;
+	for(unsigned int i = 0; i < wheel_info->nData; i++)
+	{
+		if(init_prop_codec(&wheel_info->property[i]) < 0)
+		{
+			rejected++;
+		}
+	}
+
+	DBG_INFO(LOG_PREFIX, "dbc \"%s\": %u messages, %u signals (%u rejected) loaded in %lluus",
+		fname, db.nMessage, wheel_info->nData, rejected, (unsigned long long)(monotonic_usec() - start));
+	return 0;
+}
+
+#ifdef CARLA_STATIC_SIGNALS
+int CanSender::static_define_init()
+{
+	wheel_info = (struct wheel_info_t *)calloc(1, sizeof(struct wheel_info_t) + signals::SIGNAL_COUNT * sizeof(struct prop_info_t));
+	if(wheel_info == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "not enogh memory");
+		return -1;
+	}
+
+	for(unsigned int i = 0; i < signals::SIGNAL_COUNT; i++)
+	{
+		const struct signals::signal_desc_t *sig = &signals::kSignals[i];
+		struct prop_info_t *prop = &wheel_info->property[i];
+		prop->name = sig->name;
+		prop->can_id = sig->can_id;
+		prop->bit_pos = sig->bit_pos;
+		prop->bit_size = sig->bit_size;
+		prop->dlc = sig->dlc;
+		prop->cycle_ms = sig->cycle_ms;
+		prop->bus = sig->bus;
+		prop->priority = sig->priority;
+		prop->fd = sig->fd;
+		prop->fd_flags = sig->fd_flags;
+		prop->byte_order = sig->byte_order;
+		prop->is_signed = sig->is_signed;
+		prop->factor = sig->factor;
+		prop->offset = sig->offset;
+		prop->deadband = sig->deadband;
+		prop->deadband_rel = sig->deadband_rel;
+		prop->min_interval_usec = sig->min_interval_usec;
+		prop->smoothing = sig->smoothing;
+		if(init_prop_codec(prop) < 0)
+		{
+			return -1;
+		}
+	}
+	wheel_info->nData = signals::SIGNAL_COUNT;
+
+	return 0;
+}
+#endif
+
+int CanSender::wheel_define_init(const char *fname)
+{
+	struct json_object *jobj;
+	int fd_wheel_map;
+	struct stat stbuf;
+	char *filebuf;
+
+	fd_wheel_map = open(fname, O_RDONLY);
+	if(fd_wheel_map < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "wheel map is not access");
 		return -1;
 	}
 
@@ -428,6 +1216,66 @@ int CanSender::parse_json(json_object *obj)
 	return err;
 }
 
+/*
+ * "bus_load": {"hs": {"bitrate": 500000, "data_bitrate": 2000000, "budget": 70, "defer_id": "400"}}
+ */
+int CanSender::parse_bus_load_json(json_object *obj)
+{
+	int err = 0;
+
+	json_object_object_foreach(obj, bus_name, bus_obj)
+	{
+		struct bus_load_conf *conf;
+		if(strcmp(bus_name, "hs") == 0)
+		{
+			conf = &trans_conf.load[CAN_BUS_HS];
+		}
+		else if(strcmp(bus_name, "ls") == 0)
+		{
+			conf = &trans_conf.load[CAN_BUS_LS];
+		}
+		else
+		{
+			++err;
+			DBG_ERROR(LOG_PREFIX, "json: unknown bus \"%s\" in bus_load", bus_name);
+			continue;
+		}
+
+		json_object_object_foreach(bus_obj, key, val)
+		{
+			if(strcmp(key, "bitrate") == 0)
+			{
+				conf->bitrate = (uint32_t)json_object_get_int(val);
+			}
+			else if(strcmp(key, "data_bitrate") == 0)
+			{
+				conf->data_bitrate = (uint32_t)json_object_get_int(val);
+			}
+			else if(strcmp(key, "budget") == 0)
+			{
+				int budget = json_object_get_int(val);
+				conf->budget = (budget > 0 && budget <= 100) ? (unsigned int)budget : 0;
+			}
+			else if(strcmp(key, "defer_id") == 0)
+			{
+				const char *tmp = json_object_get_string(val);
+				if(tmp == NULL || carla::parse_can_id(tmp, &conf->defer_id) < 0)
+				{
+					++err;
+					conf->defer_id = 0;
+					DBG_ERROR(LOG_PREFIX, "json: invalid defer_id in bus_load");
+				}
+			}
+			else
+			{
+				++err;
+				DBG_ERROR(LOG_PREFIX, "json: Unknown  key \"%s\" in bus_load", key);
+			}
+		}
+	}
+	return err;
+}
+
 int CanSender::parse_gear_para_json(json_object *obj)
 {
 	int err = 0;
@@ -499,6 +1347,30 @@ int CanSender::parse_gear_para_json(json_object *obj)
 				DBG_ERROR(LOG_PREFIX, "json: Need  array \"%s\"", key);
 			}
 		}
+        else if (strcmp(key,"KMH_PER_RPM") == 0)
+        {
+			double kmh_per_rpm = json_object_get_double(val);
+			if(kmh_per_rpm > 0)
+			{
+				gearKmhPerRpm = kmh_per_rpm;
+			}
+			else
+			{
+				DBG_ERROR(LOG_PREFIX, "json: invalid KMH_PER_RPM, keeping %.4f", gearKmhPerRpm);
+			}
+		}
+        else if (strcmp(key,"HYSTERESIS") == 0)
+        {
+			double hysteresis = json_object_get_double(val);
+			if(hysteresis >= 0 && hysteresis < 1)
+			{
+				gearHysteresis = hysteresis;
+			}
+			else
+			{
+				DBG_ERROR(LOG_PREFIX, "json: HYSTERESIS must be in [0, 1), keeping %.2f", gearHysteresis);
+			}
+		}
         else
         {
 			DBG_ERROR(LOG_PREFIX, "json: Unknown  key \"%s\"", key);
@@ -508,6 +1380,7 @@ int CanSender::parse_gear_para_json(json_object *obj)
 }
 
 #define DEFAULT_PROP_CNT (16)
+#define PROP_HASH_MAX_ENTRIES (1U << 14)
 int CanSender::parse_propertys(json_object *obj_propertys)
 {
 	int err = 0;
@@ -553,12 +1426,18 @@ int CanSender::parse_propertys(json_object *obj_propertys)
 	return err;
 }
 
-int CanSender::parse_property(int idx, json_object *obj_property)
+/*
+ * fill in a property from its json map entry, shared by the transmit map
+ * and the receive map
+ */
+int parse_prop_info(struct prop_info_t *prop, json_object *obj_property)
 {
 	int var_type = 0;
+	int is_signed = -1;
 	char *name = NULL;
 	char *canid = NULL;
 
+	prop->priority = CAN_PRIO_NORMAL;
 	if(obj_property)
 	{
 		json_object_object_foreach(obj_property, key, val)
@@ -579,47 +1458,416 @@ int CanSender::parse_property(int idx, json_object *obj_property)
 			else if(strcmp("BIT_POSITION", key) == 0)
 			{
 				const char * tmp = json_object_get_string(val);
-				wheel_info->property[idx].bit_pos = (uint8_t)strtoul(tmp, 0, 0);
+				prop->bit_pos = (uint16_t)strtoul(tmp, 0, 0);
 			}
 			else if(strcmp("BIT_SIZE", key) == 0)
 			{
 				const char * tmp = json_object_get_string(val);
-				wheel_info->property[idx].bit_size = (uint8_t)strtoul(tmp, 0, 0);
+				prop->bit_size = (uint8_t)strtoul(tmp, 0, 0);
 			}
 			else if(strcmp("DLC", key) == 0)
 			{
 				const char * tmp = json_object_get_string(val);
-				wheel_info->property[idx].dlc = (uint8_t)strtoul(tmp, 0, 0);
+				prop->dlc = (uint8_t)strtoul(tmp, 0, 0);
+			}
+			else if(strcmp("CYCLE", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->cycle_ms = (uint16_t)strtoul(tmp, 0, 0);
+			}
+			else if(strcmp("BYTE_ORDER", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				if(strcmp(tmp, "intel") == 0 || strcmp(tmp, "little_endian") == 0)
+				{
+					prop->byte_order = SIGNAL_ORDER_INTEL;
+				}
+				else if(strcmp(tmp, "motorola") == 0 || strcmp(tmp, "big_endian") == 0)
+				{
+					prop->byte_order = SIGNAL_ORDER_MOTOROLA;
+				}
+				else if(strcmp(tmp, "legacy") != 0)
+				{
+					DBG_ERROR(LOG_PREFIX, "json: unknown byte order \"%s\", using legacy", tmp);
+				}
 			}
+			else if(strcmp("FD", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->fd = (strcmp(tmp, "true") == 0 || strcmp(tmp, "1") == 0);
+			}
+			else if(strcmp("BRS", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				if(strcmp(tmp, "true") == 0 || strcmp(tmp, "1") == 0)
+				{
+					prop->fd_flags |= CANFD_BRS;
+				}
+			}
+			else if(strcmp("BUS", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				if(strcmp(tmp, "ls") == 0)
+				{
+					prop->bus = CAN_BUS_LS;
+				}
+				else if(strcmp(tmp, "hs") != 0)
+				{
+					DBG_ERROR(LOG_PREFIX, "json: unknown bus \"%s\", using hs", tmp);
+				}
+			}
+			else if(strcmp("FACTOR", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->factor = strtod(tmp, NULL);
+			}
+			else if(strcmp("OFFSET", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->offset = strtod(tmp, NULL);
+			}
+			else if(strcmp("SIGNED", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				is_signed = (strcmp(tmp, "true") == 0 || strcmp(tmp, "1") == 0) ? 1 : 0;
+			}
+			else if(strcmp("PRIORITY", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				if(strcmp(tmp, "high") == 0)
+				{
+					prop->priority = CAN_PRIO_HIGH;
+				}
+				else if(strcmp(tmp, "low") == 0)
+				{
+					prop->priority = CAN_PRIO_LOW;
+				}
+				else if(strcmp(tmp, "normal") != 0)
+				{
+					DBG_ERROR(LOG_PREFIX, "json: unknown priority \"%s\", using normal", tmp);
+				}
+			}
+			else if(strcmp("DEADBAND", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->deadband = fabs(strtod(tmp, NULL));
+			}
+			else if(strcmp("DEADBAND_REL", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->deadband_rel = fabs(strtod(tmp, NULL));
+			}
+			else if(strcmp("MIN_INTERVAL", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				prop->min_interval_usec = (uint32_t)strtoul(tmp, 0, 0) * 1000;
+			}
+			else if(strcmp("SMOOTHING", key) == 0)
+			{
+				const char * tmp = json_object_get_string(val);
+				double smoothing = strtod(tmp, NULL);
+				if(smoothing > 0 && smoothing < 1)
+				{
+					prop->smoothing = smoothing;
+				}
+				else if(smoothing != 1)
+				{
+					DBG_ERROR(LOG_PREFIX, "json: SMOOTHING must be in (0, 1], ignored");
+				}
+			}
+		}
+
+		/* without SIGNED the signedness follows TYPE */
+		if(is_signed < 0)
+		{
+			is_signed = (var_type >= INT8_T && var_type <= INT64_T) ? 1 : 0;
 		}
+		prop->is_signed = (is_signed != 0);
 
-		wheel_info->property[idx].name = strdup(name);
-		wheel_info->property[idx].var_type = (unsigned char)var_type;
-		wheel_info->property[idx].can_id = strdup(canid);
+		prop->name = strdup(name);
+		prop->var_type = (unsigned char)var_type;
+		prop->can_id = strdup(canid);
+		if(init_prop_codec(prop) < 0)
+		{
+			return 1;
+		}
 	}
 
 	return 0;
 }
 
-void CanSender::updateValue(const char *prop, int val)
+int CanSender::parse_property(int idx, json_object *obj_property)
 {
-	// DBG_INFO(LOG_PREFIX, "updateValue");
+	return parse_prop_info(&wheel_info->property[idx], obj_property);
+}
+
+/*
+ * interface of a bus from /etc/dev-mapping.conf, NULL if not configured
+ */
+const char *CanSender::getBusDevice(int bus) const
+{
+	return (bus == CAN_BUS_LS) ? trans_conf.ls : trans_conf.hs;
+}
+
+/*
+ * estimated utilization of a bus over the last second, in 1/1000
+ */
+unsigned int CanSender::getBusLoad(int bus) const
+{
+	if(bus < 0 || bus >= CAN_BUS_MAX)
+	{
+		return 0;
+	}
+	return tx_load_permille[bus].load(std::memory_order_relaxed);
+}
+
+static uint32_t prop_name_hash(const char *name)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
+	for(; *name != '\0'; name++)
+	{
+		h ^= (uint8_t)*name;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * build an open addressing hash table of the property names, at most half
+ * full. properties sharing a name are chained through prop_info_t::next.
+ */
+int CanSender::buildPropertyIndex()
+{
+	uint32_t size = 1;
 	unsigned int nProp = wheel_info->nData;
+
+	if(nProp > PROP_HASH_MAX_ENTRIES)
+	{
+		DBG_ERROR(LOG_PREFIX, "too many properties: %u", nProp);
+		return -1;
+	}
+
+	while(size < nProp * 2)
+	{
+		size <<= 1;
+	}
+
+	prop_hash = (int16_t *)malloc(size * sizeof(int16_t));
+	if(prop_hash == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "not enogh memory");
+		return -1;
+	}
+	memset(prop_hash, 0xFF, size * sizeof(int16_t));
+	prop_hash_mask = size - 1;
+
 	for(unsigned int i = 0; i < nProp; i++)
 	{
-		if(strcmp(prop, wheel_info->property[i].name) == 0)
+		struct prop_info_t *prop = &wheel_info->property[i];
+		uint32_t h = prop_name_hash(prop->name) & prop_hash_mask;
+
+		prop->next = NULL;
+		for(; prop_hash[h] >= 0; h = (h + 1) & prop_hash_mask)
 		{
-			if(wheel_info->property[i].curValue.int16_val != val)
+			struct prop_info_t *first = &wheel_info->property[prop_hash[h]];
+			if(strcmp(first->name, prop->name) == 0)
 			{
-				wheel_info->property[i].curValue.int16_val = (int16_t)val;
-
-				// DBG_INFO(LOG_PREFIX, "notify_property_changed name=%s,value=%d", 
-				// 	wheel_info->property[i].name, wheel_info->property[i].curValue);
-				int rc = carla::push(makeCanData(&wheel_info->property[i]));
-				if(rc < 0)
+				/* append to the properties of the same name */
+				while(first->next != NULL)
 				{
-					DBG_ERROR(LOG_PREFIX, "push failed");
+					first = first->next;
 				}
+				first->next = prop;
+				break;
+			}
+		}
+		if(prop_hash[h] < 0)
+		{
+			prop_hash[h] = (int16_t)i;
+		}
+	}
+
+	DBG_INFO(LOG_PREFIX, "property index: %u entries, table size %u", nProp, size);
+	return 0;
+}
+
+/*
+ * resolve a property name once, the handle is used with updateValue()
+ */
+prop_handle_t CanSender::getPropertyHandle(const char *prop)
+{
+	if(prop_hash == NULL || prop == NULL)
+	{
+		return INVALID_PROP_HANDLE;
+	}
+
+	for(uint32_t h = prop_name_hash(prop) & prop_hash_mask; prop_hash[h] >= 0; h = (h + 1) & prop_hash_mask)
+	{
+		if(strcmp(prop, wheel_info->property[prop_hash[h]].name) == 0)
+		{
+			return (prop_handle_t)prop_hash[h];
+		}
+	}
+
+	return INVALID_PROP_HANDLE;
+}
+
+void CanSender::updateValue(const char *prop, int val)
+{
+	prop_handle_t handle = getPropertyHandle(prop);
+	if(handle != INVALID_PROP_HANDLE)
+	{
+		updateValue(handle, val);
+	}
+}
+
+/*
+ * log how many updates the filters of each property dropped
+ */
+void CanSender::reportFilters()
+{
+	for(uint i = 0; i < wheel_info->nData; i++)
+	{
+		const struct prop_info_t *prop = &wheel_info->property[i];
+		if(!prop->filter)
+		{
+			continue;
+		}
+		DBG_INFO(LOG_PREFIX, "filter %s passed:%llu deadband:%llu deadband_rel:%llu interval:%llu released:%llu",
+			prop->name, (unsigned long long)prop->filter_stats.passed,
+			(unsigned long long)prop->filter_stats.deadband,
+			(unsigned long long)prop->filter_stats.deadband_rel,
+			(unsigned long long)prop->filter_stats.interval,
+			(unsigned long long)prop->filter_stats.released);
+	}
+}
+
+/*
+ * publish the gear estimated from one speed (km/h) and engine speed (rpm)
+ * sample, updateValue() drops the frame when the gear did not change
+ */
+void CanSender::updateGear(int speed, int engine_spd)
+{
+	if(gear_handle == INVALID_PROP_HANDLE)
+	{
+		return;
+	}
+
+	int gear = gear_estimate(&gear_est, (double)speed, (double)engine_spd);
+	if(gear >= 0)
+	{
+		updateValue(gear_handle, gear);
+	}
+}
+
+void CanSender::updateValue(prop_handle_t handle, int val)
+{
+	updateValue(handle, (double)val);
+}
+
+/*
+ * set the physical value of a property, scaled by its factor and offset
+ */
+void CanSender::updateValue(prop_handle_t handle, double val)
+{
+	// DBG_INFO(LOG_PREFIX, "updateValue");
+	if(handle < 0 || wheel_info == NULL || (unsigned int)handle >= wheel_info->nData)
+	{
+		return;
+	}
+
+	if((++update_cnt % FILTER_REPORT_INTERVAL) == 0)
+	{
+		reportFilters();
+	}
+
+	for(struct prop_info_t *prop = &wheel_info->property[handle]; prop != NULL; prop = prop->next)
+	{
+		double filtered = val;
+		if(!carla::filter_prop_value(prop, &filtered))
+		{
+			holdValue(prop);
+			continue;
+		}
+		encodeValue(prop, filtered, true);
+	}
+}
+
+/*
+ * encode a filtered value, its frame is queued, or only staged for the next
+ * cycle of its slot
+ */
+void CanSender::encodeValue(struct prop_info_t *prop, double val, bool queue)
+{
+	int64_t raw = carla::phys2raw(prop, val);
+	if(prop->raw == raw)
+	{
+		return;
+	}
+	prop->raw = raw;
+
+	// DBG_INFO(LOG_PREFIX, "notify_property_changed name=%s,value=%lld", 
+	// 	prop->name, (long long)prop->raw);
+	/* the queue itself can not overflow, each slot is queued at most once */
+	struct canfd_frame frame;
+	if(carla::makeCanFrame(prop, &frame) <= 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "encoding %s failed", prop->name);
+	}
+	else if((queue ? carla::push(prop->slot, &frame) : carla::stage(prop->slot, &frame)) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "push of %s failed, invalid slot %d", prop->name, prop->slot);
+	}
+}
+
+/*
+ * a value dropped by MIN_INTERVAL is not lost: the next cycle of a cyclic
+ * slot carries it, the others are sent by releaseHeld() once the interval
+ * has expired
+ */
+void CanSender::holdValue(struct prop_info_t *prop)
+{
+	double val;
+
+	/* the kernel only takes queued frames into the cycles of the bcm backend */
+	if(trans_conf.backend == TX_BACKEND_RAW && carla::can_slot_cycle_usec(prop->slot) != 0
+		&& carla::take_held_value(prop, &val))
+	{
+		encodeValue(prop, val, false);
+		return;
+	}
+
+	uint64_t due = prop->filter_usec + prop->min_interval_usec;
+	if(prop->filter_held && (held_release_usec == 0 || due < held_release_usec))
+	{
+		held_release_usec = due;
+	}
+}
+
+/*
+ * send the held values whose interval has expired, called from a timer at
+ * getHeldRelease() of the thread that updates the values
+ */
+void CanSender::releaseHeld()
+{
+	uint64_t now = monotonic_usec();
+
+	held_release_usec = 0;
+	for(unsigned int i = 0; i < interval_cnt; i++)
+	{
+		struct prop_info_t *prop = interval_props[i];
+		double val;
+		if(carla::release_prop_value(prop, now, &val))
+		{
+			encodeValue(prop, val, true);
+		}
+		else if(prop->filter_held)
+		{
+			uint64_t due = prop->filter_usec + prop->min_interval_usec;
+			if(held_release_usec == 0 || due < held_release_usec)
+			{
+				held_release_usec = due;
 			}
 		}
 	}
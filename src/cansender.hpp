@@ -23,12 +23,22 @@
 #include <pthread.h>
 
 #include "canencoder.hpp"
+#include "gearestimator.hpp"
+#include "signaltable.hpp"
 
 namespace carla
 {
 
+/* the tools/ programs read their configuration from the working directory */
+#ifndef STEERING_WHEEL_JSON
 #define STEERING_WHEEL_JSON	"/etc/steering_wheel.json"
+#endif
+#ifndef BUS_MAP_CONF
 #define BUS_MAP_CONF "/etc/dev-mapping.conf"
+#endif
+
+/* updates between two logs of the filter counters */
+#define FILTER_REPORT_INTERVAL	10000
 
 #define VEHICLE_SPEED				"VehicleSpeed"
 #define ENGINE_SPEED				"EngineSpeed"
@@ -39,6 +49,9 @@ namespace carla
 #define TURN_SIGNAL_STATUS			"TurnSignalStatus"
 #define LIGHT_STATUS_BRAKE			"LightStatusBrake"
 
+typedef int prop_handle_t;
+#define INVALID_PROP_HANDLE (-1)
+
 struct wheel_info_t
 {
 	unsigned int   nData;
@@ -53,7 +66,19 @@ public:
 	~CanSender();
 
     int init();
+    prop_handle_t getPropertyHandle(const char *prop);
+    void updateValue(prop_handle_t handle, int val);
+    void updateValue(prop_handle_t handle, double val);
+#ifdef CARLA_STATIC_SIGNALS
+    template<signals::signal_id_t ID, typename T> void updateSignal(T val);
+#endif
     void updateValue(const char *prop, int val);
+    void updateGear(int speed, int engine_spd);
+    const char *getBusDevice(int bus) const;
+    unsigned int getBusLoad(int bus) const;
+    /* 0 or when releaseHeld() has a value held back by MIN_INTERVAL to send */
+    uint64_t getHeldRelease() const { return held_release_usec; }
+    void releaseHeld();
 
 private:
     int initConfig();
@@ -61,17 +86,79 @@ private:
     int readTransBus(void);
     int readJsonConfig();
     int wheel_define_init(const char *fname);
+    int dbc_define_init(const char *fname);
+#ifdef CARLA_STATIC_SIGNALS
+    int static_define_init();
+#endif
     int wheel_gear_para_init(const char *fname);
     int parse_json(json_object *obj);
     int parse_gear_para_json(json_object *obj);
+    int parse_bus_load_json(json_object *obj);
     int parse_propertys(json_object *obj_propertys);
     int parse_property(int idx, json_object *obj_property);
+    int buildPropertyIndex();
+    void reportFilters();
+    void encodeValue(struct prop_info_t *prop, double val, bool queue);
+    void holdValue(struct prop_info_t *prop);
 
 private:
     struct wheel_info_t *wheel_info;
+    int16_t *prop_hash;
+    uint32_t prop_hash_mask;
     pthread_t thread_id;
+    struct gear_estimator_t gear_est;
+    prop_handle_t gear_handle;
+    uint64_t update_cnt;
+    struct prop_info_t **interval_props;	/* with MIN_INTERVAL, see releaseHeld() */
+    unsigned int interval_cnt;
+    uint64_t held_release_usec;
 };
 
+extern int parse_prop_info(struct prop_info_t *prop, json_object *obj_property);
+
+#ifdef CARLA_STATIC_SIGNALS
+/*
+ * update a property known at build time, without name lookup or layout
+ * decisions at run time. the slot numbers were checked by init().
+ */
+template<signals::signal_id_t ID, typename T>
+inline void CanSender::updateSignal(T val)
+{
+    constexpr int slot = signals::kSignals[ID].slot;
+    struct prop_info_t *prop = &wheel_info->property[ID];
+    int64_t raw;
+
+    if((++update_cnt % FILTER_REPORT_INTERVAL) == 0)
+    {
+        reportFilters();
+    }
+    if(signals::kSignals[ID].filter)
+    {
+        double filtered = (double)val;
+        if(carla::filter_prop_value(prop, &filtered))
+        {
+            raw = signals::phys2raw<ID>(filtered);
+        }
+        else
+        {
+            holdValue(prop);
+            raw = prop->raw;
+        }
+    }
+    else
+    {
+        raw = signals::phys2raw<ID>(val);
+    }
+
+    if(prop->raw != raw)
+    {
+        prop->raw = raw;
+        signals::pack<ID>(carla::can_slot_image(slot), (uint64_t)raw);
+        carla::push_slot_image(slot);
+    }
+}
+#endif
+
 } // namespace carla
 
 #endif  // !TMCAGL_CAN_SENDER_HPP
@@ -22,6 +22,8 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <sstream>
 
 #include "carlaclient.hpp"
@@ -30,8 +32,12 @@
 namespace carla
 {
 
-#define MAXLENGTH 1024
 #define CARLA_SERVER_CONFIG "/etc/carla-server.json"
+#define FRAMER_STATS_INTERVAL 1000
+#define UNKNOWN_KEY_LOG_INTERVAL 1000
+#define USEC_PER_SEC 1000000ULL
+#define RECONNECT_MIN_BACKOFF (100 * 1000ULL)
+#define RECONNECT_MAX_BACKOFF (30 * USEC_PER_SEC)
 
 static const char kKeySpeed[] = "speed";
 static const char kKeyEngineSpd[] = "engine_spd";
@@ -39,6 +45,8 @@ static const char kKeyGps[] = "gps";
 static const char kKeyYaw[] = "yaw";
 static const char kKeyLongitude[] = "longitude";
 static const char kKeyLatitude[] = "latitude";
+static const char kKeyProto[] = "proto";
+static const char kProtoBinary[] = "binary";
 
 static const std::vector<std::string> kListEventName
 {
@@ -46,19 +54,61 @@ static const std::vector<std::string> kListEventName
 };
 
 CarlaClient::CarlaClient() :
-socketfd(0),
-demo_status_change(false),
+socketfd(-1),
+wakefd(-1),
+event_loop(nullptr),
+io_source(nullptr),
+timer_source(nullptr),
+wake_source(nullptr),
+can_source(nullptr),
+held_source(nullptr),
+connected(false),
+reconnect_left(0),
+backoff_usec(0),
+use_binary(false),
+proto_negotiating(false),
+tx_len(0),
+speed_handle(INVALID_PROP_HANDLE),
+engine_speed_handle(INVALID_PROP_HANDLE),
+last_speed(0),
+last_engine_spd(0),
+unknown_keys(0),
+inflight_cnt(0),
+inflight_dropped(0),
+control_sent(0),
 demo_status(""),
-amazon_code_change(false),
-amazon_code(""),
 demo_m()
 {
+	latency_reset(&cmd_latency);
+	latency_reset(&control_latency);
+	tokener = json_tokener_new();
 	cansender.init();
 }
 
 CarlaClient::~CarlaClient()
 {
-	close( socketfd);
+	closeConnection();
+	if(timer_source != nullptr)
+	{
+		sd_event_source_unref(timer_source);
+	}
+	if(wake_source != nullptr)
+	{
+		sd_event_source_unref(wake_source);
+	}
+	if(can_source != nullptr)
+	{
+		sd_event_source_unref(can_source);
+	}
+	if(held_source != nullptr)
+	{
+		sd_event_source_unref(held_source);
+	}
+	if(wakefd >= 0)
+	{
+		close(wakefd);
+	}
+	json_tokener_free(tokener);
 }
 
 int CarlaClient::init()
@@ -73,203 +123,689 @@ int CarlaClient::init()
 
 	loadServer();
 
+	/* resolve the properties fed on every sample once */
+	speed_handle = cansender.getPropertyHandle(VEHICLE_SPEED);
+	engine_speed_handle = cansender.getPropertyHandle(ENGINE_SPEED);
+
+	/* driver inputs of the rig, optional */
+	if(canreceiver.init(cansender.getBusDevice(CAN_BUS_HS), cansender.getBusDevice(CAN_BUS_LS)) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "can receive path is disabled");
+	}
+
 	return ret;
 }
 
-int CarlaClient::connect_server()
+/*
+ * register the server connection on the binding's event loop
+ */
+int CarlaClient::start(sd_event *loop)
 {
-	struct sockaddr_in sockaddr;
-	char readline[MAXLENGTH];
-	char writeline[MAXLENGTH];
-	int length;
-	int reconnect_times_startup = reconnect_times;
+	if(loop == nullptr)
+	{
+		DBG_ERROR(LOG_PREFIX, "no event loop");
+		return -1;
+	}
+	event_loop = loop;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(server_port);
+	inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr);
+
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wakefd < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "eventfd failed: %s", strerror(errno));
+		return -1;
+	}
+	if(sd_event_add_io(event_loop, &wake_source, wakefd, EPOLLIN, onWakeEvent, this) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot watch the command eventfd");
+		return -1;
+	}
+	if(canreceiver.getFd() >= 0
+		&& sd_event_add_io(event_loop, &can_source, canreceiver.getFd(), EPOLLIN, onCanEvent, this) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot watch the can receive socket");
+		return -1;
+	}
+
+	reconnect_left = reconnect_times;
+	backoff_usec = 0;
+	startConnect();
 
+	return 0;
+}
+
+/*
+ * start a non-blocking connect, completion is reported as EPOLLOUT
+ */
+void CarlaClient::startConnect()
+{
 	DBG_DEBUG(LOG_PREFIX, "Server: %s port : %d", server_ip.c_str(), server_port);
 
-	memset(&sockaddr, 0, sizeof(sockaddr));
-	sockaddr.sin_family = AF_INET;
-	sockaddr.sin_port = htons(server_port);
+	socketfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(socketfd < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "socket failed: %s", strerror(errno));
+		scheduleReconnect();
+		return;
+	}
+
+	int ret = connect(socketfd, (struct sockaddr*) &server_addr, sizeof(server_addr));
+	if(ret < 0 && errno != EINPROGRESS)
+	{
+		DBG_DEBUG(LOG_PREFIX, "Cannot connect the server err: %s errno : %d", strerror(errno), errno);
+		closeConnection();
+		scheduleReconnect();
+		return;
+	}
 
-	inet_pton(AF_INET, server_ip.c_str(), &sockaddr.sin_addr);
+	if(sd_event_add_io(event_loop, &io_source, socketfd, EPOLLOUT, onSocketEvent, this) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot watch the server socket");
+		closeConnection();
+		scheduleReconnect();
+		return;
+	}
 
-	while(true)
+	if(ret == 0)
+	{
+		onConnected();
+	}
+}
+
+void CarlaClient::onConnected()
+{
+	DBG_DEBUG(LOG_PREFIX, "succeeded to connect");
+	connected = true;
+	reconnect_left = reconnect_times;
+	backoff_usec = 0;
+	framer.reset();
+	framer.setMode(FRAMER_MODE_JSON);
+
+	/* ask for the binary protocol, the server answers {"proto":"binary"} if it agrees */
+	proto_negotiating = use_binary && (appendCommand("hello", kProtoBinary) == 0);
+
+	sd_event_source_set_io_events(io_source, EPOLLIN);
+	flushCommands();
+}
+
+void CarlaClient::closeConnection()
+{
+	if(io_source != nullptr)
+	{
+		sd_event_source_unref(io_source);
+		io_source = nullptr;
+	}
+	if(socketfd >= 0)
+	{
+		close(socketfd);
+		socketfd = -1;
+	}
+	connected = false;
+	if(inflight_cnt > 0)
+	{
+		/* they may be cut off in txbuf, the server would not get them whole */
+		inflight_dropped += inflight_cnt;
+		DBG_ERROR(LOG_PREFIX, "connection closed, %u commands not sent (dropped:%llu)",
+			inflight_cnt, (unsigned long long)inflight_dropped);
+	}
+	tx_len = 0;
+	inflight_cnt = 0;
+	/* a partial message of the old connection is useless */
+	framer.reset();
+}
+
+/*
+ * arm the reconnect timer, the delay doubles up to RECONNECT_MAX_BACKOFF
+ */
+void CarlaClient::scheduleReconnect()
+{
+	uint64_t now;
+
+	if(reconnect_left == 0)
 	{
-		socketfd = socket(AF_INET, SOCK_STREAM, 0);
-		int ret = connect(socketfd, (struct sockaddr*) &sockaddr, sizeof(sockaddr));
-		if(ret < 0)
+		DBG_DEBUG(LOG_PREFIX, "Exceed max reconnect times");
+		return;
+	}
+	if(reconnect_left > 0)
+	{
+		reconnect_left--;
+	}
+
+	if(backoff_usec == 0)
+	{
+		backoff_usec = std::max<uint64_t>((uint64_t)reconnect_interval * USEC_PER_SEC, RECONNECT_MIN_BACKOFF);
+	}
+	else
+	{
+		backoff_usec = std::min<uint64_t>(backoff_usec * 2, RECONNECT_MAX_BACKOFF);
+	}
+
+	DBG_DEBUG(LOG_PREFIX, "failed to connect, retry in %llu ms with %d time(s) left",
+		(unsigned long long)(backoff_usec / 1000), reconnect_left);
+
+	sd_event_now(event_loop, CLOCK_MONOTONIC, &now);
+	if(timer_source == nullptr)
+	{
+		if(sd_event_add_time(event_loop, &timer_source, CLOCK_MONOTONIC, now + backoff_usec, 0,
+			onReconnectTimer, this) < 0)
 		{
-			DBG_DEBUG(LOG_PREFIX, "Cannot connect the server err: %s errno : %d", strerror(errno), errno);
-			DBG_DEBUG(LOG_PREFIX, "failed to reconnect, sleep %d sec with %d time(s) left", reconnect_interval, reconnect_times_startup);
-			close(socketfd);
-			sleep(reconnect_interval);
+			DBG_ERROR(LOG_PREFIX, "cannot arm the reconnect timer");
 		}
-		else
+	}
+	else
+	{
+		sd_event_source_set_time(timer_source, now + backoff_usec);
+		sd_event_source_set_enabled(timer_source, SD_EVENT_ONESHOT);
+	}
+}
+
+int CarlaClient::onReconnectTimer(sd_event_source *source, uint64_t usec, void *userdata)
+{
+	CarlaClient *self = (CarlaClient *)userdata;
+	self->startConnect();
+	return 0;
+}
+
+int CarlaClient::onWakeEvent(sd_event_source *source, int fd, uint32_t revents, void *userdata)
+{
+	CarlaClient *self = (CarlaClient *)userdata;
+	uint64_t count;
+
+	if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	{
+		DBG_ERROR(LOG_PREFIX, "eventfd read failed: %s", strerror(errno));
+	}
+	self->flushCommands();
+	return 0;
+}
+
+/*
+ * driver inputs from CAN go out to the server from the same loop iteration
+ */
+int CarlaClient::onCanEvent(sd_event_source *source, int fd, uint32_t revents, void *userdata)
+{
+	CarlaClient *self = (CarlaClient *)userdata;
+	char val[CMD_VAL_SIZE];
+	uint64_t rx_usec;
+
+	if(self->canreceiver.receive(val, sizeof(val), &rx_usec) > 0
+		&& self->cmd_queue.push(CMD_CONTROL, val, rx_usec) == 0)
+	{
+		self->flushCommands();
+	}
+	return 0;
+}
+
+int CarlaClient::onSocketEvent(sd_event_source *source, int fd, uint32_t revents, void *userdata)
+{
+	CarlaClient *self = (CarlaClient *)userdata;
+
+	if(!self->connected)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if(err != 0)
 		{
-			DBG_DEBUG(LOG_PREFIX, "succeeded to reconnect");
-			break;
+			DBG_DEBUG(LOG_PREFIX, "Cannot connect the server err: %s errno : %d", strerror(err), err);
+			self->closeConnection();
+			self->scheduleReconnect();
+			return 0;
 		}
+		self->onConnected();
+		return 0;
+	}
 
-		if(reconnect_times_startup == -1)
+	if(revents & EPOLLIN)
+	{
+		if(self->receiveMessages() < 0)
 		{
-			/* Nothing to do*/
+			self->closeConnection();
+			self->scheduleReconnect();
+			return 0;
 		}
-		else
+	}
+	else if(revents & (EPOLLERR | EPOLLHUP))
+	{
+		DBG_DEBUG(LOG_PREFIX, "connection lost");
+		self->closeConnection();
+		self->scheduleReconnect();
+		return 0;
+	}
+
+	if(revents & EPOLLOUT)
+	{
+		self->flushCommands();
+	}
+
+	return 0;
+}
+
+/*
+ * read everything available, returns -1 when the connection is gone
+ */
+int CarlaClient::receiveMessages()
+{
+	while(true)
+	{
+		char *readpos = framer.writePtr();
+		ssize_t length = recv(socketfd, readpos, framer.writeSpace(), 0);
+
+		if(length < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			DBG_DEBUG(LOG_PREFIX, "recv error: errno: %s", strerror(errno));
+			return -1;
+		}
+		if(length == 0)
 		{
-			reconnect_times_startup--;
-			if(reconnect_times_startup == 0)
+			DBG_DEBUG(LOG_PREFIX, "connection closed by server");
+			return -1;
+		}
+
+		framer.commit(length);
+
+		const char *msg;
+		size_t msg_len;
+		while(framer.next(&msg, &msg_len))
+		{
+			if(handleMessage(msg, msg_len) < 0)
 			{
-				DBG_DEBUG(LOG_PREFIX, "Exceed max reconnect times");
 				return -1;
 			}
 		}
+		if(!framer.inSync())
+		{
+			DBG_ERROR(LOG_PREFIX, "binary stream out of sync, reconnecting");
+			return -1;
+		}
+
+		const struct framer_stats_t &stats = framer.stats();
+		if((stats.reads % FRAMER_STATS_INTERVAL) == 0)
+		{
+			DBG_INFO(LOG_PREFIX, "recv stats: reads:%llu frames:%llu frames/read(last:%u max:%u) dropped bytes:%llu",
+				(unsigned long long)stats.reads, (unsigned long long)stats.frames,
+				stats.last_frames_per_read, stats.max_frames_per_read,
+				(unsigned long long)stats.dropped_bytes);
+		}
 	}
+}
 
-	while(true)
+/*
+ * move requested commands into the send buffer and write what the socket takes
+ */
+void CarlaClient::flushCommands()
+{
+	if(!connected)
+	{
+		return;
+	}
+
+	/* a queued command is only taken when it is sure to fit */
+	struct command_t cmd;
+	while(sizeof(txbuf) - tx_len > CMD_MSG_MAX && inflight_cnt < TX_INFLIGHT_MAX
+		&& cmd_queue.pop(&cmd))
 	{
+		/* a control command follows every change of a CAN input */
+		if(cmd.type != CMD_CONTROL || (control_sent++ % CONTROL_LOG_INTERVAL) == 0)
 		{
-			std::lock_guard<std::mutex> guard(demo_m);
-			if(demo_status_change)
+			DBG_DEBUG(LOG_PREFIX, "send %s: %s (control commands:%llu)", cmd_type_name(cmd.type), cmd.val,
+				(unsigned long long)control_sent);
+		}
+		appendCommand(cmd_type_name(cmd.type), cmd.val);
+		inflight_type[inflight_cnt] = cmd.type;
+		inflight_usec[inflight_cnt++] = cmd.enqueue_usec;
+	}
+
+	while(tx_len > 0)
+	{
+		ssize_t n = send(socketfd, txbuf, tx_len, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
 			{
-				DBG_DEBUG(LOG_PREFIX, "send demo_status: %s", demo_status.c_str());
-				memset(writeline, 0, MAXLENGTH);
-				sprintf(writeline, "{\"cmd\":\"demo\", \"val\":\"%s\"}", demo_status.c_str());
-				DBG_DEBUG(LOG_PREFIX, "send string: %s", writeline);
-				send(socketfd, writeline, strlen(writeline), 0);
-				demo_status_change = false;
+				continue;
 			}
-			else if(amazon_code_change)
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
 			{
-				DBG_DEBUG(LOG_PREFIX, "send amazon_code: %s", amazon_code.c_str());
-				memset(writeline, 0, MAXLENGTH);
-				sprintf(writeline, "{\"cmd\":\"amazon_code\", \"val\":\"%s\"}", amazon_code.c_str());
-				DBG_DEBUG(LOG_PREFIX, "send string: %s", writeline);
-				send(socketfd, writeline, strlen(writeline), 0);
-				amazon_code_change = false;
+				DBG_DEBUG(LOG_PREFIX, "send error: errno: %s", strerror(errno));
 			}
+			break;
 		}
+		memmove(txbuf, txbuf + n, tx_len - (size_t)n);
+		tx_len -= (size_t)n;
+	}
 
-		memset(readline, 0, MAXLENGTH);
-		length = recv(socketfd, readline, MAXLENGTH, 0);
-
-		///
-		if(length <= 0)
+	if(tx_len == 0 && inflight_cnt > 0)
+	{
+		uint64_t now = monotonic_usec();
+		unsigned int api_cnt = 0;
+		uint64_t api_last_usec = 0;
+		for(unsigned int i = 0; i < inflight_cnt; i++)
 		{
-			int reconnect_times_offline = reconnect_times;
-			DBG_DEBUG(LOG_PREFIX, "recv error: return value: %d", length);
-			DBG_DEBUG(LOG_PREFIX, "recv error: errno: %s", strerror(errno));
-
-			close(socketfd);
-			socketfd = socket(AF_INET, SOCK_STREAM, 0);
-
-			while(true)
+			if(inflight_type[i] != CMD_CONTROL)
 			{
-				int ret = connect(socketfd, (struct sockaddr*) &sockaddr, sizeof(sockaddr));
-				if(ret < 0)
-				{
-					DBG_DEBUG(LOG_PREFIX, "failed to reconnect, sleep %d sec with %d time(s) left", reconnect_interval, reconnect_times_offline);
-					sleep(reconnect_interval);
-				}
-				else
-				{
-					DBG_DEBUG(LOG_PREFIX, "succeeded to reconnect");
-					break;
-				}
+				api_last_usec = now - inflight_usec[i];
+				latency_record(&cmd_latency, api_last_usec);
+				api_cnt++;
+				continue;
+			}
 
-				if(reconnect_times_offline == -1)
-				{
-					/* Nothing to do*/
-				}
-				else
-				{
-					reconnect_times_offline--;
-					if(reconnect_times_offline == 0)
-					{
-						DBG_DEBUG(LOG_PREFIX, "Exceed max reconnect times");
-						return -1;
-					}
-				}
-				
+			/* frequent, only reported every CONTROL_LATENCY_REPORT_INTERVAL */
+			latency_record(&control_latency, now - inflight_usec[i]);
+			if((control_latency.count % CONTROL_LATENCY_REPORT_INTERVAL) == 0)
+			{
+				DBG_INFO(LOG_PREFIX, "control latency(can receive to send) commands:%llu p50:%lluus p99:%lluus max:%lluus",
+					(unsigned long long)control_latency.count,
+					(unsigned long long)latency_percentile(&control_latency, 50),
+					(unsigned long long)latency_percentile(&control_latency, 99),
+					(unsigned long long)control_latency.max_usec);
 			}
 		}
-		///
+		inflight_cnt = 0;
+		if(api_cnt != 0)
+		{
+			DBG_INFO(LOG_PREFIX, "command send latency: last:%lluus p50:%lluus p99:%lluus max:%lluus (coalesced:%llu rejected:%llu dropped:%llu)",
+				(unsigned long long)api_last_usec,
+				(unsigned long long)latency_percentile(&cmd_latency, 50),
+				(unsigned long long)latency_percentile(&cmd_latency, 99),
+				(unsigned long long)cmd_latency.max_usec,
+				(unsigned long long)cmd_queue.coalesced(),
+				(unsigned long long)cmd_queue.rejected(),
+				(unsigned long long)inflight_dropped);
+		}
+	}
 
-		if(length >= MAXLENGTH)
+	/* only wait for writability while something is left over */
+	sd_event_source_set_io_events(io_source, (tx_len > 0) ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+}
+
+/*
+ * append text at *pos, as the content of a json string if escape is set.
+ * returns -1 if it does not fit.
+ */
+static int append_text(char *buf, size_t size, size_t *pos, const char *text, bool escape)
+{
+	size_t p = *pos;
+
+	for(; *text != '\0'; text++)
+	{
+		unsigned char c = (unsigned char)*text;
+		char esc[8];
+		size_t n = 1;
+
+		esc[0] = (char)c;
+		if(escape && (c == '"' || c == '\\'))
+		{
+			esc[0] = '\\';
+			esc[1] = (char)c;
+			n = 2;
+		}
+		else if(escape && c < 0x20)
 		{
-			length = MAXLENGTH - 1;
+			n = (size_t)snprintf(esc, sizeof(esc), "\\u%04x", c);
 		}
-		readline[length] = '\0';
+		if(size - p < n)
+		{
+			return -1;
+		}
+		memcpy(buf + p, esc, n);
+		p += n;
+	}
+	*pos = p;
+	return 0;
+}
 
-		// fprintf(stderr, ">>>>> recv msg 1 from length:%d, client:%s\n", length,
-		// 		readline);
+/*
+ * {"cmd":"<cmd>", "val":"<val>"}, val comes from the api and is escaped
+ */
+int CarlaClient::appendCommand(const char *cmd, const char *val)
+{
+	size_t pos = tx_len;
+
+	if(append_text(txbuf, sizeof(txbuf), &pos, "{\"cmd\":\"", false) < 0
+		|| append_text(txbuf, sizeof(txbuf), &pos, cmd, true) < 0
+		|| append_text(txbuf, sizeof(txbuf), &pos, "\", \"val\":\"", false) < 0
+		|| append_text(txbuf, sizeof(txbuf), &pos, val, true) < 0
+		|| append_text(txbuf, sizeof(txbuf), &pos, "\"}", false) < 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "send buffer full, %s dropped", cmd);
+		return -1;
+	}
+	tx_len = pos;
+	return 0;
+}
+
+/*
+ * wake the event loop from an api thread
+ */
+void CarlaClient::wakeup()
+{
+	uint64_t one = 1;
+	if(wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		DBG_ERROR(LOG_PREFIX, "eventfd write failed: %s", strerror(errno));
+	}
+}
+
+/*
+ * dispatch one complete message, the fixed schema is decoded in place.
+ * Returns -1 if the stream can not be trusted any more.
+ */
+int CarlaClient::handleMessage(const char *msg, size_t len)
+{
+	struct carla_msg_t decoded;
+
+	if(framer.getMode() == FRAMER_MODE_BINARY)
+	{
+		return handleBinaryMessage(msg, len);
+	}
 
-		if(strlen(readline) <= 0)
+	if(proto_negotiating)
+	{
+		/* the first message decides, anything but the ack means json */
+		proto_negotiating = false;
+		if(isBinaryAck(msg, len))
 		{
-			DBG_DEBUG(LOG_PREFIX, "recv again");
-			continue;
+			DBG_INFO(LOG_PREFIX, "server switched to the binary protocol");
+			framer.setMode(FRAMER_MODE_BINARY);
+			return 0;
 		}
+		DBG_INFO(LOG_PREFIX, "server keeps the json protocol");
+	}
+
+	if(decode_carla_msg(msg, len, &decoded) < 0)
+	{
+		handleJsonMessage(msg, len, false);
+		return 0;
+	}
+
+	if(decoded.fields & MSG_HAS_GPS)
+	{
+		emitPosition(decoded.yaw_text, decoded.longitude_text, decoded.latitude_text);
+	}
+	if(decoded.fields & MSG_HAS_SPEED)
+	{
+		updateSpeed(decoded.speed);
+	}
+	if(decoded.fields & MSG_HAS_ENGINE_SPD)
+	{
+		updateEngineSpeed(decoded.engine_spd);
+	}
+	if(decoded.fields & (MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD))
+	{
+		updateGear();
+	}
+	if(decoded.fields & MSG_HAS_UNKNOWN)
+	{
+		handleJsonMessage(msg, len, true);
+	}
+	return 0;
+}
+
+int CarlaClient::handleBinaryMessage(const char *msg, size_t len)
+{
+	struct carla_msg_t decoded;
 
-		json_object* jobj = json_tokener_parse(readline);
+	if(len != BIN_TELEMETRY_SIZE)
+	{
+		/* every record type has this size, anything else is a framing error */
+		DBG_ERROR(LOG_PREFIX, "invalid binary record length:%u, reconnecting", (unsigned int)len);
+		return -1;
+	}
+	if(decode_carla_bin(msg, len, &decoded) < 0)
+	{
+		DBG_DEBUG(LOG_PREFIX, "unknown binary record type:%u", (unsigned int)(uint8_t)msg[2]);
+		return 0;
+	}
 
-		//		{"gps": {"latitude": "49.002756551435", "longitude": "8.001536315145"}}
-		//DBG_INFO(LOG_PREFIX, "Recv msg length:%d, content:%s", length, json_object_get_string(jobj));
+	if(decoded.fields & MSG_HAS_GPS)
+	{
+		/* the position event carries text, same as in json mode */
+		char yaw[32];
+		char lon[32];
+		char lat[32];
+		int yaw_len = snprintf(yaw, sizeof(yaw), "%.9g", decoded.yaw);
+		int lon_len = snprintf(lon, sizeof(lon), "%.17g", decoded.longitude);
+		int lat_len = snprintf(lat, sizeof(lat), "%.17g", decoded.latitude);
+		emitPosition(text_span_t{yaw, (size_t)yaw_len}, text_span_t{lon, (size_t)lon_len},
+			text_span_t{lat, (size_t)lat_len});
+	}
+	if(decoded.fields & MSG_HAS_SPEED)
+	{
+		updateSpeed(decoded.speed);
+	}
+	if(decoded.fields & MSG_HAS_ENGINE_SPD)
+	{
+		updateEngineSpeed(decoded.engine_spd);
+	}
+	if(decoded.fields & (MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD))
+	{
+		updateGear();
+	}
+	return 0;
+}
+
+bool CarlaClient::isBinaryAck(const char *msg, size_t len)
+{
+	bool ack = false;
+	json_object *jproto;
 
-		if(jobj != nullptr)
+	json_tokener_reset(tokener);
+	json_object* jobj = json_tokener_parse_ex(tokener, msg, (int)len);
+	if(jobj == nullptr)
+	{
+		return false;
+	}
+	if(json_object_object_get_ex(jobj, kKeyProto, &jproto))
+	{
+		ack = (strcmp(json_object_get_string(jproto), kProtoBinary) == 0);
+	}
+	json_object_put(jobj);
+
+	return ack;
+}
+
+/*
+ * generic json-c path for messages the fixed schema decoder rejects or that
+ * carry keys it does not know (MSG_HAS_UNKNOWN). Unlike decode_carla_msg()
+ * this path allocates: json-c builds an object tree for the whole message.
+ */
+void CarlaClient::handleJsonMessage(const char *msg, size_t len, bool unknown_only)
+{
+	json_tokener_reset(tokener);
+	json_object* jobj = json_tokener_parse_ex(tokener, msg, (int)len);
+
+	//		{"gps": {"latitude": "49.002756551435", "longitude": "8.001536315145"}}
+	//DBG_INFO(LOG_PREFIX, "Recv msg length:%d, content:%s", length, json_object_get_string(jobj));
+
+	if(jobj == nullptr)
+	{
+		DBG_DEBUG(LOG_PREFIX, "Invalid json data %.*s", (int)len, msg);
+		return;
+	}
+
+	bool gear_sample = false;
+	json_object_object_foreach(jobj, key, val)
+	{
+		bool known = (strcmp(key, kKeyGps) == 0)
+			|| (strcmp(key, kKeySpeed) == 0)
+			|| (strcmp(key, kKeyEngineSpd) == 0);
+		if(known && unknown_only)
+		{
+			continue;
+		}
+
+		if(strcmp(key, kKeyGps) == 0)
 		{
-			json_object_object_foreach(jobj, key, val)
+			json_object *jyaw;
+			json_object *jlon;
+			json_object *jlat;
+			if(val)
 			{
-				if(strcmp(key, kKeyGps) == 0)
-				{
-					json_object *jyaw;
-					json_object *jlon;
-					json_object *jlat;
-					if(val)
-					{
-						json_object_object_get_ex(val, kKeyYaw, &jyaw);
-						json_object_object_get_ex(val, kKeyLongitude, &jlon);
-						json_object_object_get_ex(val, kKeyLatitude, &jlat);
-
-						// fprintf(stderr, ">>>>> recv msg 3 jgps:%s, jlon:%s, jlat:%s\n",json_object_get_string(jgps),
-						// 		json_object_get_string(jlon), json_object_get_string(jlat));
-						if(jyaw && jlon && jlat)
-						{
-							// DBG_DEBUG(LOG_PREFIX, "GPS: %s %s", json_object_get_string(jlon), json_object_get_string(jlat));
-							emitPosition(json_object_get_string(jyaw), json_object_get_string(jlon), json_object_get_string(jlat));
-						}
-					}
-				}
-				else if(strcmp(key, kKeySpeed) == 0)
-				{
-					int speed;
-					if(val)
-					{
-						speed = json_object_get_int(val);
-						// DBG_INFO(LOG_PREFIX, "Speed:%d", speed);
-						cansender.updateValue(VEHICLE_SPEED, speed);
-					}
-				}
-				else if(strcmp(key, kKeyEngineSpd) == 0)
-				{
-					int engine_speed;
-					if(val)
-					{
-						engine_speed = json_object_get_int(val);
-						// DBG_INFO(LOG_PREFIX, "Engine Speed:%d", engine_speed);
-						cansender.updateValue(ENGINE_SPEED, engine_speed);
-					}
-				}
-				else
+				json_object_object_get_ex(val, kKeyYaw, &jyaw);
+				json_object_object_get_ex(val, kKeyLongitude, &jlon);
+				json_object_object_get_ex(val, kKeyLatitude, &jlat);
+
+				if(jyaw && jlon && jlat)
 				{
-					DBG_ERROR(LOG_PREFIX, "Invalid msg!");
+					const char *yaw = json_object_get_string(jyaw);
+					const char *lon = json_object_get_string(jlon);
+					const char *lat = json_object_get_string(jlat);
+					emitPosition(text_span_t{yaw, strlen(yaw)}, text_span_t{lon, strlen(lon)},
+						text_span_t{lat, strlen(lat)});
 				}
 			}
 		}
+		else if(strcmp(key, kKeySpeed) == 0)
+		{
+			int speed;
+			if(val)
+			{
+				speed = json_object_get_int(val);
+				// DBG_INFO(LOG_PREFIX, "Speed:%d", speed);
+				updateSpeed(speed);
+				gear_sample = true;
+			}
+		}
+		else if(strcmp(key, kKeyEngineSpd) == 0)
+		{
+			int engine_speed;
+			if(val)
+			{
+				engine_speed = json_object_get_int(val);
+				// DBG_INFO(LOG_PREFIX, "Engine Speed:%d", engine_speed);
+				updateEngineSpeed(engine_speed);
+				gear_sample = true;
+			}
+		}
 		else
 		{
-			DBG_DEBUG(LOG_PREFIX, "Incomplete json data %s", readline);
+			/* keep formatting off the per message path, report every n-th */
+			if((unknown_keys++ % UNKNOWN_KEY_LOG_INTERVAL) == 0)
+			{
+				DBG_ERROR(LOG_PREFIX, "Invalid msg! unknown key \"%s\", total:%llu",
+					key, (unsigned long long)unknown_keys);
+			}
 		}
 	}
+	if(gear_sample)
+	{
+		updateGear();
+	}
 
-	return 0;
+	json_object_put(jobj);
 }
 
 bool CarlaClient::subscribe(afb_req_t req, EventType event_id)
@@ -295,7 +831,6 @@ bool CarlaClient::set_demo_status(const char *status)
 {
 	DBG_DEBUG(LOG_PREFIX, "demo_status 1: %s", status);
 	std::lock_guard<std::mutex> guard(demo_m);
-	demo_status_change = true;
 	if(strcmp(status, "true") == 0)
 	{
 		demo_status = "true";
@@ -305,6 +840,11 @@ bool CarlaClient::set_demo_status(const char *status)
 		demo_status = "false";
 	}
 	DBG_DEBUG(LOG_PREFIX, "demo_status 2: %s", demo_status.c_str());
+	if(cmd_queue.push(CMD_DEMO, demo_status.c_str()) < 0)
+	{
+		return false;
+	}
+	wakeup();
 
 	return true;
 }
@@ -312,9 +852,11 @@ bool CarlaClient::set_demo_status(const char *status)
 bool CarlaClient::set_amazon_code(const char *code)
 {
 	DBG_DEBUG(LOG_PREFIX, "set_amazon_code: %s", code);
-	std::lock_guard<std::mutex> guard(demo_m);
-	amazon_code_change = true;
-	amazon_code = code;
+	if(cmd_queue.push(CMD_AMAZON_CODE, code) < 0)
+	{
+		return false;
+	}
+	wakeup();
 
 	return true;
 }
@@ -381,6 +923,13 @@ int CarlaClient::loadServer()
 		reconnect_times = json_object_get_int(json_times);
 	}
 
+	// Get protocol (optional, json if not given)
+	json_object *json_protocol;
+	if(json_object_object_get_ex(json_obj, "protocol", &json_protocol))
+	{
+		use_binary = (strcmp(json_object_get_string(json_protocol), kProtoBinary) == 0);
+	}
+
     return 0;
 }
 
@@ -436,7 +985,75 @@ int CarlaClient::inputJsonFilie(const char *file, json_object **obj)
     return ret;
 }
 
-void CarlaClient::emitPosition(const char* yaw, const char* longitude, const char* latitude)
+/*
+ * feed the per sample signals, through the compiled in table when built
+ * with CARLA_STATIC_SIGNALS
+ */
+void CarlaClient::updateSpeed(int speed)
+{
+	last_speed = speed;
+#ifdef SIGNAL_HAS_VehicleSpeed
+	cansender.updateSignal<signals::SIG_VehicleSpeed>(speed);
+#else
+	cansender.updateValue(speed_handle, speed);
+#endif
+}
+
+void CarlaClient::updateEngineSpeed(int engine_spd)
+{
+	last_engine_spd = engine_spd;
+#ifdef SIGNAL_HAS_EngineSpeed
+	cansender.updateSignal<signals::SIG_EngineSpeed>(engine_spd);
+#else
+	cansender.updateValue(engine_speed_handle, engine_spd);
+#endif
+}
+
+/*
+ * once per message, after speed and engine speed of the message were applied
+ */
+void CarlaClient::updateGear()
+{
+	cansender.updateGear(last_speed, last_engine_spd);
+	armHeldTimer();
+}
+
+/*
+ * a value held back by MIN_INTERVAL goes out when its interval expires, also
+ * when no further sample comes. the values are only touched from this loop.
+ */
+void CarlaClient::armHeldTimer()
+{
+	uint64_t due = cansender.getHeldRelease();
+
+	if(due == 0)
+	{
+		return;
+	}
+	if(held_source == nullptr)
+	{
+		if(sd_event_add_time(event_loop, &held_source, CLOCK_MONOTONIC, due, 0, onHeldTimer, this) < 0)
+		{
+			DBG_ERROR(LOG_PREFIX, "cannot arm the held value timer");
+		}
+	}
+	else
+	{
+		sd_event_source_set_time(held_source, due);
+		sd_event_source_set_enabled(held_source, SD_EVENT_ONESHOT);
+	}
+}
+
+int CarlaClient::onHeldTimer(sd_event_source *source, uint64_t usec, void *userdata)
+{
+	CarlaClient *self = (CarlaClient *)userdata;
+	self->cansender.releaseHeld();
+	self->armHeldTimer();
+	return 0;
+}
+
+void CarlaClient::emitPosition(const struct text_span_t &yaw, const struct text_span_t &longitude,
+	const struct text_span_t &latitude)
 {
 	json_object* j = nullptr;
 	afb_event_t event = map_afb_event[kListEventName[Event_PositionUpdated]];
@@ -456,9 +1073,9 @@ void CarlaClient::emitPosition(const char* yaw, const char* longitude, const cha
 					lat.str().c_str()));
 #else
 	j = json_object_new_object();
-	json_object_object_add(j, kKeyYaw, json_object_new_string(yaw));
-	json_object_object_add(j, kKeyLongitude, json_object_new_string(longitude));
-	json_object_object_add(j, kKeyLatitude, json_object_new_string(latitude));
+	json_object_object_add(j, kKeyYaw, json_object_new_string_len(yaw.ptr, (int)yaw.len));
+	json_object_object_add(j, kKeyLongitude, json_object_new_string_len(longitude.ptr, (int)longitude.len));
+	json_object_object_add(j, kKeyLatitude, json_object_new_string_len(latitude.ptr, (int)latitude.len));
 #endif
 	if(afb_event_is_valid(event))
 	{
@@ -20,16 +20,29 @@
 #include <map>
 #include <string.h>
 #include <mutex>
+#include <netinet/in.h>
 
 extern "C" {
 #include <afb/afb-binding.h>
+#include <systemd/sd-event.h>
 }
 
 #include "cansender.hpp"
+#include "canreceiver.hpp"
+#include "msgframer.hpp"
+#include "msgdecoder.hpp"
+#include "cmdqueue.hpp"
+#include "latency.hpp"
 
 namespace carla
 {	
 
+#define TX_BUFFER_SIZE 4096
+#define TX_INFLIGHT_MAX 16
+#define CMD_MSG_MAX (CMD_VAL_SIZE * 6 + 64)	/* every byte of val escaped as \u00XX */
+#define CONTROL_LATENCY_REPORT_INTERVAL 1000
+#define CONTROL_LOG_INTERVAL 1000
+
 class CarlaClient
 {
 public:
@@ -44,7 +57,7 @@ public:
 	~CarlaClient();
 
 	int init();
-	int connect_server();
+	int start(sd_event *loop);
 	bool subscribe(afb_req_t req, EventType event_id);
 	bool set_demo_status(const char *status);
 	bool set_amazon_code(const char *code);
@@ -57,7 +70,30 @@ private:
 
 	int loadServer();
 	int inputJsonFilie(const char *file, json_object **obj);
-	void emitPosition(const char* yaw, const char* longitude, const char* latitude);
+	void startConnect();
+	void onConnected();
+	void closeConnection();
+	void scheduleReconnect();
+	int receiveMessages();
+	void flushCommands();
+	int appendCommand(const char *cmd, const char *val);
+	void wakeup();
+	int handleMessage(const char *msg, size_t len);
+	void handleJsonMessage(const char *msg, size_t len, bool unknown_only);
+	int handleBinaryMessage(const char *msg, size_t len);
+	bool isBinaryAck(const char *msg, size_t len);
+	void emitPosition(const struct text_span_t &yaw, const struct text_span_t &longitude,
+		const struct text_span_t &latitude);
+	void updateSpeed(int speed);
+	void updateEngineSpeed(int engine_spd);
+	void updateGear();
+	void armHeldTimer();
+
+	static int onSocketEvent(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+	static int onWakeEvent(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+	static int onReconnectTimer(sd_event_source *source, uint64_t usec, void *userdata);
+	static int onCanEvent(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+	static int onHeldTimer(sd_event_source *source, uint64_t usec, void *userdata);
 
 private:
 	std::map<std::string, afb_event_t> map_afb_event;
@@ -67,13 +103,41 @@ private:
 	int reconnect_interval;
 	int reconnect_times;
 	int socketfd;
+	int wakefd;
+	struct sockaddr_in server_addr;
+	sd_event *event_loop;
+	sd_event_source *io_source;
+	sd_event_source *timer_source;
+	sd_event_source *wake_source;
+	sd_event_source *can_source;
+	sd_event_source *held_source;	/* sends values held back by MIN_INTERVAL */
+	bool connected;
+	int reconnect_left;
+	uint64_t backoff_usec;
+	bool use_binary;
+	bool proto_negotiating;
+	char txbuf[TX_BUFFER_SIZE];
+	size_t tx_len;
 
 	CanSender cansender;
+	CanReceiver canreceiver;
+	prop_handle_t speed_handle;
+	prop_handle_t engine_speed_handle;
+	int last_speed;
+	int last_engine_spd;
+	MsgFramer framer;
+	json_tokener *tokener;
+	uint64_t unknown_keys;	/* keys only the json-c fallback handles */
 
-	bool demo_status_change;
+	CommandQueue cmd_queue;
+	uint64_t inflight_usec[TX_INFLIGHT_MAX];
+	enum cmd_type_t inflight_type[TX_INFLIGHT_MAX];
+	unsigned int inflight_cnt;
+	uint64_t inflight_dropped;	/* taken from cmd_queue, lost with the connection */
+	uint64_t control_sent;	/* CMD_CONTROL, only every CONTROL_LOG_INTERVAL is logged */
+	struct latency_stats_t cmd_latency;
+	struct latency_stats_t control_latency;	/* can receive to server send */
 	std::string demo_status;
-	bool amazon_code_change;
-	std::string amazon_code;
 	std::mutex demo_m;
 };
 
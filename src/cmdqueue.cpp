@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmdqueue.hpp"
+#include "latency.hpp"
+#include "debugmsg.hpp"
+
+namespace carla
+{
+
+static const char *kCmdTypeName[CMD_TYPE_MAX] =
+{
+	"demo",
+	"amazon_code",
+	"control",
+};
+
+const char *cmd_type_name(enum cmd_type_t type)
+{
+	return kCmdTypeName[type];
+}
+
+CommandQueue::CommandQueue() :
+head(0),
+count(0),
+coalesced_cnt(0),
+rejected_cnt(0),
+queue_m()
+{
+}
+
+CommandQueue::~CommandQueue()
+{
+}
+
+/*
+ * queue a command, returns -1 when the queue is full. enqueue_usec is the
+ * time the value came into being, now if 0.
+ */
+int CommandQueue::push(enum cmd_type_t type, const char *val, uint64_t enqueue_usec)
+{
+	std::lock_guard<std::mutex> guard(queue_m);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		struct command_t *cmd = &entries[(head + i) % CMD_QUEUE_SIZE];
+		if(cmd->type == type)
+		{
+			/* not sent yet, only the newest value matters */
+			snprintf(cmd->val, sizeof(cmd->val), "%s", val);
+			coalesced_cnt++;
+			return 0;
+		}
+	}
+
+	if(count == CMD_QUEUE_SIZE)
+	{
+		rejected_cnt++;
+		DBG_ERROR(LOG_PREFIX, "command queue full, %s dropped", cmd_type_name(type));
+		return -1;
+	}
+
+	struct command_t *cmd = &entries[(head + count) % CMD_QUEUE_SIZE];
+	cmd->type = type;
+	snprintf(cmd->val, sizeof(cmd->val), "%s", val);
+	cmd->enqueue_usec = (enqueue_usec != 0) ? enqueue_usec : monotonic_usec();
+	count++;
+
+	return 0;
+}
+
+bool CommandQueue::pop(struct command_t *cmd)
+{
+	std::lock_guard<std::mutex> guard(queue_m);
+
+	if(count == 0)
+	{
+		return false;
+	}
+
+	*cmd = entries[head];
+	head = (head + 1) % CMD_QUEUE_SIZE;
+	count--;
+
+	return true;
+}
+
+} // namespace carla
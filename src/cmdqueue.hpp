@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_CMD_QUEUE_HPP
+#define TMCAGL_CMD_QUEUE_HPP
+
+#include <stdint.h>
+#include <mutex>
+
+namespace carla
+{
+
+#define CMD_QUEUE_SIZE	16
+#define CMD_VAL_SIZE	256
+
+enum cmd_type_t
+{
+	CMD_DEMO,
+	CMD_AMAZON_CODE,
+	CMD_CONTROL,		/* driver inputs received on CAN */
+	CMD_TYPE_MAX
+};
+
+struct command_t
+{
+	enum cmd_type_t type;
+	char val[CMD_VAL_SIZE];
+	uint64_t enqueue_usec;
+};
+
+/*
+ * Bounded FIFO of commands for the CARLA server.
+ *
+ * A command whose type is already waiting replaces the value of the
+ * waiting entry in place, so the order between different command types
+ * is kept while a burst of the same command collapses to its latest
+ * value.
+ */
+class CommandQueue
+{
+public:
+	explicit CommandQueue();
+	~CommandQueue();
+
+	int push(enum cmd_type_t type, const char *val, uint64_t enqueue_usec = 0);
+	bool pop(struct command_t *cmd);
+	uint64_t coalesced() const { return coalesced_cnt; }
+	uint64_t rejected() const { return rejected_cnt; }
+
+private:
+	CommandQueue(CommandQueue const&) = delete;
+	CommandQueue& operator=(CommandQueue const&) = delete;
+
+private:
+	struct command_t entries[CMD_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+	uint64_t coalesced_cnt;
+	uint64_t rejected_cnt;
+	std::mutex queue_m;
+};
+
+extern const char *cmd_type_name(enum cmd_type_t type);
+
+} // namespace carla
+
+#endif  // !TMCAGL_CMD_QUEUE_HPP
@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dbcparser.hpp"
+#include "debugmsg.hpp"
+
+namespace carla
+{
+
+#define DBC_EFF_FLAG		0x80000000U
+#define DBC_INDEPENDENT_SIG_MSG	"VECTOR__INDEPENDENT_SIG_MSG"
+#define DBC_CYCLE_TIME_ATTR	"\"GenMsgCycleTime\""
+#define DBC_BRS_ATTR		"\"CANFD_BRS\""
+#define DBC_INITIAL_SIGNALS	256
+#define DBC_INITIAL_MESSAGES	64
+
+struct dbc_msg_t
+{
+	uint32_t id;		/* as written in the file, bit 31 marks 29 bit ids */
+	uint8_t dlc;
+	char can_id[12];	/* hex form used by prop_info_t */
+	int cycle_ms;		/* -1 if not set */
+	int brs;		/* -1 if not set */
+	unsigned int first;	/* first signal */
+	unsigned int cnt;
+};
+
+struct dbc_parser_t
+{
+	struct dbc_msg_t *msg;
+	unsigned int nMsg;
+	unsigned int msg_size;
+	struct prop_info_t *sig;
+	unsigned int nSig;
+	unsigned int sig_size;
+	int cur_msg;		/* message the following SG_ lines belong to, -1 if skipped */
+	int default_cycle_ms;
+	int default_brs;
+	unsigned int skipped;
+};
+
+static inline bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skip_space(const char *p, const char *end)
+{
+	while(p < end && is_space(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+static inline bool has_prefix(const char *p, const char *end, const char *prefix, size_t len)
+{
+	return (size_t)(end - p) >= len && memcmp(p, prefix, len) == 0;
+}
+
+/* identifier up to white space or ':' */
+static const char *parse_ident(const char *p, const char *end, const char **ident, size_t *len)
+{
+	const char *start = p;
+	while(p < end && !is_space(*p) && *p != ':')
+	{
+		p++;
+	}
+	*ident = start;
+	*len = (size_t)(p - start);
+	return p;
+}
+
+/* unsigned decimal, the line is NUL free so strtoul stops in the line */
+static const char *parse_uint(const char *p, const char *end, unsigned long *val)
+{
+	char *next = NULL;
+	p = skip_space(p, end);
+	*val = strtoul(p, &next, 10);
+	return (next == p || next > end) ? NULL : next;
+}
+
+static const char *parse_double(const char *p, const char *end, double *val)
+{
+	char *next = NULL;
+	p = skip_space(p, end);
+	*val = strtod(p, &next);
+	return (next == p || next > end) ? NULL : next;
+}
+
+static const char *expect(const char *p, const char *end, char c)
+{
+	p = skip_space(p, end);
+	return (p < end && *p == c) ? p + 1 : NULL;
+}
+
+static struct dbc_msg_t *find_msg(struct dbc_parser_t *ps, uint32_t id)
+{
+	for(unsigned int i = 0; i < ps->nMsg; i++)
+	{
+		if(ps->msg[i].id == id)
+		{
+			return &ps->msg[i];
+		}
+	}
+	return NULL;
+}
+
+/* BO_ <id> <name>: <dlc> <transmitter> */
+static int parse_bo(struct dbc_parser_t *ps, const char *p, const char *end)
+{
+	unsigned long id;
+	unsigned long dlc;
+	const char *name;
+	size_t name_len;
+
+	ps->cur_msg = -1;
+
+	if((p = parse_uint(p, end, &id)) == NULL)
+	{
+		return -1;
+	}
+	p = parse_ident(skip_space(p, end), end, &name, &name_len);
+	if((p = expect(p, end, ':')) == NULL || (p = parse_uint(p, end, &dlc)) == NULL)
+	{
+		return -1;
+	}
+
+	if(name_len == sizeof(DBC_INDEPENDENT_SIG_MSG) - 1
+		&& memcmp(name, DBC_INDEPENDENT_SIG_MSG, name_len) == 0)
+	{
+		/* pseudo message of unassigned signals */
+		return 0;
+	}
+
+	if(ps->nMsg == ps->msg_size)
+	{
+		unsigned int size = ps->msg_size ? ps->msg_size * 2 : DBC_INITIAL_MESSAGES;
+		struct dbc_msg_t *msg = (struct dbc_msg_t *)realloc(ps->msg, size * sizeof(*msg));
+		if(msg == NULL)
+		{
+			return -1;
+		}
+		ps->msg = msg;
+		ps->msg_size = size;
+	}
+
+	struct dbc_msg_t *msg = &ps->msg[ps->nMsg];
+	msg->id = (uint32_t)id;
+	msg->dlc = (uint8_t)dlc;
+	msg->cycle_ms = -1;
+	msg->brs = -1;
+	msg->first = ps->nSig;
+	msg->cnt = 0;
+	if(id & DBC_EFF_FLAG)
+	{
+		snprintf(msg->can_id, sizeof(msg->can_id), "%08X", (unsigned int)(id & CAN_EFF_MASK));
+	}
+	else
+	{
+		snprintf(msg->can_id, sizeof(msg->can_id), "%03X", (unsigned int)(id & CAN_SFF_MASK));
+	}
+
+	ps->cur_msg = (int)ps->nMsg++;
+	return 0;
+}
+
+/* SG_ <name> [M|m<n>] : <start>|<size>@<order><sign> (<factor>,<offset>) [<min>|<max>] "<unit>" <receivers> */
+static int parse_sg(struct dbc_parser_t *ps, const char *p, const char *end)
+{
+	const char *name;
+	size_t name_len;
+	unsigned long start;
+	unsigned long size;
+	double factor;
+	double offset;
+
+	if(ps->cur_msg < 0)
+	{
+		return 0;
+	}
+
+	p = parse_ident(skip_space(p, end), end, &name, &name_len);
+	p = skip_space(p, end);
+	if(p < end && *p == 'm')
+	{
+		/* multiplexed signals share their bits, they cannot be packed together */
+		ps->skipped++;
+		return 0;
+	}
+	if(p < end && *p == 'M')
+	{
+		p++;
+	}
+
+	if((p = expect(p, end, ':')) == NULL
+		|| (p = parse_uint(p, end, &start)) == NULL
+		|| (p = expect(p, end, '|')) == NULL
+		|| (p = parse_uint(p, end, &size)) == NULL
+		|| (p = expect(p, end, '@')) == NULL
+		|| p + 2 > end
+		|| (p[0] != '0' && p[0] != '1') || (p[1] != '+' && p[1] != '-'))
+	{
+		return -1;
+	}
+	bool intel = (p[0] == '1');
+	bool is_signed = (p[1] == '-');
+	p += 2;
+
+	if((p = expect(p, end, '(')) == NULL
+		|| (p = parse_double(p, end, &factor)) == NULL
+		|| (p = expect(p, end, ',')) == NULL
+		|| (p = parse_double(p, end, &offset)) == NULL
+		|| (p = expect(p, end, ')')) == NULL)
+	{
+		return -1;
+	}
+
+	if(ps->nSig == ps->sig_size)
+	{
+		unsigned int new_size = ps->sig_size ? ps->sig_size * 2 : DBC_INITIAL_SIGNALS;
+		struct prop_info_t *sig = (struct prop_info_t *)realloc(ps->sig, new_size * sizeof(*sig));
+		if(sig == NULL)
+		{
+			return -1;
+		}
+		ps->sig = sig;
+		ps->sig_size = new_size;
+	}
+
+	struct dbc_msg_t *msg = &ps->msg[ps->cur_msg];
+	struct prop_info_t *sig = &ps->sig[ps->nSig++];
+	memset(sig, 0, sizeof(*sig));
+	sig->name = strndup(name, name_len);
+	sig->can_id = strdup(msg->can_id);
+	sig->var_type = is_signed ? INT64_T : UINT64_T;
+	sig->bit_pos = (uint16_t)start;
+	sig->bit_size = (uint8_t)size;
+	sig->dlc = msg->dlc;
+	sig->byte_order = intel ? SIGNAL_ORDER_INTEL : SIGNAL_ORDER_MOTOROLA;
+	sig->is_signed = is_signed;
+	sig->priority = CAN_PRIO_NORMAL;
+	sig->factor = factor;
+	sig->offset = offset;
+	msg->cnt++;
+
+	return (sig->name != NULL && sig->can_id != NULL) ? 0 : -1;
+}
+
+/*
+ * BA_ "GenMsgCycleTime" BO_ <id> <ms>; and BA_DEF_DEF_ "GenMsgCycleTime" <ms>;
+ * the same for "CANFD_BRS" (0 or 1) of CAN FD messages
+ */
+static int parse_ba(struct dbc_parser_t *ps, const char *p, const char *end, bool def)
+{
+	unsigned long id;
+	unsigned long val;
+	bool brs;
+
+	p = skip_space(p, end);
+	if(has_prefix(p, end, DBC_CYCLE_TIME_ATTR, sizeof(DBC_CYCLE_TIME_ATTR) - 1))
+	{
+		p += sizeof(DBC_CYCLE_TIME_ATTR) - 1;
+		brs = false;
+	}
+	else if(has_prefix(p, end, DBC_BRS_ATTR, sizeof(DBC_BRS_ATTR) - 1))
+	{
+		p += sizeof(DBC_BRS_ATTR) - 1;
+		brs = true;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if(def)
+	{
+		/* enum defaults are quoted */
+		p = skip_space(p, end);
+		if(p < end && *p == '"')
+		{
+			p++;
+		}
+		if((p = parse_uint(p, end, &val)) == NULL)
+		{
+			return -1;
+		}
+		if(brs)
+		{
+			ps->default_brs = (val != 0);
+		}
+		else
+		{
+			ps->default_cycle_ms = (int)val;
+		}
+		return 0;
+	}
+
+	p = skip_space(p, end);
+	if(!has_prefix(p, end, "BO_", 3))
+	{
+		return 0;
+	}
+	if((p = parse_uint(p + 3, end, &id)) == NULL || (p = parse_uint(p, end, &val)) == NULL)
+	{
+		return -1;
+	}
+
+	struct dbc_msg_t *msg = find_msg(ps, (uint32_t)id);
+	if(msg != NULL)
+	{
+		if(brs)
+		{
+			msg->brs = (val != 0);
+		}
+		else
+		{
+			msg->cycle_ms = (int)val;
+		}
+	}
+	return 0;
+}
+
+static char *read_file(const char *fname, size_t *len)
+{
+	struct stat stbuf;
+	char *buf;
+	size_t pos = 0;
+
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &stbuf) == -1 || (buf = (char *)malloc((size_t)stbuf.st_size + 1)) == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	while(pos < (size_t)stbuf.st_size)
+	{
+		ssize_t n = read(fd, buf + pos, (size_t)stbuf.st_size - pos);
+		if(n <= 0)
+		{
+			break;
+		}
+		pos += (size_t)n;
+	}
+	close(fd);
+
+	/* NUL characters would stop strtoul/strtod early, the terminator bounds the last line */
+	buf[pos] = '\0';
+	*len = pos;
+	return buf;
+}
+
+/*
+ * load the messages and signals of a dbc file, the signals are returned in
+ * file order with the codec fields filled in, ready for init_prop_codec()
+ */
+int load_dbc(const char *fname, struct dbc_db_t *db)
+{
+	struct dbc_parser_t ps;
+	size_t len = 0;
+	unsigned int line_no = 0;
+	int ret = 0;
+
+	memset(db, 0, sizeof(*db));
+	memset(&ps, 0, sizeof(ps));
+	ps.cur_msg = -1;
+	ps.default_cycle_ms = 0;
+	ps.default_brs = 0;
+
+	char *buf = read_file(fname, &len);
+	if(buf == NULL)
+	{
+		DBG_ERROR(LOG_PREFIX, "cannot read dbc file \"%s\"", fname);
+		return -1;
+	}
+
+	const char *p = buf;
+	const char *end = buf + len;
+	while(p < end && ret == 0)
+	{
+		const char *eol = (const char *)memchr(p, '\n', (size_t)(end - p));
+		if(eol == NULL)
+		{
+			eol = end;
+		}
+		line_no++;
+
+		const char *q = skip_space(p, eol);
+		if(has_prefix(q, eol, "BO_ ", 4))
+		{
+			ret = parse_bo(&ps, q + 4, eol);
+		}
+		else if(has_prefix(q, eol, "SG_ ", 4))
+		{
+			ret = parse_sg(&ps, q + 4, eol);
+		}
+		else if(has_prefix(q, eol, "BA_ ", 4))
+		{
+			ret = parse_ba(&ps, q + 4, eol, false);
+		}
+		else if(has_prefix(q, eol, "BA_DEF_DEF_ ", 12))
+		{
+			ret = parse_ba(&ps, q + 12, eol, true);
+		}
+
+		p = eol + 1;
+	}
+	free(buf);
+
+	if(ret != 0)
+	{
+		DBG_ERROR(LOG_PREFIX, "dbc \"%s\": syntax error in line %u", fname, line_no);
+		for(unsigned int i = 0; i < ps.nSig; i++)
+		{
+			free((void *)ps.sig[i].name);
+			free((void *)ps.sig[i].can_id);
+		}
+		free(ps.sig);
+		free(ps.msg);
+		return -1;
+	}
+
+	for(unsigned int m = 0; m < ps.nMsg; m++)
+	{
+		int cycle = (ps.msg[m].cycle_ms >= 0) ? ps.msg[m].cycle_ms : ps.default_cycle_ms;
+		int brs = (ps.msg[m].brs >= 0) ? ps.msg[m].brs : ps.default_brs;
+		if(cycle > UINT16_MAX)
+		{
+			cycle = UINT16_MAX;
+		}
+		for(unsigned int i = 0; i < ps.msg[m].cnt; i++)
+		{
+			struct prop_info_t *sig = &ps.sig[ps.msg[m].first + i];
+			sig->cycle_ms = (uint16_t)cycle;
+			/* a message longer than 8 bytes is CAN FD, BRS only applies to those */
+			if(brs && sig->dlc > CAN_MAX_DLEN)
+			{
+				sig->fd_flags = CANFD_BRS;
+			}
+		}
+	}
+
+	if(ps.skipped)
+	{
+		DBG_NOTICE(LOG_PREFIX, "dbc \"%s\": %u multiplexed signals are not supported, skipped", fname, ps.skipped);
+	}
+
+	db->nSignal = ps.nSig;
+	db->nMessage = ps.nMsg;
+	db->signal = ps.sig;
+	free(ps.msg);
+
+	return 0;
+}
+
+/*
+ * free the signal table and its strings
+ */
+void free_dbc(struct dbc_db_t *db)
+{
+	for(unsigned int i = 0; i < db->nSignal; i++)
+	{
+		free((void *)db->signal[i].name);
+		free((void *)db->signal[i].can_id);
+	}
+	free(db->signal);
+	memset(db, 0, sizeof(*db));
+}
+
+} // namespace carla
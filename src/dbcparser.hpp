@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_DBC_PARSER_HPP
+#define TMCAGL_DBC_PARSER_HPP
+
+#include "canencoder.hpp"
+
+namespace carla
+{
+
+/*
+ * signal definitions loaded from a Vector DBC file.
+ * every SG_ becomes one property named after the signal, the cycle time
+ * comes from the GenMsgCycleTime attribute of its message.
+ */
+struct dbc_db_t
+{
+	unsigned int nSignal;
+	unsigned int nMessage;
+	struct prop_info_t *signal;
+};
+
+extern int load_dbc(const char *fname, struct dbc_db_t *db);
+extern void free_dbc(struct dbc_db_t *db);
+
+} // namespace carla
+
+#endif  // !TMCAGL_DBC_PARSER_HPP
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include "gearestimator.hpp"
+#include "debugmsg.hpp"
+
+namespace carla
+{
+
+/*
+ * build the thresholds from ratio[GEAR_MAX] (output to engine speed, index
+ * is the gear number, 0 neutral and 7 reverse are not estimated)
+ */
+void gear_estimator_init(struct gear_estimator_t *est, const double *ratio,
+	double kmh_per_rpm, double hysteresis)
+{
+	memset(est, 0, sizeof(*est));
+	est->cur = -1;
+
+	for(uint8_t g = 1; g < GEAR_MAX - 1; g++)
+	{
+		if(ratio[g] <= 0)
+		{
+			continue;
+		}
+		/* insertion by ascending ratio, the table is normally sorted already */
+		unsigned int i = est->cnt++;
+		while(i > 0 && ratio[est->gear[i - 1]] > ratio[g])
+		{
+			est->gear[i] = est->gear[i - 1];
+			i--;
+		}
+		est->gear[i] = g;
+	}
+
+	for(unsigned int i = 0; i < est->cnt; i++)
+	{
+		est->up[i] = HUGE_VAL;
+		est->down[i] = 0;
+	}
+	for(unsigned int i = 0; i + 1 < est->cnt; i++)
+	{
+		double lo = ratio[est->gear[i]];
+		double hi = ratio[est->gear[i + 1]];
+		double shift = pow(hi / lo, hysteresis / 2);
+		est->mid[i] = kmh_per_rpm * sqrt(lo * hi);
+		est->up[i] = est->mid[i] * shift;
+		est->down[i + 1] = est->mid[i] / shift;
+	}
+
+	DBG_INFO(LOG_PREFIX, "gear estimation: %u forward gears, %.4f km/h per rpm, hysteresis %.2f",
+		est->cnt, kmh_per_rpm, hysteresis);
+}
+
+/*
+ * returns the gear number for a sample, or -1 while none is known
+ */
+int gear_estimate(struct gear_estimator_t *est, double kmh, double rpm)
+{
+	if(est->cnt == 0)
+	{
+		return -1;
+	}
+
+	if(kmh >= GEAR_MIN_KMH && rpm >= GEAR_MIN_RPM)
+	{
+		int last = (int)est->cnt - 1;
+		if(est->cur < 0)
+		{
+			/* first estimate, the nearest ratio */
+			est->cur = 0;
+			while(est->cur < last && kmh > rpm * est->mid[est->cur])
+			{
+				est->cur++;
+			}
+		}
+		while(est->cur < last && kmh > rpm * est->up[est->cur])
+		{
+			est->cur++;
+		}
+		while(est->cur > 0 && kmh < rpm * est->down[est->cur])
+		{
+			est->cur--;
+		}
+	}
+
+	/* too slow to tell, the last gear is kept */
+	return (est->cur < 0) ? -1 : est->gear[est->cur];
+}
+
+} // namespace carla
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TMCAGL_GEAR_ESTIMATOR_HPP
+#define TMCAGL_GEAR_ESTIMATOR_HPP
+
+#include <stdint.h>
+
+namespace carla
+{
+
+#define GEAR_MAX			8	/* neutral, six forward gears, reverse */
+#define GEAR_KMH_PER_RPM_DEFAULT	0.031	/* 0.32m wheel radius, 3.9 final drive */
+#define GEAR_HYSTERESIS_DEFAULT		0.3	/* part of the gap to the next gear */
+#define GEAR_MIN_KMH			3.0	/* below this the gear is kept */
+#define GEAR_MIN_RPM			500.0
+
+/*
+ * Estimates the engaged gear from vehicle speed and engine speed.
+ *
+ * The thresholds between neighbouring gears are computed once from the
+ * ratio table: the switching point lies at the geometric mean of the two
+ * ratios (the midpoint in log space), moved by the hysteresis towards the
+ * gear not engaged. A sample then costs two multiplications per gear step.
+ */
+struct gear_estimator_t
+{
+	unsigned int cnt;		/* forward gears, by ascending ratio */
+	uint8_t gear[GEAR_MAX];		/* gear number of each entry */
+	double mid[GEAR_MAX];		/* km/h per rpm between entry i and i+1 */
+	double up[GEAR_MAX];		/* shift up from entry i above this */
+	double down[GEAR_MAX];		/* shift down from entry i below this */
+	int cur;			/* current entry, -1 until the first estimate */
+};
+
+extern void gear_estimator_init(struct gear_estimator_t *est, const double *ratio,
+	double kmh_per_rpm, double hysteresis);
+extern int gear_estimate(struct gear_estimator_t *est, double kmh, double rpm);
+
+} // namespace carla
+
+#endif  // !TMCAGL_GEAR_ESTIMATOR_HPP
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "latency.hpp"
+
+namespace carla
+{
+
+void latency_reset(struct latency_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * add one sample, the caller serializes access
+ */
+void latency_record(struct latency_stats_t *stats, uint64_t usec)
+{
+	unsigned int idx = 0;
+
+	while(idx < LATENCY_BUCKETS - 1 && (usec >> idx) != 0)
+	{
+		idx++;
+	}
+
+	stats->count++;
+	stats->sum_usec += usec;
+	if(usec > stats->max_usec)
+	{
+		stats->max_usec = usec;
+	}
+	stats->bucket[idx]++;
+}
+
+/*
+ * upper bound of the bucket holding the given percentile
+ */
+uint64_t latency_percentile(const struct latency_stats_t *stats, unsigned int percent)
+{
+	uint64_t target, seen = 0;
+
+	if(stats->count == 0)
+	{
+		return 0;
+	}
+
+	target = (stats->count * percent + 99) / 100;
+	for(unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += stats->bucket[i];
+		if(seen >= target)
+		{
+			uint64_t bound = (i == 0) ? 0 : ((1ULL << i) - 1);
+			return (bound < stats->max_usec) ? bound : stats->max_usec;
+		}
+	}
+
+	return stats->max_usec;
+}
+
+} // namespace carla
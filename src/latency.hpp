@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_LATENCY_HPP
+#define TMCAGL_LATENCY_HPP
+
+#include <stdint.h>
+#include <time.h>
+
+namespace carla
+{
+
+/* bucket i counts samples in [2^(i-1), 2^i) usec, bucket 0 counts 0 usec */
+#define LATENCY_BUCKETS	32
+
+struct latency_stats_t
+{
+	uint64_t count;
+	uint64_t sum_usec;
+	uint64_t max_usec;
+	uint64_t bucket[LATENCY_BUCKETS];
+};
+
+static inline uint64_t monotonic_usec(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t)tp.tv_sec * 1000000ULL) + ((uint64_t)tp.tv_nsec / 1000);
+}
+
+extern void latency_reset(struct latency_stats_t *stats);
+extern void latency_record(struct latency_stats_t *stats, uint64_t usec);
+extern uint64_t latency_percentile(const struct latency_stats_t *stats, unsigned int percent);
+
+} // namespace carla
+
+#endif  // !TMCAGL_LATENCY_HPP
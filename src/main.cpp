@@ -16,7 +16,6 @@
 
 #include <mutex>
 #include <json.h>
-#include <pthread.h>
 
 extern "C" {
 #include <afb/afb-binding.h>
@@ -29,14 +28,6 @@ extern "C" {
 carla::CarlaClient *g_carlaclient;
 std::mutex binding_m;
 
-void *dataReceiveThread(void *ptr)
-{
-	carla::CarlaClient *carlaClient = (carla::CarlaClient *)ptr;
-	// carlaClient->connect_server("192.168.160.168", 12345);
-	carlaClient->connect_server();
-	return nullptr;
-}
-
 static int init(afb_api_t api)
 noexcept
 {
@@ -49,8 +40,8 @@ noexcept
 	{
 		g_carlaclient->init();
 
-		pthread_t id;
-	    if (pthread_create(&id, NULL, dataReceiveThread, g_carlaclient)) {
+		/* the server connection is served by the binding's event loop */
+	    if (g_carlaclient->start(afb_api_get_event_loop(api))) {
 	        return -1;
 	    }
 	    return 0;
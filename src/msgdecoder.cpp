@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgdecoder.hpp"
+
+namespace carla
+{
+
+#define MAX_NUMBER_TEXT	64
+#define MAX_EXACT_MANTISSA	(1ULL << 53)
+
+/* powers of ten which are exact in a double */
+static const double kPow10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+	1e21, 1e22
+};
+
+static const char kKeyGps[] = "gps";
+static const char kKeySpeed[] = "speed";
+static const char kKeyEngineSpd[] = "engine_spd";
+static const char kKeyYaw[] = "yaw";
+static const char kKeyLongitude[] = "longitude";
+static const char kKeyLatitude[] = "latitude";
+
+static inline bool is_digit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
+
+static inline const char *skip_ws(const char *p, const char *end)
+{
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+	{
+		p++;
+	}
+	return p;
+}
+
+/*
+ * convert a decoded number to int, saturating at the int range.
+ * false for NaN, which has no sensible int value
+ */
+static inline bool to_int(double val, int *out)
+{
+	if(isnan(val))
+	{
+		return false;
+	}
+	if(val >= (double)INT_MAX)
+	{
+		*out = INT_MAX;
+	}
+	else if(val <= (double)INT_MIN)
+	{
+		*out = INT_MIN;
+	}
+	else
+	{
+		*out = (int)val;
+	}
+	return true;
+}
+
+static inline bool span_equals(const struct text_span_t *span, const char *str, size_t len)
+{
+	return (span->len == len) && (memcmp(span->ptr, str, len) == 0);
+}
+
+/*
+ * parse a decimal number, Clinger's fast path when the result is exact,
+ * strtod on a bounded local copy otherwise
+ */
+const char *parse_number(const char *p, const char *end, double *val)
+{
+	const char *start = p;
+	bool negative = false;
+	bool any_digit = false;
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exp10 = 0;
+
+	if(p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	for(; p < end && is_digit(*p); p++)
+	{
+		any_digit = true;
+		if(digits < 19)
+		{
+			mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+			if(mantissa != 0)
+			{
+				digits++;
+			}
+		}
+		else
+		{
+			exp10++;
+		}
+	}
+
+	if(p < end && *p == '.')
+	{
+		p++;
+		for(; p < end && is_digit(*p); p++)
+		{
+			any_digit = true;
+			if(digits < 19)
+			{
+				mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+				if(mantissa != 0)
+				{
+					digits++;
+				}
+				exp10--;
+			}
+		}
+	}
+
+	if(!any_digit)
+	{
+		return NULL;
+	}
+
+	if(p < end && (*p == 'e' || *p == 'E'))
+	{
+		bool exp_negative = false;
+		int exp = 0;
+
+		p++;
+		if(p < end && (*p == '-' || *p == '+'))
+		{
+			exp_negative = (*p == '-');
+			p++;
+		}
+		if(p >= end || !is_digit(*p))
+		{
+			return NULL;
+		}
+		for(; p < end && is_digit(*p); p++)
+		{
+			if(exp < 10000)
+			{
+				exp = exp * 10 + (*p - '0');
+			}
+		}
+		exp10 += exp_negative ? -exp : exp;
+	}
+
+	if(mantissa <= MAX_EXACT_MANTISSA && exp10 >= -22 && exp10 <= 22)
+	{
+		double d = (double)mantissa;
+		d = (exp10 < 0) ? (d / kPow10[-exp10]) : (d * kPow10[exp10]);
+		*val = negative ? -d : d;
+		return p;
+	}
+
+	/* more digits than a double holds exactly, let libc round it */
+	char text[MAX_NUMBER_TEXT];
+	size_t len = (size_t)(p - start);
+	if(len >= sizeof(text))
+	{
+		return NULL;
+	}
+	memcpy(text, start, len);
+	text[len] = '\0';
+	*val = strtod(text, NULL);
+
+	return p;
+}
+
+/*
+ * parse a string token, the span excludes the quotes and keeps escapes
+ */
+static const char *parse_string(const char *p, const char *end, struct text_span_t *span)
+{
+	if(p >= end || *p != '"')
+	{
+		return NULL;
+	}
+	p++;
+	span->ptr = p;
+
+	for(; p < end; p++)
+	{
+		if(*p == '\\')
+		{
+			p++;
+		}
+		else if(*p == '"')
+		{
+			span->len = (size_t)(p - span->ptr);
+			return p + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * skip any json value
+ */
+static const char *skip_value(const char *p, const char *end)
+{
+	struct text_span_t dummy;
+
+	if(p >= end)
+	{
+		return NULL;
+	}
+
+	if(*p == '"')
+	{
+		return parse_string(p, end, &dummy);
+	}
+
+	if(*p == '{' || *p == '[')
+	{
+		int depth = 0;
+		for(; p < end; p++)
+		{
+			if(*p == '"')
+			{
+				p = parse_string(p, end, &dummy);
+				if(p == NULL)
+				{
+					return NULL;
+				}
+				p--;
+			}
+			else if(*p == '{' || *p == '[')
+			{
+				depth++;
+			}
+			else if(*p == '}' || *p == ']')
+			{
+				if(--depth == 0)
+				{
+					return p + 1;
+				}
+			}
+		}
+		return NULL;
+	}
+
+	/* number, true, false, null */
+	while(p < end && *p != ',' && *p != '}' && *p != ']'
+		&& *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+	{
+		p++;
+	}
+
+	return p;
+}
+
+/*
+ * parse a number which may also be sent as a quoted string
+ */
+static const char *parse_value_number(const char *p, const char *end, double *val, struct text_span_t *span)
+{
+	bool quoted = false;
+
+	if(p < end && *p == '"')
+	{
+		quoted = true;
+		p++;
+	}
+
+	span->ptr = p;
+	p = parse_number(p, end, val);
+	if(p == NULL)
+	{
+		return NULL;
+	}
+	span->len = (size_t)(p - span->ptr);
+
+	if(quoted)
+	{
+		if(p >= end || *p != '"')
+		{
+			return NULL;
+		}
+		p++;
+	}
+
+	return p;
+}
+
+static const char *decode_gps(const char *p, const char *end, struct carla_msg_t *out)
+{
+	unsigned int found = 0;
+
+	if(p >= end || *p != '{')
+	{
+		return NULL;
+	}
+	p = skip_ws(p + 1, end);
+	if(p < end && *p == '}')
+	{
+		return p + 1;
+	}
+
+	while(true)
+	{
+		struct text_span_t key;
+
+		p = parse_string(p, end, &key);
+		if(p == NULL)
+		{
+			return NULL;
+		}
+		p = skip_ws(p, end);
+		if(p >= end || *p != ':')
+		{
+			return NULL;
+		}
+		p = skip_ws(p + 1, end);
+
+		if(span_equals(&key, kKeyYaw, sizeof(kKeyYaw) - 1))
+		{
+			p = parse_value_number(p, end, &out->yaw, &out->yaw_text);
+			found |= 1;
+		}
+		else if(span_equals(&key, kKeyLongitude, sizeof(kKeyLongitude) - 1))
+		{
+			p = parse_value_number(p, end, &out->longitude, &out->longitude_text);
+			found |= 2;
+		}
+		else if(span_equals(&key, kKeyLatitude, sizeof(kKeyLatitude) - 1))
+		{
+			p = parse_value_number(p, end, &out->latitude, &out->latitude_text);
+			found |= 4;
+		}
+		else
+		{
+			p = skip_value(p, end);
+		}
+		if(p == NULL)
+		{
+			return NULL;
+		}
+
+		p = skip_ws(p, end);
+		if(p >= end)
+		{
+			return NULL;
+		}
+		if(*p == '}')
+		{
+			break;
+		}
+		if(*p != ',')
+		{
+			return NULL;
+		}
+		p = skip_ws(p + 1, end);
+	}
+
+	if(found == 7)
+	{
+		out->fields |= MSG_HAS_GPS;
+	}
+
+	return p + 1;
+}
+
+/*
+ * decode one message of the known schema in place, without allocation.
+ * returns -1 when the message is not plain json of the expected shape,
+ * the caller should then use the generic json-c path.
+ */
+int decode_carla_msg(const char *msg, size_t len, struct carla_msg_t *out)
+{
+	const char *p = msg;
+	const char *end = msg + len;
+
+	out->fields = 0;
+
+	p = skip_ws(p, end);
+	if(p >= end || *p != '{')
+	{
+		return -1;
+	}
+	p = skip_ws(p + 1, end);
+	if(p < end && *p == '}')
+	{
+		return 0;
+	}
+
+	while(true)
+	{
+		struct text_span_t key;
+		struct text_span_t text;
+		double val = 0;
+
+		p = parse_string(p, end, &key);
+		if(p == NULL)
+		{
+			return -1;
+		}
+		p = skip_ws(p, end);
+		if(p >= end || *p != ':')
+		{
+			return -1;
+		}
+		p = skip_ws(p + 1, end);
+
+		if(span_equals(&key, kKeyGps, sizeof(kKeyGps) - 1))
+		{
+			p = decode_gps(p, end, out);
+		}
+		else if(span_equals(&key, kKeySpeed, sizeof(kKeySpeed) - 1))
+		{
+			p = parse_value_number(p, end, &val, &text);
+			if(p != NULL && to_int(val, &out->speed))
+			{
+				out->fields |= MSG_HAS_SPEED;
+			}
+		}
+		else if(span_equals(&key, kKeyEngineSpd, sizeof(kKeyEngineSpd) - 1))
+		{
+			p = parse_value_number(p, end, &val, &text);
+			if(p != NULL && to_int(val, &out->engine_spd))
+			{
+				out->fields |= MSG_HAS_ENGINE_SPD;
+			}
+		}
+		else
+		{
+			p = skip_value(p, end);
+			out->fields |= MSG_HAS_UNKNOWN;
+		}
+		if(p == NULL)
+		{
+			return -1;
+		}
+
+		p = skip_ws(p, end);
+		if(p >= end)
+		{
+			return -1;
+		}
+		if(*p == '}')
+		{
+			return 0;
+		}
+		if(*p != ',')
+		{
+			return -1;
+		}
+		p = skip_ws(p + 1, end);
+	}
+}
+
+static inline uint16_t get_le16(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static inline uint32_t get_le32(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline uint64_t get_le64(const char *p)
+{
+	return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static inline float get_float32(const char *p)
+{
+	uint32_t u = get_le32(p);
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static inline double get_float64(const char *p)
+{
+	uint64_t u = get_le64(p);
+	double d;
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+/*
+ * decode one binary telemetry record, the text spans are left empty
+ */
+int decode_carla_bin(const char *msg, size_t len, struct carla_msg_t *out)
+{
+	out->fields = 0;
+
+	if(len < BIN_TELEMETRY_SIZE || get_le16(msg) != len)
+	{
+		return -1;
+	}
+	if((uint8_t)msg[2] != BIN_MSG_TELEMETRY)
+	{
+		return -1;
+	}
+
+	out->fields = (uint8_t)msg[3] & (MSG_HAS_GPS | MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD);
+	out->sim_usec = get_le64(msg + 4);
+	out->latitude = get_float64(msg + 12);
+	out->longitude = get_float64(msg + 20);
+	out->yaw = get_float32(msg + 28);
+	if(!to_int(get_float32(msg + 32), &out->speed))
+	{
+		out->fields &= ~(unsigned int)MSG_HAS_SPEED;
+	}
+	if(!to_int(get_float32(msg + 36), &out->engine_spd))
+	{
+		out->fields &= ~(unsigned int)MSG_HAS_ENGINE_SPD;
+	}
+	out->yaw_text.len = 0;
+	out->longitude_text.len = 0;
+	out->latitude_text.len = 0;
+
+	return 0;
+}
+
+} // namespace carla
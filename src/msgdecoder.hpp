@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_MSG_DECODER_HPP
+#define TMCAGL_MSG_DECODER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace carla
+{
+
+#define MSG_HAS_GPS			(1 << 0)
+#define MSG_HAS_SPEED		(1 << 1)
+#define MSG_HAS_ENGINE_SPD	(1 << 2)
+#define MSG_HAS_UNKNOWN		(1 << 3)
+
+/* points into the received buffer, not NUL terminated */
+struct text_span_t
+{
+	const char *ptr;
+	size_t len;
+};
+
+/*
+ * decoded form of {"gps":{"yaw":..,"longitude":..,"latitude":..},
+ *                  "speed":..,"engine_spd":..}
+ */
+struct carla_msg_t
+{
+	unsigned int fields;
+	double yaw;
+	double longitude;
+	double latitude;
+	struct text_span_t yaw_text;
+	struct text_span_t longitude_text;
+	struct text_span_t latitude_text;
+	int speed;
+	int engine_spd;
+	uint64_t sim_usec;
+};
+
+/*
+ * binary protocol record, all fields little endian, no padding
+ *
+ *   0  uint16  record length including this header
+ *   2  uint8   record type (BIN_MSG_TELEMETRY)
+ *   3  uint8   valid fields (MSG_HAS_GPS | MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD)
+ *   4  uint64  simulation time in usec
+ *  12  float64 latitude
+ *  20  float64 longitude
+ *  28  float32 yaw
+ *  32  float32 speed
+ *  36  float32 engine speed
+ */
+#define BIN_HEADER_SIZE		4
+#define BIN_TELEMETRY_SIZE	40
+#define BIN_MSG_TELEMETRY	1
+
+/*
+ * decode_carla_msg() and decode_carla_bin() neither allocate nor log, see
+ * tools/bench_decoder.cpp. Keys outside the schema only set MSG_HAS_UNKNOWN,
+ * the caller then falls back to json-c which does allocate.
+ */
+extern int decode_carla_msg(const char *msg, size_t len, struct carla_msg_t *out);
+extern int decode_carla_bin(const char *msg, size_t len, struct carla_msg_t *out);
+extern const char *parse_number(const char *p, const char *end, double *val);
+
+} // namespace carla
+
+#endif  // !TMCAGL_MSG_DECODER_HPP
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "msgframer.hpp"
+#include "debugmsg.hpp"
+
+namespace carla
+{
+
+MsgFramer::MsgFramer() :
+mode(FRAMER_MODE_JSON),
+head(0),
+scan(0),
+tail(0),
+depth(0),
+in_string(false),
+escape(false),
+skip_newline(false),
+out_of_sync(false),
+frames_this_read(0),
+read_open(false)
+{
+	memset(&frame_stats, 0, sizeof(frame_stats));
+}
+
+MsgFramer::~MsgFramer()
+{
+}
+
+/*
+ * drop everything buffered, e.g. after the connection was lost
+ */
+void MsgFramer::reset()
+{
+	head = 0;
+	scan = 0;
+	tail = 0;
+	depth = 0;
+	in_string = false;
+	escape = false;
+	skip_newline = false;
+	out_of_sync = false;
+	frames_this_read = 0;
+	read_open = false;
+}
+
+/*
+ * switch the framing, bytes already buffered are cut the new way. The one
+ * newline that may end the message announcing binary mode still belongs to
+ * the json stream, any other byte is already part of a length prefix.
+ */
+void MsgFramer::setMode(enum framer_mode_t new_mode)
+{
+	mode = new_mode;
+	skip_newline = (new_mode == FRAMER_MODE_BINARY);
+}
+
+/*
+ * move the unconsumed bytes to the front of the buffer
+ */
+void MsgFramer::compact()
+{
+	if(head == 0)
+	{
+		return;
+	}
+
+	memmove(buffer, buffer + head, tail - head);
+	scan -= head;
+	tail -= head;
+	head = 0;
+}
+
+/*
+ * get the position for the next read, must be called before writeSpace()
+ */
+char *MsgFramer::writePtr()
+{
+	compact();
+
+	if(tail >= sizeof(buffer))
+	{
+		/* a single message does not fit into the buffer, give it up */
+		DBG_ERROR(LOG_PREFIX, "message exceeds %d bytes, dropped", FRAMER_BUFFER_SIZE);
+		frame_stats.dropped_bytes += tail;
+		reset();
+	}
+
+	return buffer + tail;
+}
+
+size_t MsgFramer::writeSpace() const
+{
+	return sizeof(buffer) - tail;
+}
+
+/*
+ * account the bytes received into writePtr()
+ */
+void MsgFramer::commit(size_t len)
+{
+	tail += len;
+	frame_stats.reads++;
+	frames_this_read = 0;
+	read_open = true;
+}
+
+/*
+ * get the next complete message, the pointer stays valid until writePtr()
+ */
+bool MsgFramer::next(const char **msg, size_t *len)
+{
+	bool found = (mode == FRAMER_MODE_BINARY) ? nextBinary(msg, len) : nextJson(msg, len);
+	if(found)
+	{
+		frames_this_read++;
+		frame_stats.frames++;
+		return true;
+	}
+
+	if(read_open)
+	{
+		frame_stats.last_frames_per_read = frames_this_read;
+		if(frames_this_read > frame_stats.max_frames_per_read)
+		{
+			frame_stats.max_frames_per_read = frames_this_read;
+		}
+		read_open = false;
+	}
+
+	return false;
+}
+
+bool MsgFramer::nextBinary(const char **msg, size_t *len)
+{
+	if(out_of_sync)
+	{
+		return false;
+	}
+	if(skip_newline)
+	{
+		/* may arrive in a later read than the json message before it */
+		if(head == tail)
+		{
+			return false;
+		}
+		if(buffer[head] == '\n')
+		{
+			head++;
+			scan = head;
+		}
+		skip_newline = false;
+	}
+	if(tail - head < 2)
+	{
+		return false;
+	}
+
+	const unsigned char *p = (const unsigned char *)(buffer + head);
+	size_t record_len = (size_t)(p[0] | (p[1] << 8));
+	if(record_len < 4)
+	{
+		/* the stream is out of sync, nothing after this can be trusted */
+		DBG_ERROR(LOG_PREFIX, "invalid record length %u", (unsigned int)record_len);
+		frame_stats.dropped_bytes += tail - head;
+		head = tail;
+		scan = tail;
+		out_of_sync = true;
+		return false;
+	}
+	if(tail - head < record_len)
+	{
+		return false;
+	}
+
+	*msg = buffer + head;
+	*len = record_len;
+	head += record_len;
+	scan = head;
+	return true;
+}
+
+bool MsgFramer::nextJson(const char **msg, size_t *len)
+{
+	if(depth == 0)
+	{
+		/* skip separators (newline, blanks) and stray bytes between messages */
+		while(head < tail && buffer[head] != '{')
+		{
+			if(buffer[head] != '\n' && buffer[head] != '\r'
+				&& buffer[head] != ' ' && buffer[head] != '\t')
+			{
+				frame_stats.dropped_bytes++;
+			}
+			head++;
+		}
+		if(scan < head)
+		{
+			scan = head;
+		}
+	}
+
+	while(scan < tail)
+	{
+		char c = buffer[scan++];
+
+		if(in_string)
+		{
+			if(escape)
+			{
+				escape = false;
+			}
+			else if(c == '\\')
+			{
+				escape = true;
+			}
+			else if(c == '"')
+			{
+				in_string = false;
+			}
+			continue;
+		}
+
+		if(c == '"')
+		{
+			in_string = true;
+		}
+		else if(c == '{' || c == '[')
+		{
+			depth++;
+		}
+		else if(c == '}' || c == ']')
+		{
+			depth--;
+			if(depth == 0)
+			{
+				*msg = buffer + head;
+				*len = scan - head;
+				head = scan;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+} // namespace carla
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_MSG_FRAMER_HPP
+#define TMCAGL_MSG_FRAMER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace carla
+{
+
+#define FRAMER_BUFFER_SIZE	(64 * 1024)
+
+enum framer_mode_t
+{
+	FRAMER_MODE_JSON,
+	FRAMER_MODE_BINARY	/* little endian uint16 length prefixed records */
+};
+
+struct framer_stats_t
+{
+	uint64_t reads;
+	uint64_t frames;
+	uint64_t dropped_bytes;
+	unsigned int last_frames_per_read;
+	unsigned int max_frames_per_read;
+};
+
+/*
+ * Splits the CARLA byte stream into complete JSON messages.
+ *
+ * Bytes that do not yet form a complete top level object are kept until
+ * the next read, so messages that span several recv() calls and several
+ * messages arriving in one recv() are both handled. Newline delimited and
+ * plain concatenated objects are accepted alike. In binary mode the stream
+ * is cut at the length prefix of each record instead.
+ */
+class MsgFramer
+{
+public:
+	explicit MsgFramer();
+	~MsgFramer();
+
+	char *writePtr();
+	size_t writeSpace() const;
+	void commit(size_t len);
+	bool next(const char **msg, size_t *len);
+	void reset();
+	void setMode(enum framer_mode_t new_mode);
+	enum framer_mode_t getMode() const { return mode; }
+	/* false once a binary length prefix was invalid, the connection must be reset */
+	bool inSync() const { return !out_of_sync; }
+
+	const struct framer_stats_t &stats() const { return frame_stats; }
+
+private:
+	MsgFramer(MsgFramer const&) = delete;
+	MsgFramer& operator=(MsgFramer const&) = delete;
+
+	void compact();
+	bool nextJson(const char **msg, size_t *len);
+	bool nextBinary(const char **msg, size_t *len);
+
+private:
+	char buffer[FRAMER_BUFFER_SIZE];
+	enum framer_mode_t mode;
+	size_t head;		/* start of the first unconsumed byte */
+	size_t scan;		/* next byte to be scanned */
+	size_t tail;		/* end of valid data */
+	int depth;
+	bool in_string;
+	bool escape;
+	bool skip_newline;	/* the newline ending the json ack before binary is pending */
+	bool out_of_sync;
+	unsigned int frames_this_read;
+	bool read_open;
+	struct framer_stats_t frame_stats;
+};
+
+} // namespace carla
+
+#endif  // !TMCAGL_MSG_FRAMER_HPP
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TMCAGL_SIGNAL_TABLE_HPP
+#define TMCAGL_SIGNAL_TABLE_HPP
+
+#include <stdint.h>
+#include <math.h>
+
+#include "canencoder.hpp"
+
+namespace carla
+{
+namespace signals
+{
+
+/*
+ * layout of one property, computed at build time the same way as
+ * init_prop_codec() does at run time
+ */
+struct signal_desc_t
+{
+	const char *name;
+	const char *can_id;
+	uint16_t bit_pos;
+	uint8_t bit_size;
+	uint8_t dlc;
+	bool fd;
+	uint8_t fd_flags;
+	uint16_t cycle_ms;
+	uint8_t bus;
+	uint8_t priority;
+	uint8_t byte_order;
+	bool is_signed;
+	double factor;
+	double offset;
+	int slot;		/* slots are registered in property order, per bus and id */
+	uint8_t byte_start;
+	uint8_t byte_cnt;
+	uint8_t shift;
+	uint64_t mask;
+	int64_t raw_min;
+	int64_t raw_max;
+	double deadband;
+	double deadband_rel;
+	uint32_t min_interval_usec;
+	double smoothing;
+	bool filter;		/* any update filter is set */
+};
+
+} // namespace signals
+} // namespace carla
+
+#ifdef CARLA_STATIC_SIGNALS
+
+/* generated by tools/gen_signal_table.py: signal_id_t, SIGNAL_COUNT, kSignals[] */
+#include "signal_table.hpp"
+
+namespace carla
+{
+namespace signals
+{
+
+template<signal_id_t ID>
+inline int64_t phys2raw(double val)
+{
+	constexpr double factor = kSignals[ID].factor;
+	constexpr double offset = kSignals[ID].offset;
+	constexpr int64_t raw_min = kSignals[ID].raw_min;
+	constexpr int64_t raw_max = kSignals[ID].raw_max;
+
+	double raw = (offset == 0) ? val : (val - offset);
+	if(factor != 1)
+	{
+		raw /= factor;
+	}
+	if(raw <= (double)raw_min)
+	{
+		return raw_min;
+	}
+	if(raw >= (double)raw_max)
+	{
+		return raw_max;
+	}
+	return llround(raw);
+}
+
+template<signal_id_t ID>
+inline int64_t phys2raw(int val)
+{
+	constexpr int64_t raw_min = kSignals[ID].raw_min;
+	constexpr int64_t raw_max = kSignals[ID].raw_max;
+
+	if(kSignals[ID].factor != 1 || kSignals[ID].offset != 0)
+	{
+		return phys2raw<ID>((double)val);
+	}
+	return (val < raw_min) ? raw_min : ((val > raw_max) ? raw_max : (int64_t)val);
+}
+
+/*
+ * merge a raw value into the signal image of its slot, the window, shift
+ * and mask are constants so this unrolls to a few loads, shifts and stores
+ */
+template<signal_id_t ID>
+inline void pack(uint8_t *image, uint64_t raw)
+{
+	constexpr unsigned int start = kSignals[ID].byte_start;
+	constexpr unsigned int cnt = kSignals[ID].byte_cnt;
+	constexpr unsigned int shift = kSignals[ID].shift;
+	constexpr uint64_t mask = kSignals[ID].mask << shift;
+	uint64_t val = (raw & kSignals[ID].mask) << shift;
+	uint8_t *win = image + start;
+	uint64_t w = 0;
+
+	if(kSignals[ID].byte_order == SIGNAL_ORDER_INTEL)
+	{
+		for(unsigned int i = 0; i < cnt; i++)
+		{
+			w |= (uint64_t)win[i] << (8 * i);
+		}
+		w = (w & ~mask) | val;
+		for(unsigned int i = 0; i < cnt; i++)
+		{
+			win[i] = (uint8_t)(w >> (8 * i));
+		}
+	}
+	else
+	{
+		for(unsigned int i = 0; i < cnt; i++)
+		{
+			w = (w << 8) | win[i];
+		}
+		w = (w & ~mask) | val;
+		for(unsigned int i = cnt; i-- > 0; )
+		{
+			win[i] = (uint8_t)w;
+			w >>= 8;
+		}
+	}
+}
+
+} // namespace signals
+} // namespace carla
+
+#endif // CARLA_STATIC_SIGNALS
+
+#endif  // !TMCAGL_SIGNAL_TABLE_HPP
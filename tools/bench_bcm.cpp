@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * cyclic transmit benchmark: sends a set of cyclic ids on a (v)can
+ * interface either from user space on the timerfd schedule of the encoder
+ * or through the kernel broadcast manager, and compares the CPU time of
+ * the sending thread and the period jitter seen by a receiving socket.
+ *
+ *   bench_bcm <raw|bcm> [interface] [ids] [period ms] [seconds]
+ *
+ *   ip link add vcan0 type vcan && ip link set vcan0 up
+ *   bench_bcm raw vcan0 32 10 10; bench_bcm bcm vcan0 32 10 10
+ *
+ * The broadcast manager runs its timers in softirq context, that time is
+ * not charged to the process; compare the system wide softirq time with
+ * e.g. mpstat when the difference matters.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <atomic>
+
+#include "canencoder.hpp"
+#include "canbcm.hpp"
+#include "latency.hpp"
+
+using namespace carla;
+
+#define BASE_ID 0x100
+#define MAX_IDS 512
+
+struct rx_state_t
+{
+	int s;
+	unsigned int ids;
+	uint64_t period_usec;
+	std::atomic<bool> stop;
+	uint64_t frames;
+	uint64_t last_usec[MAX_IDS];
+	struct latency_stats_t jitter;	/* |interval - period| */
+};
+
+static int open_raw(const char *ifname)
+{
+	struct sockaddr_can addr;
+	struct timeval tv = {0, 100 * 1000};
+	int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+
+	if(s < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = (int)if_nametoindex(ifname);
+	if(addr.can_ifindex == 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "cannot bind to %s: %s\n", ifname, strerror(errno));
+		close(s);
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return s;
+}
+
+static void *receive_loop(void *arg)
+{
+	struct rx_state_t *rx = (struct rx_state_t *)arg;
+	struct can_frame cf;
+
+	while(!rx->stop.load(std::memory_order_relaxed))
+	{
+		if(read(rx->s, &cf, sizeof(cf)) != (ssize_t)sizeof(cf))
+		{
+			continue;
+		}
+		uint64_t now = monotonic_usec();
+		unsigned int i = (cf.can_id & CAN_SFF_MASK) - BASE_ID;
+		if(i >= rx->ids)
+		{
+			continue;
+		}
+		if(rx->last_usec[i] != 0)
+		{
+			uint64_t interval = now - rx->last_usec[i];
+			latency_record(&rx->jitter, (interval > rx->period_usec) ?
+				interval - rx->period_usec : rx->period_usec - interval);
+		}
+		rx->last_usec[i] = now;
+		rx->frames++;
+	}
+	return NULL;
+}
+
+/*
+ * user space schedule: wake on the timerfd, send every due slot
+ */
+static uint64_t run_raw(int s, uint64_t end_usec)
+{
+	struct pollfd pfd = {can_schedule_fd(), POLLIN, 0};
+	struct can_data_t dat;
+	uint64_t wakeups = 0;
+
+	start_can_schedule();
+	while(monotonic_usec() < end_usec)
+	{
+		if(poll(&pfd, 1, 100) <= 0)
+		{
+			continue;
+		}
+		wakeups++;
+		on_can_schedule_timer();
+		while(pop(CAN_BUS_HS, &dat))
+		{
+			ssize_t ret = write(s, &dat.frame, (size_t)dat.mtu);
+			if(ret < 0 && errno != ENOBUFS)
+			{
+				perror("write");
+			}
+			complete_can_deadline(&dat, ret >= 0);
+		}
+	}
+	return wakeups;
+}
+
+/*
+ * kernel schedule: hand the slots to the broadcast manager and sleep
+ */
+static int run_bcm(const char *ifname, uint64_t end_usec)
+{
+	int s = bcm_open((int)if_nametoindex(ifname));
+	if(s < 0 || bcm_setup_cycles(s, CAN_BUS_HS, false) < 0)
+	{
+		return -1;
+	}
+	while(monotonic_usec() < end_usec)
+	{
+		usleep(100 * 1000);
+	}
+	close(s);	/* stops the kernel timers */
+	return 0;
+}
+
+static double cpu_msec(const struct rusage *ru)
+{
+	return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000.0
+		+ (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2 || (strcmp(argv[1], "raw") != 0 && strcmp(argv[1], "bcm") != 0))
+	{
+		fprintf(stderr, "usage: %s <raw|bcm> [interface] [ids] [period ms] [seconds]\n", argv[0]);
+		return 2;
+	}
+	bool bcm = (strcmp(argv[1], "bcm") == 0);
+	const char *ifname = (argc > 2) ? argv[2] : "vcan0";
+	unsigned int ids = (argc > 3) ? (unsigned int)atoi(argv[3]) : 32;
+	unsigned int period_ms = (argc > 4) ? (unsigned int)atoi(argv[4]) : 10;
+	unsigned int seconds = (argc > 5) ? (unsigned int)atoi(argv[5]) : 10;
+	static struct rx_state_t rx;
+	struct rusage before, after;
+	struct canfd_frame cf;
+	uint64_t wakeups = 0;
+	pthread_t rx_thread;
+
+	if(ids == 0 || ids > MAX_IDS || period_ms == 0 || seconds == 0)
+	{
+		fprintf(stderr, "ids must be 1..%d, period and seconds above 0\n", MAX_IDS);
+		return 2;
+	}
+	if(init_can_encoder(ids) < 0)
+	{
+		return 1;
+	}
+	memset(&cf, 0, sizeof(cf));
+	cf.len = CAN_MAX_DLEN;
+	for(unsigned int i = 0; i < ids; i++)
+	{
+		int slot = register_can_slot(CAN_BUS_HS, BASE_ID + i, CAN_MAX_DLEN, CAN_MTU, 0);
+		if(slot < 0 || set_can_slot_cycle(slot, period_ms) < 0)
+		{
+			return 1;
+		}
+		cf.can_id = BASE_ID + i;
+		cf.data[0] = (uint8_t)i;
+		push(slot, &cf);
+	}
+	order_can_slots();
+
+	int s = open_raw(ifname);
+	rx.s = open_raw(ifname);
+	if(s < 0 || rx.s < 0)
+	{
+		return 1;
+	}
+	/* the initial pushes are not part of the measurement */
+	clear(CAN_BUS_HS);
+	rx.ids = ids;
+	rx.period_usec = period_ms * 1000ULL;
+	latency_reset(&rx.jitter);
+	pthread_create(&rx_thread, NULL, receive_loop, &rx);
+
+	uint64_t end_usec = monotonic_usec() + seconds * 1000000ULL;
+	getrusage(RUSAGE_THREAD, &before);
+	if(bcm)
+	{
+		if(run_bcm(ifname, end_usec) < 0)
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		wakeups = run_raw(s, end_usec);
+	}
+	getrusage(RUSAGE_THREAD, &after);
+
+	rx.stop.store(true);
+	pthread_join(rx_thread, NULL);
+
+	uint64_t expected = (uint64_t)ids * seconds * 1000ULL / period_ms;
+	printf("%s: %u ids every %u ms for %u s on %s\n", bcm ? "bcm" : "raw", ids, period_ms, seconds, ifname);
+	printf("  sender cpu:%.1f ms (%.3f%% of one core) wakeups:%llu\n",
+		cpu_msec(&after) - cpu_msec(&before),
+		(cpu_msec(&after) - cpu_msec(&before)) / (seconds * 10.0),
+		(unsigned long long)wakeups);
+	printf("  frames:%llu of %llu expected\n", (unsigned long long)rx.frames, (unsigned long long)expected);
+	printf("  period jitter: p50:%lluus p99:%lluus max:%lluus\n",
+		(unsigned long long)latency_percentile(&rx.jitter, 50),
+		(unsigned long long)latency_percentile(&rx.jitter, 99),
+		(unsigned long long)rx.jitter.max_usec);
+
+	close(s);
+	close(rx.s);
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * signal codec benchmark: packs a mix of Intel and Motorola, signed,
+ * scaled and up to 64 bit signals with phys2raw() and makeCanFrame(),
+ * checks every value by decoding it again, and times the id to slot
+ * lookup of find_can_slot() for standard and extended ids.
+ * Exits non zero if a value or a lookup comes back wrong.
+ *
+ *   bench_codec [iterations]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "canencoder.hpp"
+
+using namespace carla;
+
+#define DEFAULT_ITERATIONS 1000000UL
+#define LOOKUP_IDS 2048		/* of each kind */
+#define NSEC_PER_SEC 1000000000ULL
+
+struct signal_spec_t
+{
+	const char *name;
+	const char *can_id;
+	uint16_t bit_pos;
+	uint8_t bit_size;
+	uint8_t byte_order;
+	bool is_signed;
+	double factor;
+	double offset;
+	double min;		/* physical range exercised */
+	double max;
+};
+
+static const struct signal_spec_t kSpecs[] =
+{
+	{"VehicleSpeed",	"3E9",		0,	16,	SIGNAL_ORDER_INTEL,	false,	0.01,	0,	0,	300},
+	{"EngineSpeed",		"3E9",		16,	14,	SIGNAL_ORDER_INTEL,	false,	0.5,	0,	0,	8000},
+	{"SteeringAngle",	"25",		7,	16,	SIGNAL_ORDER_MOTOROLA,	true,	0.1,	0,	-780,	780},
+	{"Gear",		"3E8",		3,	4,	SIGNAL_ORDER_MOTOROLA,	false,	1,	0,	0,	8},
+	{"Brake",		"70",		8,	1,	SIGNAL_ORDER_INTEL,	false,	1,	0,	0,	1},
+	{"Temperature",		"18FEEE00",	0,	8,	SIGNAL_ORDER_INTEL,	false,	1,	-40,	-40,	210},
+	{"Odometer",		"18FEC100",	0,	32,	SIGNAL_ORDER_INTEL,	false,	0.005,	0,	0,	2e7},
+	{"YawRate",		"130",		23,	12,	SIGNAL_ORDER_MOTOROLA,	true,	0.01,	0,	-20,	20},
+	{"Timestamp",		"18FF0000",	0,	64,	SIGNAL_ORDER_INTEL,	false,	1,	0,	0,	1e15},
+	{"Legacy",		"200",		4,	10,	SIGNAL_ORDER_LEGACY,	false,	1,	0,	0,	1023},
+};
+
+#define SIGNAL_CNT (sizeof(kSpecs) / sizeof(kSpecs[0]))
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double rng_range(double min, double max)
+{
+	return min + (max - min) * ((double)(rng_next() >> 11) / (double)(1ULL << 53));
+}
+
+static int init_signals(struct prop_info_t *props)
+{
+	for(unsigned int i = 0; i < SIGNAL_CNT; i++)
+	{
+		const struct signal_spec_t *spec = &kSpecs[i];
+		struct prop_info_t *p = &props[i];
+
+		memset(p, 0, sizeof(*p));
+		p->name = spec->name;
+		p->can_id = spec->can_id;
+		p->bit_pos = spec->bit_pos;
+		p->bit_size = spec->bit_size;
+		p->dlc = CAN_MAX_DLEN;
+		p->byte_order = spec->byte_order;
+		p->is_signed = spec->is_signed;
+		p->factor = spec->factor;
+		p->offset = spec->offset;
+		if(init_prop_codec(p) < 0)
+		{
+			return -1;
+		}
+		p->slot = register_can_slot(CAN_BUS_HS, p->frame_id, p->dlc, CAN_MTU, 0);
+		if(p->slot < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * pack random values and decode them again, a value may only move by the
+ * rounding to the signal resolution
+ */
+static unsigned long check_signals(struct prop_info_t *props, unsigned long n)
+{
+	unsigned long wrong = 0;
+	struct canfd_frame cf;
+
+	for(unsigned long k = 0; k < n; k++)
+	{
+		unsigned int i = (unsigned int)(k % SIGNAL_CNT);
+		struct prop_info_t *p = &props[i];
+		double val = rng_range(kSpecs[i].min, kSpecs[i].max);
+		double back;
+
+		p->raw = phys2raw(p, val);
+		if(makeCanFrame(p, &cf) <= 0 || decodeCanSignal(p, &cf, &back) < 0
+			|| fabs(back - val) > p->factor / 2 + fabs(val) * 1e-12)
+		{
+			if(wrong++ < 10)
+			{
+				printf("  %s: %.17g came back as %.17g\n", p->name, val, back);
+			}
+		}
+	}
+	return wrong;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+	struct prop_info_t props[SIGNAL_CNT];
+	static double values[SIGNAL_CNT][256];
+	static canid_t ids[2 * LOOKUP_IDS];
+	static int slots[2 * LOOKUP_IDS];
+	struct canfd_frame cf;
+	unsigned long wrong;
+	long sink = 0;
+	int rc = 0;
+
+	if(iterations == 0)
+	{
+		iterations = DEFAULT_ITERATIONS;
+	}
+	if(init_can_encoder(SIGNAL_CNT + 2 * LOOKUP_IDS) < 0 || init_signals(props) < 0)
+	{
+		return 1;
+	}
+
+	wrong = check_signals(props, 100000);
+	printf("round trip: %lu of 100000 values wrong\n", wrong);
+	rc |= (wrong != 0);
+
+	for(unsigned int i = 0; i < SIGNAL_CNT; i++)
+	{
+		for(unsigned int j = 0; j < 256; j++)
+		{
+			values[i][j] = rng_range(kSpecs[i].min, kSpecs[i].max);
+		}
+	}
+	uint64_t start = now_nsec();
+	for(unsigned long k = 0; k < iterations; k++)
+	{
+		unsigned int i = (unsigned int)(k % SIGNAL_CNT);
+		struct prop_info_t *p = &props[i];
+		p->raw = phys2raw(p, values[i][(k / SIGNAL_CNT) & 255]);
+		sink += makeCanFrame(p, &cf) + cf.data[0];
+	}
+	uint64_t nsec = now_nsec() - start;
+	printf("pack:   %lu signals %6.1f ns/signal %12.0f signals/s\n",
+		iterations, (double)nsec / iterations, iterations * (double)NSEC_PER_SEC / (nsec ? nsec : 1));
+
+	/* extended ids go through the hash, standard ids through the dense map */
+	for(unsigned int i = 0; i < LOOKUP_IDS; i++)
+	{
+		ids[2 * i] = 0x400 + i % 0x3FF;
+		ids[2 * i + 1] = (0x10000000 + i * 0x1021) | CAN_EFF_FLAG;
+	}
+	for(unsigned int i = 0; i < 2 * LOOKUP_IDS; i++)
+	{
+		slots[i] = find_can_slot(CAN_BUS_HS, ids[i]);
+		if(slots[i] < 0)
+		{
+			slots[i] = register_can_slot(CAN_BUS_HS, ids[i], CAN_MAX_DLEN, CAN_MTU, 0);
+		}
+	}
+	wrong = 0;
+	start = now_nsec();
+	for(unsigned long k = 0; k < iterations; k++)
+	{
+		unsigned int i = (unsigned int)((k * 7919) % (2 * LOOKUP_IDS));
+		int slot = find_can_slot(CAN_BUS_HS, ids[i]);
+		wrong += (slot != slots[i]);
+		sink += slot;
+	}
+	nsec = now_nsec() - start;
+	printf("lookup: %lu ids     %6.1f ns/lookup %12.0f lookups/s (%u standard, %u extended ids) wrong:%lu\n",
+		iterations, (double)nsec / iterations, iterations * (double)NSEC_PER_SEC / (nsec ? nsec : 1),
+		0x3FF, LOOKUP_IDS, wrong);
+	rc |= (wrong != 0);
+
+	/* keep the loops from being optimized away */
+	if(sink == 1)
+	{
+		printf("%ld\n", sink);
+	}
+	return rc;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * signal database load benchmark: writes a DBC file with the given number
+ * of signals and times load_dbc() alone, the full CanSender::init() on it
+ * (codec layout, property index, frame slots) and the name lookup of
+ * getPropertyHandle(). Exits non zero if a name does not resolve or the
+ * init takes longer than LOAD_LIMIT_MSEC.
+ *
+ *   bench_dbc [signals] [runs]
+ *
+ * The files are written to a temporary directory, which is the working
+ * directory of CanSender (see STEERING_WHEEL_JSON in tools/CMakeLists.txt).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cansender.hpp"
+#include "dbcparser.hpp"
+#include "latency.hpp"
+
+using namespace carla;
+
+#define DEFAULT_SIGNALS 5000
+#define DEFAULT_RUNS 10
+#define SIGNALS_PER_MSG 8
+#define LOAD_LIMIT_MSEC 100
+#define SIGNAL_NAME_SIZE 32
+
+static int write_file(const char *path, const char *text)
+{
+	FILE *fp = fopen(path, "w");
+	if(fp == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	fputs(text, fp);
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * 8 byte messages of 8 signals, Intel and Motorola alternating, every
+ * fourth message with a 29 bit id and every other one cyclic
+ */
+static int write_dbc(const char *path, unsigned int signals)
+{
+	unsigned int msgs = (signals + SIGNALS_PER_MSG - 1) / SIGNALS_PER_MSG;
+	FILE *fp = fopen(path, "w");
+
+	if(fp == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	fprintf(fp, "VERSION \"\"\n\nNS_ :\n\nBS_:\n\nBU_: ECU\n\n");
+	for(unsigned int m = 0; m < msgs; m++)
+	{
+		unsigned long id = (m % 4 == 3) ? (0x80000000UL | (0x18F00000UL + m)) : (0x100UL + m);
+		fprintf(fp, "BO_ %lu MSG_%u: 8 ECU\n", id, m);
+		for(unsigned int k = 0; k < SIGNALS_PER_MSG && m * SIGNALS_PER_MSG + k < signals; k++)
+		{
+			if(k % 2 == 0)
+			{
+				fprintf(fp, " SG_ SIG_%u_%u : %u|8@1+ (0.5,0) [0|127.5] \"km/h\" ECU\n", m, k, 8 * k);
+			}
+			else
+			{
+				fprintf(fp, " SG_ SIG_%u_%u : %u|8@0- (1,-10) [-138|117] \"\" ECU\n", m, k, 8 * k + 7);
+			}
+		}
+		fprintf(fp, "\n");
+	}
+	fprintf(fp, "BA_DEF_ BO_ \"GenMsgCycleTime\" INT 0 10000;\n");
+	fprintf(fp, "BA_DEF_DEF_ \"GenMsgCycleTime\" 0;\n");
+	for(unsigned int m = 0; m < msgs; m += 2)
+	{
+		unsigned long id = (m % 4 == 3) ? (0x80000000UL | (0x18F00000UL + m)) : (0x100UL + m);
+		fprintf(fp, "BA_ \"GenMsgCycleTime\" BO_ %lu 100;\n", id);
+	}
+	fclose(fp);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int signals = (argc > 1) ? (unsigned int)atoi(argv[1]) : DEFAULT_SIGNALS;
+	unsigned int runs = (argc > 2) ? (unsigned int)atoi(argv[2]) : DEFAULT_RUNS;
+	char dir[] = "/tmp/bench_dbc.XXXXXX";
+	struct dbc_db_t db;
+	uint64_t min_usec = UINT64_MAX;
+	uint64_t sum_usec = 0;
+	int rc = 0;
+
+	if(signals == 0 || runs == 0)
+	{
+		fprintf(stderr, "usage: %s [signals] [runs]\n", argv[0]);
+		return 2;
+	}
+	/* keep the per property log lines of init() out of the measurement */
+	if(getenv("USE_HMI_DEBUG") == NULL)
+	{
+		setenv("USE_HMI_DEBUG", "1", 1);
+	}
+	if(mkdtemp(dir) == NULL || chdir(dir) < 0)
+	{
+		perror(dir);
+		return 1;
+	}
+	if(write_dbc("bench.dbc", signals) < 0
+		|| write_file("steering_wheel.json", "{\"dbc\": \"bench.dbc\"}\n") < 0
+		|| write_file("dev-mapping.conf", "[CANbus-mapping]\nhs=\"vcan0\"\nls=\"vcan1\"\n") < 0)
+	{
+		return 1;
+	}
+
+	for(unsigned int i = 0; i < runs; i++)
+	{
+		uint64_t start = monotonic_usec();
+		if(load_dbc("bench.dbc", &db) < 0)
+		{
+			return 1;
+		}
+		uint64_t usec = monotonic_usec() - start;
+		min_usec = (usec < min_usec) ? usec : min_usec;
+		sum_usec += usec;
+		if(i + 1 < runs)
+		{
+			free_dbc(&db);
+		}
+	}
+	printf("load_dbc:  %u signals in %u messages, min %llu us, avg %llu us\n",
+		db.nSignal, db.nMessage, (unsigned long long)min_usec, (unsigned long long)(sum_usec / runs));
+	free_dbc(&db);
+
+	/* once only, the encoder and the transmit thread are process wide */
+	static CanSender sender;
+	uint64_t start = monotonic_usec();
+	if(sender.init() < 0)
+	{
+		return 1;
+	}
+	uint64_t init_usec = monotonic_usec() - start;
+	printf("init:      %llu us for dbc, codec, property index and frame slots\n", (unsigned long long)init_usec);
+	if(init_usec > LOAD_LIMIT_MSEC * 1000ULL)
+	{
+		printf("  over the limit of %u ms\n", LOAD_LIMIT_MSEC);
+		rc = 1;
+	}
+
+	char (*names)[SIGNAL_NAME_SIZE] = (char (*)[SIGNAL_NAME_SIZE])malloc((size_t)signals * SIGNAL_NAME_SIZE);
+	if(names == NULL)
+	{
+		return 1;
+	}
+	for(unsigned int s = 0; s < signals; s++)
+	{
+		snprintf(names[s], SIGNAL_NAME_SIZE, "SIG_%u_%u", s / SIGNALS_PER_MSG, s % SIGNALS_PER_MSG);
+	}
+	unsigned long wrong = 0;
+	start = monotonic_usec();
+	for(unsigned int i = 0; i < runs; i++)
+	{
+		for(unsigned int s = 0; s < signals; s++)
+		{
+			wrong += (sender.getPropertyHandle(names[s]) != (prop_handle_t)s);
+		}
+	}
+	printf("lookup:    %.1f ns per name, %lu wrong\n",
+		(monotonic_usec() - start) * 1000.0 / ((double)signals * runs), wrong);
+	rc |= (wrong != 0);
+	free(names);
+
+	unlink("bench.dbc");
+	unlink("steering_wheel.json");
+	unlink("dev-mapping.conf");
+	if(chdir("/") == 0)
+	{
+		rmdir(dir);
+	}
+	/* the transmit thread runs until the process ends */
+	fflush(stdout);
+	_exit(rc);
+}
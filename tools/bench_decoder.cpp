@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * decoder benchmark: times decode_carla_msg() and decode_carla_bin() and
+ * counts heap allocations made while decoding. Exits non zero if the
+ * decoder allocated or rejected a sample, or if an out of range speed
+ * was not saturated.
+ *
+ *   bench_decoder [iterations]
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "msgdecoder.hpp"
+
+using namespace carla;
+
+#define DEFAULT_ITERATIONS 1000000UL
+#define NSEC_PER_SEC 1000000000ULL
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static volatile unsigned long alloc_count;
+
+/* interpose the allocator, operator new ends up here as well */
+extern "C" void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+
+static const char *kJsonSamples[] =
+{
+	"{\"gps\": {\"yaw\": \"12.5\", \"longitude\": \"8.001536315145\", \"latitude\": \"49.002756551435\"}, "
+		"\"speed\": 42, \"engine_spd\": 2100}",
+	"{\"gps\": {\"yaw\": -178.25, \"longitude\": 8.001536315145, \"latitude\": 49.002756551435}}",
+	"{\"speed\": 0, \"engine_spd\": 780}",
+	"{\"gps\":{\"latitude\":\"49.002756551435\",\"yaw\":\"0.0\",\"longitude\":\"8.001536315145\"},\"speed\":\"130\"}",
+};
+
+/* speeds outside of the int range saturate */
+static const struct
+{
+	const char *json;
+	int speed;
+	int engine_spd;
+} kRangeSamples[] =
+{
+	{"{\"speed\": 1e20, \"engine_spd\": -1e20}", INT_MAX, INT_MIN},
+	{"{\"speed\": \"2147483648\", \"engine_spd\": \"-2147483649\"}", INT_MAX, INT_MIN},
+	{"{\"speed\": -42.9, \"engine_spd\": 2147483647}", -42, INT_MAX},
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void put_le(char *p, uint64_t val, int bytes)
+{
+	for(int i = 0; i < bytes; i++)
+	{
+		p[i] = (char)(val >> (8 * i));
+	}
+}
+
+static void make_bin_record(char *rec, float speed, float engine)
+{
+	double lat = 49.002756551435;
+	double lon = 8.001536315145;
+	float yaw = 12.5f;
+	uint64_t u64;
+	uint32_t u32;
+
+	memset(rec, 0, BIN_TELEMETRY_SIZE);
+	put_le(rec, BIN_TELEMETRY_SIZE, 2);
+	rec[2] = BIN_MSG_TELEMETRY;
+	rec[3] = MSG_HAS_GPS | MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD;
+	put_le(rec + 4, 123456789ULL, 8);
+	memcpy(&u64, &lat, 8);
+	put_le(rec + 12, u64, 8);
+	memcpy(&u64, &lon, 8);
+	put_le(rec + 20, u64, 8);
+	memcpy(&u32, &yaw, 4);
+	put_le(rec + 28, u32, 4);
+	memcpy(&u32, &speed, 4);
+	put_le(rec + 32, u32, 4);
+	memcpy(&u32, &engine, 4);
+	put_le(rec + 36, u32, 4);
+}
+
+static int check_range(void)
+{
+	const size_t nsamples = sizeof(kRangeSamples) / sizeof(kRangeSamples[0]);
+	const unsigned int both = MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD;
+	char rec[BIN_TELEMETRY_SIZE];
+	struct carla_msg_t msg;
+	int rc = 0;
+
+	for(size_t i = 0; i < nsamples; i++)
+	{
+		const char *json = kRangeSamples[i].json;
+		if(decode_carla_msg(json, strlen(json), &msg) < 0 || (msg.fields & both) != both
+			|| msg.speed != kRangeSamples[i].speed || msg.engine_spd != kRangeSamples[i].engine_spd)
+		{
+			printf("range: %s decoded as speed:%d engine_spd:%d\n", json, msg.speed, msg.engine_spd);
+			rc = 1;
+		}
+	}
+
+	make_bin_record(rec, 1e20f, -1e20f);
+	if(decode_carla_bin(rec, sizeof(rec), &msg) < 0 || (msg.fields & both) != both
+		|| msg.speed != INT_MAX || msg.engine_spd != INT_MIN)
+	{
+		printf("range: binary 1e20/-1e20 decoded as speed:%d engine_spd:%d\n", msg.speed, msg.engine_spd);
+		rc = 1;
+	}
+
+	/* NaN has no int value, the field is dropped but the record is kept */
+	make_bin_record(rec, NAN, 2100.0f);
+	if(decode_carla_bin(rec, sizeof(rec), &msg) < 0 || (msg.fields & both) != MSG_HAS_ENGINE_SPD
+		|| !(msg.fields & MSG_HAS_GPS))
+	{
+		printf("range: binary NaN speed kept, fields:0x%x\n", msg.fields);
+		rc = 1;
+	}
+
+	return rc;
+}
+
+static int report(const char *name, unsigned long iterations, uint64_t nsec,
+	unsigned long allocs, unsigned long failed)
+{
+	printf("%-6s %10lu msgs %8.1f ns/msg %10.0f msgs/s allocs:%lu failed:%lu\n",
+		name, iterations, (double)nsec / iterations,
+		iterations * (double)NSEC_PER_SEC / (nsec ? nsec : 1), allocs, failed);
+	return (allocs == 0 && failed == 0) ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], nullptr, 0) : DEFAULT_ITERATIONS;
+	const size_t nsamples = sizeof(kJsonSamples) / sizeof(kJsonSamples[0]);
+	size_t lens[sizeof(kJsonSamples) / sizeof(kJsonSamples[0])];
+	char rec[BIN_TELEMETRY_SIZE];
+	struct carla_msg_t msg;
+	unsigned long failed = 0;
+	unsigned long allocs;
+	double sink = 0;
+	uint64_t start;
+	int rc = 0;
+
+	if(iterations == 0)
+	{
+		iterations = DEFAULT_ITERATIONS;
+	}
+	for(size_t i = 0; i < nsamples; i++)
+	{
+		lens[i] = strlen(kJsonSamples[i]);
+	}
+	rc |= check_range();
+	make_bin_record(rec, 42.0f, 2100.0f);
+
+	/* warm up, the first call may touch lazily bound symbols */
+	decode_carla_msg(kJsonSamples[0], lens[0], &msg);
+	decode_carla_bin(rec, sizeof(rec), &msg);
+
+	allocs = alloc_count;
+	start = now_nsec();
+	for(unsigned long i = 0; i < iterations; i++)
+	{
+		size_t n = i % nsamples;
+		if(decode_carla_msg(kJsonSamples[n], lens[n], &msg) < 0 || (msg.fields & MSG_HAS_UNKNOWN))
+		{
+			failed++;
+		}
+		sink += msg.speed + msg.latitude;
+	}
+	rc |= report("json", iterations, now_nsec() - start, alloc_count - allocs, failed);
+
+	failed = 0;
+	allocs = alloc_count;
+	start = now_nsec();
+	for(unsigned long i = 0; i < iterations; i++)
+	{
+		if(decode_carla_bin(rec, sizeof(rec), &msg) < 0)
+		{
+			failed++;
+		}
+		sink += msg.speed + msg.latitude;
+	}
+	rc |= report("binary", iterations, now_nsec() - start, alloc_count - allocs, failed);
+
+	/* keep the loops from being optimized away */
+	if(sink == 0.5)
+	{
+		printf("%f\n", sink);
+	}
+
+	return rc;
+}
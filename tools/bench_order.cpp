@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * transmit order check: registers random standard and extended ids on
+ * both buses with one or two random priority classes each, pushes a
+ * random subset of them in random order and checks that pop() returns
+ * every pushed id exactly once, by priority class (high, normal, low),
+ * then in CAN arbitration order. The expected order is computed here
+ * from the id bits, independently of can_arbitration_key(). Times the
+ * push and pop of a frame. Exits non zero on any violation.
+ *
+ *   bench_order [ids] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "canencoder.hpp"
+
+using namespace carla;
+
+#define DEFAULT_IDS 512
+#define DEFAULT_ROUNDS 2000
+#define NSEC_PER_SEC 1000000000ULL
+
+struct order_id_t
+{
+	canid_t can_id;
+	int bus;
+	int slot;
+	unsigned int urgency;	/* 0: high, 1: normal, 2: low */
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static unsigned int urgency_of(unsigned int prio)
+{
+	return (prio == CAN_PRIO_HIGH) ? 0 : (prio == CAN_PRIO_NORMAL) ? 1 : 2;
+}
+
+/*
+ * which of two frames wins the arbitration: the 11 bit base id, then the
+ * dominant RTR/IDE bits of a standard frame against the recessive SRR/IDE
+ * of an extended one, then the 18 bit id extension
+ */
+static int arbitration_cmp(canid_t a, canid_t b)
+{
+	bool a_eff = (a & CAN_EFF_FLAG) != 0;
+	bool b_eff = (b & CAN_EFF_FLAG) != 0;
+	uint32_t a_base = a_eff ? (a & CAN_EFF_MASK) >> 18 : (a & CAN_SFF_MASK);
+	uint32_t b_base = b_eff ? (b & CAN_EFF_MASK) >> 18 : (b & CAN_SFF_MASK);
+
+	if(a_base != b_base)
+	{
+		return (a_base < b_base) ? -1 : 1;
+	}
+	if(a_eff != b_eff)
+	{
+		return a_eff ? 1 : -1;
+	}
+	if(!a_eff)
+	{
+		return 0;
+	}
+	uint32_t a_ext = a & 0x3FFFF;
+	uint32_t b_ext = b & 0x3FFFF;
+	return (a_ext < b_ext) ? -1 : (a_ext > b_ext) ? 1 : 0;
+}
+
+static int order_cmp(const struct order_id_t *a, const struct order_id_t *b)
+{
+	if(a->urgency != b->urgency)
+	{
+		return (a->urgency < b->urgency) ? -1 : 1;
+	}
+	return arbitration_cmp(a->can_id, b->can_id);
+}
+
+/*
+ * distinct ids, a quarter of them extended. extended ids often share the
+ * base of a standard one to exercise the IDE bit.
+ */
+static int init_ids(struct order_id_t *ids, unsigned int cnt)
+{
+	for(unsigned int i = 0; i < cnt; i++)
+	{
+		struct order_id_t *o = &ids[i];
+		bool unique;
+
+		do
+		{
+			uint64_t r = rng_next();
+			if((r & 3) == 0)
+			{
+				uint32_t base = (i > 0 && (r & 4)) ? (ids[(r >> 8) % i].can_id & CAN_SFF_MASK) : (uint32_t)(r >> 16) & CAN_SFF_MASK;
+				o->can_id = CAN_EFF_FLAG | (base << 18) | ((uint32_t)(r >> 32) & 0x3FFFF);
+			}
+			else
+			{
+				o->can_id = (canid_t)(r >> 16) & CAN_SFF_MASK;
+			}
+			o->bus = (int)((r >> 60) & 1);
+			unique = true;
+			for(unsigned int j = 0; j < i && unique; j++)
+			{
+				unique = !(ids[j].can_id == o->can_id && ids[j].bus == o->bus);
+			}
+		} while(!unique);
+
+		o->slot = register_can_slot(o->bus, o->can_id, 8, CAN_MTU, 0);
+		if(o->slot < 0)
+		{
+			return -1;
+		}
+
+		/* some ids have properties of two classes, the most urgent one counts */
+		unsigned int prio = (unsigned int)(rng_next() % CAN_PRIO_MAX);
+		o->urgency = urgency_of(prio);
+		set_can_slot_priority(o->slot, prio);
+		if(rng_next() & 1)
+		{
+			prio = (unsigned int)(rng_next() % CAN_PRIO_MAX);
+			if(urgency_of(prio) < o->urgency)
+			{
+				o->urgency = urgency_of(prio);
+			}
+			set_can_slot_priority(o->slot, prio);
+		}
+	}
+	order_can_slots();
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int cnt = (argc > 1) ? (unsigned int)strtoul(argv[1], NULL, 0) : DEFAULT_IDS;
+	unsigned long rounds = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_ROUNDS;
+	unsigned long violations = 0;
+	unsigned long lost = 0;
+	unsigned long frames = 0;
+	uint64_t nsec = 0;
+
+	if(cnt == 0 || cnt > 2048)
+	{
+		cnt = DEFAULT_IDS;
+	}
+	if(rounds == 0)
+	{
+		rounds = DEFAULT_ROUNDS;
+	}
+
+	struct order_id_t *ids = (struct order_id_t *)calloc(cnt, sizeof(*ids));
+	struct order_id_t **by_slot = (struct order_id_t **)calloc(cnt, sizeof(*by_slot));
+	unsigned int *perm = (unsigned int *)calloc(cnt, sizeof(*perm));
+	bool *pushed = (bool *)calloc(cnt, sizeof(*pushed));
+	if(ids == NULL || by_slot == NULL || perm == NULL || pushed == NULL
+		|| init_can_encoder(cnt) < 0 || init_ids(ids, cnt) < 0)
+	{
+		return 1;
+	}
+	for(unsigned int i = 0; i < cnt; i++)
+	{
+		by_slot[ids[i].slot] = &ids[i];
+		perm[i] = i;
+	}
+
+	for(unsigned long r = 0; r < rounds; r++)
+	{
+		struct canfd_frame cf;
+		struct can_data_t dat;
+		unsigned int n = 1 + (unsigned int)(rng_next() % cnt);
+
+		/* the first n of a random permutation, in that order */
+		for(unsigned int i = cnt - 1; i > 0; i--)
+		{
+			unsigned int j = (unsigned int)(rng_next() % (i + 1));
+			unsigned int t = perm[i];
+			perm[i] = perm[j];
+			perm[j] = t;
+		}
+		memset(&cf, 0, sizeof(cf));
+		cf.len = 8;
+
+		uint64_t start = now_nsec();
+		for(unsigned int i = 0; i < n; i++)
+		{
+			const struct order_id_t *o = &ids[perm[i]];
+			cf.can_id = o->can_id;
+			push(o->slot, &cf);
+			pushed[o->slot] = true;
+		}
+
+		for(int bus = 0; bus < CAN_BUS_MAX; bus++)
+		{
+			const struct order_id_t *prev = NULL;
+			while(pop(bus, &dat))
+			{
+				const struct order_id_t *o = by_slot[dat.slot];
+				frames++;
+				if(!pushed[dat.slot] || o->bus != bus || dat.frame.can_id != o->can_id)
+				{
+					if(lost++ < 10)
+					{
+						printf("  bus %d: unexpected frame %X\n", bus, dat.frame.can_id);
+					}
+				}
+				else if(prev != NULL && order_cmp(prev, o) >= 0)
+				{
+					if(violations++ < 10)
+					{
+						printf("  bus %d: %X (class %u) sent before %X (class %u)\n",
+							bus, prev->can_id, prev->urgency, o->can_id, o->urgency);
+					}
+				}
+				pushed[dat.slot] = false;
+				prev = o;
+			}
+		}
+		nsec += now_nsec() - start;
+
+		for(unsigned int i = 0; i < cnt; i++)
+		{
+			if(pushed[i])
+			{
+				if(lost++ < 10)
+				{
+					printf("  %X pushed but not sent\n", by_slot[i]->can_id);
+				}
+				pushed[i] = false;
+			}
+		}
+	}
+
+	printf("ids:%u rounds:%lu frames:%lu order violations:%lu lost or unexpected:%lu push+pop:%.1f ns/frame\n",
+		cnt, rounds, frames, violations, lost, frames ? (double)nsec / (double)frames : 0.0);
+	free(ids);
+	free(by_slot);
+	free(perm);
+	free(pushed);
+	return (violations != 0 || lost != 0) ? 1 : 0;
+}
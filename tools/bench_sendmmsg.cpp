@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * batched transmit benchmark: sends bursts of frames on a (v)can
+ * interface with one write() per frame or one sendmmsg() per burst and
+ * prints syscalls, throughput and CPU time of both.
+ *
+ *   bench_sendmmsg [interface] [frames per burst] [bursts]
+ *
+ *   ip link add vcan0 type vcan && ip link set vcan0 up
+ *   bench_sendmmsg vcan0 16 100000
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "latency.hpp"
+
+using namespace carla;
+
+#define BURST_MAX 64	/* TX_BATCH_MAX of the transmitter */
+#define BASE_ID 0x100
+
+struct run_stats_t
+{
+	uint64_t frames;
+	uint64_t syscalls;
+	uint64_t saturated;	/* ENOBUFS or EAGAIN, waited for the socket */
+	uint64_t usec;
+	double cpu_msec;
+};
+
+static int open_raw(const char *ifname)
+{
+	struct sockaddr_can addr;
+	int loopback = 0;
+	int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+
+	if(s < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+	/* nobody listens here, keep the receive path out of the measurement */
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_LOOPBACK, &loopback, sizeof(loopback));
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = (int)if_nametoindex(ifname);
+	if(addr.can_ifindex == 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "cannot bind to %s: %s\n", ifname, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static double cpu_msec(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+}
+
+static void wait_writable(int s, struct run_stats_t *st)
+{
+	struct pollfd pfd = {s, POLLOUT, 0};
+	st->saturated++;
+	poll(&pfd, 1, 10);
+}
+
+static void run(int s, bool batched, unsigned int burst, unsigned long bursts, struct run_stats_t *st)
+{
+	struct can_frame frames[BURST_MAX];
+	struct iovec iov[BURST_MAX];
+	struct mmsghdr msgs[BURST_MAX];
+
+	memset(st, 0, sizeof(*st));
+	memset(frames, 0, sizeof(frames));
+	memset(msgs, 0, sizeof(msgs));
+	for(unsigned int i = 0; i < burst; i++)
+	{
+		frames[i].can_id = BASE_ID + i;
+		frames[i].can_dlc = CAN_MAX_DLEN;
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	double cpu = cpu_msec();
+	uint64_t start = monotonic_usec();
+	for(unsigned long n = 0; n < bursts; n++)
+	{
+		unsigned int sent = 0;
+		for(unsigned int i = 0; i < burst; i++)
+		{
+			frames[i].data[0] = (uint8_t)n;
+		}
+		while(sent < burst)
+		{
+			int ret;
+			st->syscalls++;
+			if(batched)
+			{
+				ret = sendmmsg(s, &msgs[sent], burst - sent, 0);
+			}
+			else
+			{
+				ret = (write(s, &frames[sent], sizeof(frames[sent])) < 0) ? -1 : 1;
+			}
+			if(ret < 0)
+			{
+				if(errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+				{
+					perror("send");
+					return;
+				}
+				wait_writable(s, st);
+				continue;
+			}
+			sent += (unsigned int)ret;
+		}
+		st->frames += burst;
+	}
+	st->usec = monotonic_usec() - start;
+	st->cpu_msec = cpu_msec() - cpu;
+}
+
+static void report(const char *name, const struct run_stats_t *st)
+{
+	double sec = st->usec / 1e6;
+	printf("%-9s frames:%llu syscalls:%llu frames/syscall:%.2f %.0f frames/s cpu:%.0f ms (%.2f us/frame) saturated:%llu\n",
+		name, (unsigned long long)st->frames, (unsigned long long)st->syscalls,
+		st->syscalls ? (double)st->frames / st->syscalls : 0.0,
+		sec > 0 ? st->frames / sec : 0.0, st->cpu_msec,
+		st->frames ? st->cpu_msec * 1000.0 / st->frames : 0.0,
+		(unsigned long long)st->saturated);
+}
+
+int main(int argc, char **argv)
+{
+	const char *ifname = (argc > 1) ? argv[1] : "vcan0";
+	unsigned int burst = (argc > 2) ? (unsigned int)atoi(argv[2]) : 16;
+	unsigned long bursts = (argc > 3) ? strtoul(argv[3], NULL, 0) : 100000;
+	struct run_stats_t st;
+
+	if(burst == 0 || burst > BURST_MAX || bursts == 0)
+	{
+		fprintf(stderr, "usage: %s [interface] [frames per burst 1..%d] [bursts]\n", argv[0], BURST_MAX);
+		return 2;
+	}
+
+	int s = open_raw(ifname);
+	if(s < 0)
+	{
+		return 1;
+	}
+
+	printf("%lu bursts of %u frames on %s\n", bursts, burst, ifname);
+	run(s, false, burst, bursts, &st);
+	report("write", &st);
+	run(s, true, burst, bursts, &st);
+	report("sendmmsg", &st);
+
+	close(s);
+	return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * static vs runtime signal encoding: every signal of the generated table
+ * (CARLA_SIGNAL_MAP) is updated once through the runtime codec,
+ * phys2raw() + makeCanFrame() + push(), as CanSender::updateValue() does,
+ * and once through the compile time path of CanSender::updateSignal(),
+ * signals::phys2raw<ID>() + signals::pack<ID>() + push_slot_image().
+ * Both must leave the same frame images, the program exits non zero if not.
+ *
+ *   bench_static [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <type_traits>
+
+#include "canencoder.hpp"
+#include "signaltable.hpp"
+
+using namespace carla;
+
+#define DEFAULT_ROUNDS 1000000UL
+#define VALUE_SETS 64
+#define NSEC_PER_SEC 1000000000ULL
+
+static struct prop_info_t props[signals::SIGNAL_COUNT];
+static double values[VALUE_SETS][signals::SIGNAL_COUNT];
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/* one update of every signal, unrolled at compile time */
+template<int ID>
+inline typename std::enable_if<(ID == signals::SIGNAL_COUNT)>::type
+update_static(const double *val)
+{
+}
+
+template<int ID>
+inline typename std::enable_if<(ID < signals::SIGNAL_COUNT)>::type
+update_static(const double *val)
+{
+	constexpr signals::signal_id_t id = (signals::signal_id_t)ID;
+	constexpr int slot = signals::kSignals[id].slot;
+
+	signals::pack<id>(can_slot_image(slot), (uint64_t)signals::phys2raw<id>(val[ID]));
+	push_slot_image(slot);
+	update_static<ID + 1>(val);
+}
+
+static void update_runtime(const double *val)
+{
+	struct canfd_frame cf;
+
+	for(unsigned int i = 0; i < signals::SIGNAL_COUNT; i++)
+	{
+		props[i].raw = phys2raw(&props[i], val[i]);
+		if(makeCanFrame(&props[i], &cf) > 0)
+		{
+			push(props[i].slot, &cf);
+		}
+	}
+}
+
+static int init_props(void)
+{
+	for(unsigned int i = 0; i < signals::SIGNAL_COUNT; i++)
+	{
+		const struct signals::signal_desc_t *d = &signals::kSignals[i];
+		struct prop_info_t *p = &props[i];
+
+		memset(p, 0, sizeof(*p));
+		p->name = d->name;
+		p->can_id = d->can_id;
+		p->bit_pos = d->bit_pos;
+		p->bit_size = d->bit_size;
+		p->dlc = d->dlc;
+		p->fd = d->fd;
+		p->fd_flags = d->fd_flags;
+		p->bus = d->bus;
+		p->byte_order = d->byte_order;
+		p->is_signed = d->is_signed;
+		p->factor = d->factor;
+		p->offset = d->offset;
+		if(init_prop_codec(p) < 0)
+		{
+			return -1;
+		}
+		p->slot = register_can_slot(p->bus, p->frame_id, p->dlc, p->fd ? CANFD_MTU : CAN_MTU, p->fd_flags);
+		if(p->slot != d->slot)
+		{
+			fprintf(stderr, "%s: slot %d, the table says %d\n", p->name, p->slot, d->slot);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * physical values spread over the raw range of each signal
+ */
+static void init_values(void)
+{
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+
+	for(unsigned int n = 0; n < VALUE_SETS; n++)
+	{
+		for(unsigned int i = 0; i < signals::SIGNAL_COUNT; i++)
+		{
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			double r = (double)(x >> 11) / (double)(1ULL << 53);
+			double raw = (double)props[i].raw_min + r * ((double)props[i].raw_max - (double)props[i].raw_min);
+			values[n][i] = raw * props[i].factor + props[i].offset;
+		}
+	}
+}
+
+static int compare_images(uint8_t (*expected)[CANFD_MAX_DLEN])
+{
+	int wrong = 0;
+
+	for(unsigned int i = 0; i < signals::SIGNAL_COUNT; i++)
+	{
+		int slot = props[i].slot;
+		if(memcmp(can_slot_image(slot), expected[slot], props[i].dlc) != 0)
+		{
+			fprintf(stderr, "frame image of %s differs\n", props[i].name);
+			wrong++;
+		}
+	}
+	return wrong;
+}
+
+static void report(const char *name, unsigned long rounds, uint64_t nsec)
+{
+	unsigned long updates = rounds * signals::SIGNAL_COUNT;
+	printf("%-8s %lu updates %6.1f ns/update %12.0f updates/s\n",
+		name, updates, (double)nsec / updates, updates * (double)NSEC_PER_SEC / (nsec ? nsec : 1));
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long rounds = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ROUNDS;
+	static uint8_t images[signals::SIGNAL_COUNT][CANFD_MAX_DLEN];
+	int wrong = 0;
+
+	if(rounds == 0)
+	{
+		rounds = DEFAULT_ROUNDS;
+	}
+	if(init_can_encoder(signals::SIGNAL_COUNT) < 0 || init_props() < 0)
+	{
+		return 1;
+	}
+	init_values();
+
+	/* both paths must build the same frames */
+	for(unsigned int n = 0; n < VALUE_SETS; n++)
+	{
+		update_runtime(values[n]);
+		for(unsigned int i = 0; i < signals::SIGNAL_COUNT; i++)
+		{
+			memcpy(images[props[i].slot], can_slot_image(props[i].slot), props[i].dlc);
+		}
+		update_static<0>(values[n]);
+		wrong += compare_images(images);
+	}
+	printf("%u signals from the generated table, %d frame images differ\n",
+		(unsigned int)signals::SIGNAL_COUNT, wrong);
+
+	uint64_t start = now_nsec();
+	for(unsigned long n = 0; n < rounds; n++)
+	{
+		update_runtime(values[n % VALUE_SETS]);
+	}
+	report("runtime", rounds, now_nsec() - start);
+
+	start = now_nsec();
+	for(unsigned long n = 0; n < rounds; n++)
+	{
+		update_static<0>(values[n % VALUE_SETS]);
+	}
+	report("static", rounds, now_nsec() - start);
+
+	return (wrong != 0) ? 1 : 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * stress driver for tools/vcan_stress.py: runs CanSender with the
+ * configuration of the working directory and writes an increasing
+ * sequence number to every given property at a fixed rate. When done it
+ * waits for the queues to drain and prints the last value of each
+ * property, which the receiver must have seen last.
+ *
+ *   carla_can_driver <updates per second> <seconds> <property>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cansender.hpp"
+#include "latency.hpp"
+
+using namespace carla;
+
+#define MAX_PROPS 64
+#define DRAIN_TIMEOUT_USEC (2 * 1000 * 1000ULL)
+#define DRAIN_SETTLE_USEC (200 * 1000)
+
+static bool queues_empty(void)
+{
+	for(int bus = 0; bus < CAN_BUS_MAX; bus++)
+	{
+		struct can_queue_stats_t stats;
+		get_can_queue_stats(bus, &stats);
+		if(stats.depth != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	static CanSender sender;
+	prop_handle_t handle[MAX_PROPS];
+	int nprops = argc - 3;
+
+	if(argc < 4 || nprops > MAX_PROPS)
+	{
+		fprintf(stderr, "usage: %s <updates per second> <seconds> <property>...\n", argv[0]);
+		return 2;
+	}
+	unsigned int rate = (unsigned int)atoi(argv[1]);
+	unsigned int seconds = (unsigned int)atoi(argv[2]);
+	if(rate == 0 || rate > 1000000)
+	{
+		fprintf(stderr, "rate must be 1..1000000\n");
+		return 2;
+	}
+
+	if(sender.init() < 0)
+	{
+		return 1;
+	}
+	for(int i = 0; i < nprops; i++)
+	{
+		handle[i] = sender.getPropertyHandle(argv[3 + i]);
+		if(handle[i] == INVALID_PROP_HANDLE)
+		{
+			fprintf(stderr, "unknown property %s\n", argv[3 + i]);
+			return 1;
+		}
+	}
+	/* let the transmit thread open the buses */
+	usleep(DRAIN_SETTLE_USEC);
+
+	struct timespec next;
+	long period_nsec = 1000000000L / (long)rate;
+	unsigned long ticks = (unsigned long)rate * seconds;
+	unsigned long late = 0;
+	int seq = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(unsigned long t = 0; t < ticks; t++)
+	{
+		seq++;
+		for(int i = 0; i < nprops; i++)
+		{
+			sender.updateValue(handle[i], seq);
+		}
+
+		next.tv_nsec += period_nsec;
+		while(next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+		{
+			late++;
+			continue;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	uint64_t deadline = monotonic_usec() + DRAIN_TIMEOUT_USEC;
+	while(!queues_empty() && monotonic_usec() < deadline)
+	{
+		usleep(1000);
+	}
+	/* a batch held over a saturation is not part of the queue depth */
+	usleep(DRAIN_SETTLE_USEC);
+
+	printf("updates %lu late %lu drained %d\n", ticks, late, queues_empty() ? 1 : 0);
+	for(int i = 0; i < nprops; i++)
+	{
+		printf("sent %s %d\n", argv[3 + i], seq);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	/* the transmit thread runs until the process ends */
+	_exit(0);
+}
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Reference CARLA bridge server for testing the client without a simulator.
+
+usage: carla_test_server.py [--port 12345] [--protocol json|binary] [--rate 20]
+                            [--count N] [--chunk N] [--bad-record N]
+
+Speaks both wire protocols described in README.md. With --protocol binary
+the server answers the client's {"cmd":"hello", "val":"binary"} with
+{"proto":"binary"} followed by a newline and then sends 40 byte telemetry
+records; otherwise, or if the client does not ask, it sends newline
+delimited JSON. Commands from the client are printed to stdout.
+
+--chunk N    write the stream in pieces of at most N bytes to exercise framing
+--bad-record N
+             after N records send one with a wrong length prefix; the client
+             must drop the connection and reconnect
+"""
+
+import argparse
+import json
+import math
+import select
+import socket
+import struct
+import sys
+import time
+
+BIN_TELEMETRY_SIZE = 40
+BIN_MSG_TELEMETRY = 1
+MSG_HAS_GPS = 1
+MSG_HAS_SPEED = 2
+MSG_HAS_ENGINE_SPD = 4
+HELLO_WAIT = 0.5
+
+
+class CommandReader(object):
+    """Splits the client's concatenated JSON commands."""
+
+    def __init__(self):
+        self.buf = ""
+        self.decoder = json.JSONDecoder()
+
+    def feed(self, data):
+        self.buf += data.decode("utf-8", "replace")
+        cmds = []
+        while True:
+            text = self.buf.lstrip()
+            if not text:
+                self.buf = ""
+                break
+            try:
+                obj, end = self.decoder.raw_decode(text)
+            except ValueError:
+                self.buf = text
+                break
+            cmds.append(obj)
+            self.buf = text[end:]
+        return cmds
+
+
+def telemetry(n, rate):
+    t = float(n) / rate
+    speed = 60.0 + 60.0 * math.sin(t / 10.0)
+    engine = 800.0 + speed * 35.0
+    lat = 49.002756551435 + 0.0001 * math.sin(t / 30.0)
+    lon = 8.001536315145 + 0.0001 * math.cos(t / 30.0)
+    yaw = math.degrees(t / 30.0) % 360.0 - 180.0
+    return int(t * 1000000), lat, lon, yaw, speed, engine
+
+
+def json_record(n, rate):
+    _, lat, lon, yaw, speed, engine = telemetry(n, rate)
+    msg = {"gps": {"yaw": "%.6f" % yaw, "longitude": "%.12f" % lon, "latitude": "%.12f" % lat},
+           "speed": int(speed), "engine_spd": int(engine)}
+    return (json.dumps(msg) + "\n").encode()
+
+
+def bin_record(n, rate, length=BIN_TELEMETRY_SIZE):
+    usec, lat, lon, yaw, speed, engine = telemetry(n, rate)
+    rec = struct.pack("<HBBQddfff", length, BIN_MSG_TELEMETRY,
+                      MSG_HAS_GPS | MSG_HAS_SPEED | MSG_HAS_ENGINE_SPD,
+                      usec, lat, lon, yaw, speed, engine)
+    assert len(rec) == BIN_TELEMETRY_SIZE
+    return rec
+
+
+def send(conn, data, chunk):
+    step = chunk if chunk > 0 else len(data)
+    for i in range(0, len(data), step):
+        conn.sendall(data[i:i + step])
+
+
+def print_commands(reader, data):
+    for cmd in reader.feed(data):
+        print("cmd: %s" % json.dumps(cmd))
+    sys.stdout.flush()
+
+
+def serve(conn, args):
+    reader = CommandReader()
+    binary = False
+
+    # the client sends its hello right after connecting
+    deadline = time.time() + HELLO_WAIT
+    while time.time() < deadline and not binary:
+        ready, _, _ = select.select([conn], [], [], max(0.0, deadline - time.time()))
+        if not ready:
+            break
+        data = conn.recv(4096)
+        if not data:
+            return
+        for cmd in reader.feed(data):
+            print("cmd: %s" % json.dumps(cmd))
+            if cmd.get("cmd") == "hello" and cmd.get("val") == "binary" and args.protocol == "binary":
+                binary = True
+    if binary:
+        send(conn, b'{"proto":"binary"}\n', args.chunk)
+    print("protocol: %s" % ("binary" if binary else "json"))
+    sys.stdout.flush()
+
+    n = 0
+    period = 1.0 / args.rate
+    next_tx = time.time()
+    while args.count == 0 or n < args.count:
+        timeout = max(0.0, next_tx - time.time())
+        ready, _, _ = select.select([conn], [], [], timeout)
+        if ready:
+            data = conn.recv(4096)
+            if not data:
+                print("client closed the connection after %d records" % n)
+                return
+            print_commands(reader, data)
+            continue
+        if binary:
+            bad = args.bad_record > 0 and n == args.bad_record
+            rec = bin_record(n, args.rate, BIN_TELEMETRY_SIZE + 4 if bad else BIN_TELEMETRY_SIZE)
+            if bad:
+                print("sending a record with a bad length prefix")
+        else:
+            rec = json_record(n, args.rate)
+        send(conn, rec, args.chunk)
+        n += 1
+        next_tx += period
+
+
+def main():
+    parser = argparse.ArgumentParser(description="reference CARLA bridge server")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=12345)
+    parser.add_argument("--protocol", choices=("json", "binary"), default="json",
+                        help="highest protocol the server agrees to")
+    parser.add_argument("--rate", type=float, default=20.0, help="records per second")
+    parser.add_argument("--count", type=int, default=0, help="records per connection, 0 = endless")
+    parser.add_argument("--chunk", type=int, default=0, help="max bytes per write, 0 = whole records")
+    parser.add_argument("--bad-record", type=int, default=0,
+                        help="send a record with a wrong length after this many (binary only)")
+    args = parser.parse_args()
+
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind((args.host, args.port))
+    srv.listen(1)
+    print("listening on %s:%d" % (args.host, args.port))
+    sys.stdout.flush()
+    while True:
+        conn, addr = srv.accept()
+        print("client %s:%d connected" % addr)
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        try:
+            serve(conn, args)
+        except (OSError, socket.error) as e:
+            print("connection error: %s" % e)
+        finally:
+            conn.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Generate signal_table.hpp from steering_wheel_map.json.
+
+usage: gen_signal_table.py <steering_wheel_map.json> <signal_table.hpp>
+
+The layout rules mirror init_prop_codec() in src/canencoder.cpp.
+"""
+
+import json
+import re
+import sys
+
+ORDER = {"legacy": 0, "intel": 1, "little_endian": 1, "motorola": 2, "big_endian": 2}
+ORDER_NAME = ["SIGNAL_ORDER_LEGACY", "SIGNAL_ORDER_INTEL", "SIGNAL_ORDER_MOTOROLA"]
+BUS = {"hs": 0, "ls": 1}
+BUS_NAME = ["CAN_BUS_HS", "CAN_BUS_LS"]
+PRIORITY = {"high": 0, "normal": 1, "low": 2}
+PRIORITY_NAME = ["CAN_PRIO_HIGH", "CAN_PRIO_NORMAL", "CAN_PRIO_LOW"]
+SIGNED_TYPES = ("int8_t", "int16_t", "int", "int32_t", "int64_t")
+CAN_EFF_FLAG = 0x80000000
+CAN_SFF_MASK = 0x7FF
+CAN_EFF_MASK = 0x1FFFFFFF
+CAN_MAX_DLEN = 8
+CANFD_MAX_DLEN = 64
+CANFD_BRS = 0x01
+CANFD_LENGTHS = (0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64)
+
+
+def is_true(text):
+    return text in ("true", "1")
+
+
+def strtoul(text):
+    """strtoul(text, 0, 0)"""
+    text = text.strip()
+    if text.lower().startswith("0x"):
+        return int(text, 16)
+    if len(text) > 1 and text.startswith("0"):
+        return int(text, 8)
+    return int(text)
+
+
+def layout(sig):
+    size = sig["bit_size"]
+    pos = sig["bit_pos"]
+    if size == 0 or size > 64:
+        raise ValueError("invalid bit size %d" % size)
+    if sig["byte_order"] == 1:
+        first = pos // 8
+        last = (pos + size - 1) // 8
+        shift = pos % 8
+    else:
+        msb = pos if sig["byte_order"] == 0 else (pos // 8) * 8 + (7 - pos % 8)
+        first = msb // 8
+        last = (msb + size - 1) // 8
+        shift = (last + 1) * 8 - msb - size
+    if last >= sig["dlc"]:
+        raise ValueError("does not fit into %d bytes" % sig["dlc"])
+    if last - first + 1 > 8:
+        raise ValueError("spans more than 8 bytes")
+
+    mask = (1 << size) - 1
+    if sig["is_signed"]:
+        raw_max = mask >> 1
+        raw_min = -raw_max - 1
+    else:
+        raw_min = 0
+        raw_max = mask if size < 63 else (1 << 63) - 1
+    sig.update(byte_start=first, byte_cnt=last - first + 1, shift=shift,
+               mask=mask, raw_min=raw_min, raw_max=raw_max)
+
+
+def parse(path):
+    with open(path) as f:
+        # json-c accepts trailing commas, so the maps contain them
+        text = re.sub(r",(\s*[}\]])", r"\1", f.read())
+    props = json.loads(text)["PROPERTYS"]
+
+    signals = []
+    slots = {}
+    for prop in props:
+        sig = {
+            "name": prop["PROPERTY"],
+            "can_id": prop["CANID"],
+            "bit_pos": strtoul(prop["BIT_POSITION"]),
+            "bit_size": strtoul(prop["BIT_SIZE"]),
+            "dlc": strtoul(prop["DLC"]),
+            "cycle_ms": strtoul(prop.get("CYCLE", "0")),
+            "byte_order": ORDER[prop.get("BYTE_ORDER", "legacy")],
+            "bus": BUS[prop.get("BUS", "hs")],
+            "priority": PRIORITY[prop.get("PRIORITY", "normal")],
+            "factor": float(prop.get("FACTOR", "1")) or 1.0,
+            "offset": float(prop.get("OFFSET", "0")),
+            "deadband": abs(float(prop.get("DEADBAND", "0"))),
+            "deadband_rel": abs(float(prop.get("DEADBAND_REL", "0"))),
+            "min_interval_usec": strtoul(prop.get("MIN_INTERVAL", "0")) * 1000,
+            "smoothing": float(prop.get("SMOOTHING", "0")),
+        }
+        if not 0 <= sig["smoothing"] <= 1:
+            raise ValueError("%s: SMOOTHING must be in (0, 1]" % sig["name"])
+        if sig["smoothing"] == 1:
+            sig["smoothing"] = 0.0
+        sig["filter"] = (sig["deadband"] > 0 or sig["deadband_rel"] > 0
+                         or sig["min_interval_usec"] != 0 or sig["smoothing"] > 0)
+        sig["fd_flags"] = CANFD_BRS if is_true(prop.get("BRS", "")) else 0
+        sig["fd"] = (is_true(prop.get("FD", "")) or sig["fd_flags"] != 0
+                     or sig["dlc"] > CAN_MAX_DLEN)
+        if "SIGNED" in prop:
+            sig["is_signed"] = is_true(prop["SIGNED"])
+        else:
+            sig["is_signed"] = prop.get("TYPE", "") in SIGNED_TYPES
+        if any(s["name"] == sig["name"] for s in signals):
+            raise ValueError("%s: properties sharing a name need the runtime map" % sig["name"])
+        if sig["dlc"] == 0 or sig["dlc"] > (CANFD_MAX_DLEN if sig["fd"] else CAN_MAX_DLEN):
+            raise ValueError("%s: invalid dlc" % sig["name"])
+        if sig["fd"]:
+            sig["dlc"] = min(n for n in CANFD_LENGTHS if n >= sig["dlc"])
+        try:
+            layout(sig)
+        except ValueError as e:
+            raise ValueError("%s: %s" % (sig["name"], e))
+
+        if not re.fullmatch(r"[0-9A-Fa-f]+", sig["can_id"]):
+            raise ValueError("%s: invalid can id %s" % (sig["name"], sig["can_id"]))
+        frame_id = int(sig["can_id"], 16)
+        if len(sig["can_id"]) > 3:
+            if frame_id > CAN_EFF_MASK:
+                raise ValueError("%s: can id %s exceeds 29 bits" % (sig["name"], sig["can_id"]))
+            frame_id |= CAN_EFF_FLAG
+        elif frame_id > CAN_SFF_MASK:
+            raise ValueError("%s: can id %s exceeds 11 bits" % (sig["name"], sig["can_id"]))
+        sig["slot"] = slots.setdefault((sig["bus"], frame_id), len(slots))
+        signals.append(sig)
+    return signals
+
+
+def c_int64(v):
+    if v == (1 << 63) - 1:
+        return "INT64_MAX"
+    if v == -(1 << 63):
+        return "INT64_MIN"
+    return "%dLL" % v
+
+
+def ident(name):
+    return re.sub(r"[^0-9A-Za-z_]", "_", name)
+
+
+def emit(signals, src, out):
+    lines = [
+        "/* generated by tools/gen_signal_table.py from %s, do not edit */" % src,
+        "",
+        "#ifndef TMCAGL_SIGNAL_TABLE_GENERATED_HPP",
+        "#define TMCAGL_SIGNAL_TABLE_GENERATED_HPP",
+        "",
+        "namespace carla",
+        "{",
+        "namespace signals",
+        "{",
+        "",
+        "enum signal_id_t",
+        "{",
+    ]
+    for sig in signals:
+        lines.append("\tSIG_%s," % ident(sig["name"]))
+    lines += ["\tSIGNAL_COUNT", "};", ""]
+    for sig in signals:
+        lines.append("#define SIGNAL_HAS_%s 1" % ident(sig["name"]))
+    lines += ["", "constexpr struct signal_desc_t kSignals[SIGNAL_COUNT] =", "{"]
+    for sig in signals:
+        lines.append(
+            '\t{"%s", "%s", %d, %d, %d, %s, %d, %d, %s, %s, %s, %s, %r, %r, %d, %d, %d, %d, 0x%XULL, %s, %s, '
+            '%r, %r, %d, %r, %s},'
+            % (sig["name"], sig["can_id"], sig["bit_pos"], sig["bit_size"], sig["dlc"],
+               "true" if sig["fd"] else "false", sig["fd_flags"],
+               sig["cycle_ms"], BUS_NAME[sig["bus"]], PRIORITY_NAME[sig["priority"]], ORDER_NAME[sig["byte_order"]],
+               "true" if sig["is_signed"] else "false", sig["factor"], sig["offset"],
+               sig["slot"], sig["byte_start"], sig["byte_cnt"], sig["shift"], sig["mask"],
+               c_int64(sig["raw_min"]), c_int64(sig["raw_max"]),
+               sig["deadband"], sig["deadband_rel"], sig["min_interval_usec"],
+               sig["smoothing"], "true" if sig["filter"] else "false"))
+    lines += [
+        "};",
+        "",
+        "} // namespace signals",
+        "} // namespace carla",
+        "",
+        "#endif  // !TMCAGL_SIGNAL_TABLE_GENERATED_HPP",
+        "",
+    ]
+    with open(out, "w") as f:
+        f.write("\n".join(lines))
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 2
+    try:
+        signals = parse(sys.argv[1])
+    except (OSError, KeyError, ValueError) as e:
+        sys.stderr.write("gen_signal_table: %s\n" % e)
+        return 1
+    emit(signals, sys.argv[1], sys.argv[2])
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 TOYOTA MOTOR CORPORATION
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""vcan stress test of the CAN transmit path.
+
+usage: vcan_stress.py --driver <carla_can_driver> [--rate 2000] [--seconds 12]
+                      [--limit-kbit 125] [--expect-saturation] [--keep-dir]
+
+Needs root, the vcan module and candump (can-utils). Brings up vcan0 (hs)
+and vcan1 (ls), writes a map of 4 + 4 properties of 32 bit each, one per
+CAN id, records both buses with candump and runs carla_can_driver
+(built with -DCARLA_BENCHMARKS=ON), which writes an increasing sequence
+number to every property at --rate updates per second.
+
+Checks, per CAN id:
+  ordering   the values seen never go backwards
+  loss       the last value seen is the last value written
+Updates that were replaced by a newer value before they were sent
+(coalesced in the queue, or superseded after a saturation) show up as
+skipped sequence numbers, which is allowed.
+
+--limit-kbit puts a token bucket qdisc with a short queue on both
+interfaces, so the device queue overflows like a real bus at that bit
+rate: sends fail with ENOBUFS and the bus report of the driver must show
+saturation, retries and superseded frames (--expect-saturation).
+"""
+
+import argparse
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+BUSES = (("hs", "vcan0", 0x101), ("ls", "vcan1", 0x201))
+PROPS_PER_BUS = 4
+CYCLE_MS = 10   # the first property of each bus is also sent cyclically
+
+CANDUMP_RE = re.compile(r"^\(([0-9.]+)\)\s+(\S+)\s+([0-9A-Fa-f]+)#([0-9A-Fa-f]*)")
+REPORT_RE = re.compile(r"can bus (hs|ls): .*?coalesced:(\d+) saturated:(\d+) retries:(\d+) "
+                       r"superseded:(\d+) blocked:(\d+)ms errors:(\d+)")
+
+
+def run(cmd, check=True):
+    return subprocess.run(cmd, check=check, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          universal_newlines=True)
+
+
+def setup_bus(ifname, limit_kbit):
+    if run(["ip", "link", "show", ifname], check=False).returncode != 0:
+        run(["ip", "link", "add", "dev", ifname, "type", "vcan"])
+    run(["ip", "link", "set", ifname, "up"])
+    run(["tc", "qdisc", "del", "dev", ifname, "root"], check=False)
+    if limit_kbit:
+        # room for a few frames only, a full queue drops with ENOBUFS
+        run(["tc", "qdisc", "add", "dev", ifname, "root", "tbf", "rate", "%dkbit" % limit_kbit,
+             "burst", "1600", "limit", "1600"])
+
+
+def properties():
+    props = []
+    for bus, _, base in BUSES:
+        for i in range(PROPS_PER_BUS):
+            props.append({"name": "Stress_%s_%d" % (bus, i), "bus": bus, "can_id": base + i,
+                          "cycle": CYCLE_MS if i == 0 else 0})
+    return props
+
+
+def write_config(workdir, props):
+    entries = []
+    for p in props:
+        entry = ('\t\t{\n\t\t"PROPERTY": "%s",\n\t\t"TYPE": "uint32_t",\n\t\t"CANID": "%03X",\n'
+                 '\t\t"BIT_POSITION": "0",\n\t\t"BIT_SIZE": "32",\n\t\t"BYTE_ORDER": "intel",\n'
+                 '\t\t"DLC": "8",\n\t\t"BUS": "%s"' % (p["name"], p["can_id"], p["bus"]))
+        if p["cycle"]:
+            entry += ',\n\t\t"CYCLE": "%d"' % p["cycle"]
+        entries.append(entry + "\n\t\t}")
+    with open(os.path.join(workdir, "stress_map.json"), "w") as f:
+        f.write('{\n\t"PROPERTYS" : [\n%s\n\t]\n}\n' % ",\n".join(entries))
+    with open(os.path.join(workdir, "steering_wheel.json"), "w") as f:
+        f.write('{\n\t"wheel_map": "stress_map.json"\n}\n')
+    with open(os.path.join(workdir, "dev-mapping.conf"), "w") as f:
+        f.write('[CANbus-mapping]\n%s\n' % "\n".join('%s="%s"' % (bus, ifname) for bus, ifname, _ in BUSES))
+
+
+def parse_candump(path):
+    """returns {(ifname, can_id): [value, ...]} in receive order"""
+    frames = {}
+    with open(path) as f:
+        for line in f:
+            m = CANDUMP_RE.match(line)
+            if not m:
+                continue
+            data = bytes.fromhex(m.group(4))
+            if len(data) < 4:
+                continue
+            key = (m.group(2), int(m.group(3), 16))
+            frames.setdefault(key, []).append(int.from_bytes(data[:4], "little"))
+    return frames
+
+
+def parse_driver(output):
+    sent = {}
+    reports = {}
+    summary = ""
+    for line in output.splitlines():
+        if line.startswith("sent "):
+            _, name, val = line.split()
+            sent[name] = int(val)
+        elif line.startswith("updates "):
+            summary = line
+        m = REPORT_RE.search(line)
+        if m:
+            # counters are totals, the last report wins
+            reports[m.group(1)] = {k: int(v) for k, v in zip(
+                ("coalesced", "saturated", "retries", "superseded", "blocked_ms", "errors"), m.groups()[1:])}
+    return sent, reports, summary
+
+
+def check(props, frames, sent):
+    failures = []
+    ifname_of = {bus: ifname for bus, ifname, _ in BUSES}
+    for p in props:
+        values = frames.get((ifname_of[p["bus"]], p["can_id"]), [])
+        backwards = sum(1 for a, b in zip(values, values[1:]) if b < a)
+        distinct = len(set(values))
+        last = values[-1] if values else None
+        expected = sent.get(p["name"])
+        print("%-12s %s %03X frames:%-7d distinct values:%-7d skipped:%-7d backwards:%d last:%s sent:%s"
+              % (p["name"], ifname_of[p["bus"]], p["can_id"], len(values), distinct,
+                 (expected or 0) - distinct, backwards, last, expected))
+        if backwards:
+            failures.append("%s: %d values went backwards" % (p["name"], backwards))
+        if expected is None or last != expected:
+            failures.append("%s: last value %s, expected %s" % (p["name"], last, expected))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="vcan stress test of the CAN transmit path")
+    parser.add_argument("--driver", required=True, help="path of carla_can_driver")
+    parser.add_argument("--rate", type=int, default=2000, help="updates per second of every property")
+    parser.add_argument("--seconds", type=int, default=12,
+                        help="run time, at least 10 s for a bus report of the driver")
+    parser.add_argument("--limit-kbit", type=int, default=0,
+                        help="emulate a bus of this bit rate with a token bucket qdisc")
+    parser.add_argument("--expect-saturation", action="store_true",
+                        help="fail unless the driver reports saturation and superseded frames")
+    parser.add_argument("--keep-dir", action="store_true", help="keep the configuration and logs")
+    args = parser.parse_args()
+
+    if os.geteuid() != 0:
+        sys.stderr.write("vcan_stress: needs root to set up vcan0/vcan1\n")
+        return 2
+    if shutil.which("candump") is None:
+        sys.stderr.write("vcan_stress: candump (can-utils) not found\n")
+        return 2
+    driver = os.path.abspath(args.driver)
+
+    run(["modprobe", "vcan"], check=False)
+    for _, ifname, _ in BUSES:
+        setup_bus(ifname, args.limit_kbit)
+
+    props = properties()
+    workdir = tempfile.mkdtemp(prefix="vcan_stress.")
+    write_config(workdir, props)
+    dump_path = os.path.join(workdir, "candump.log")
+
+    with open(dump_path, "w") as dump:
+        candump = subprocess.Popen(["candump", "-L"] + [ifname for _, ifname, _ in BUSES], stdout=dump)
+        time.sleep(0.3)
+        env = dict(os.environ, USE_HMI_DEBUG="4")
+        result = subprocess.run([driver, str(args.rate), str(args.seconds)] + [p["name"] for p in props],
+                                cwd=workdir, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                universal_newlines=True)
+        time.sleep(0.3)
+        candump.send_signal(signal.SIGINT)
+        candump.wait()
+    with open(os.path.join(workdir, "driver.log"), "w") as f:
+        f.write(result.stdout)
+
+    if args.limit_kbit:
+        for _, ifname, _ in BUSES:
+            run(["tc", "qdisc", "del", "dev", ifname, "root"], check=False)
+
+    if result.returncode != 0:
+        sys.stderr.write(result.stdout)
+        sys.stderr.write("vcan_stress: driver failed with %d\n" % result.returncode)
+        return 1
+
+    sent, reports, summary = parse_driver(result.stdout)
+    print("driver: %s" % summary)
+    failures = check(props, parse_candump(dump_path), sent)
+    for bus, _, _ in BUSES:
+        r = reports.get(bus)
+        if r is None:
+            print("bus %s: no report" % bus)
+            continue
+        print("bus %s: coalesced:%d saturated:%d retries:%d superseded:%d blocked:%dms errors:%d"
+              % (bus, r["coalesced"], r["saturated"], r["retries"], r["superseded"], r["blocked_ms"], r["errors"]))
+    if args.expect_saturation:
+        if not any(r["saturated"] and r["retries"] for r in reports.values()):
+            failures.append("no saturation reported, lower --limit-kbit or raise --rate")
+        if not any(r["superseded"] for r in reports.values()):
+            failures.append("no superseded frames reported")
+
+    if args.keep_dir:
+        print("logs in %s" % workdir)
+    else:
+        shutil.rmtree(workdir)
+    for f in failures:
+        print("FAIL: %s" % f)
+    print("PASS" if not failures else "FAILED")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())